@@ -236,6 +236,7 @@ typedef struct transformer_state_t {
 	const char *dst_dir;            /* if non-NULL, extract to dir */
 	char     *dst_name;
 	uint64_t dst_size;
+	uint64_t dst_offset;            /* uncompressed offset to start from (seekable zstd, gzip) */
 	size_t   mem_output_size_max;   /* if non-zero, decompress to RAM instead of fd */
 	size_t   mem_output_size;
 	char     *mem_output_buf;
@@ -18,22 +18,8 @@
 typedef long long int(*unpacker_t)(transformer_state_t *xstate);
 
 /* Globals */
-smallint bb_got_signal;
-uint64_t bb_total_rb;
-printf_t bled_printf = NULL;
-read_t bled_read = NULL;
-write_t bled_write = NULL;
-progress_t bled_progress = NULL;
-switch_t bled_switch = NULL;
-unsigned long* bled_cancel_request;
-static bool bled_initialized = 0;
-jmp_buf bb_error_jmp;
-char* bb_virtual_buf = NULL;
-size_t bb_virtual_len = 0, bb_virtual_pos = 0;
-int bb_virtual_fd = -1;
-// ZSTD has a minimal buffer size of (1 << ZSTD_BLOCKSIZELOG_MAX) + ZSTD_blockHeaderSize = 128 KB + 3
-// So we set our bufsize to 256 KB
-uint32_t BB_BUFSIZE = 0x40000;
+BLED_TLS struct bled_ctx *bled_cur_ctx = NULL;
+static bled_ctx_t *bled_default_ctx = NULL;
 
 static long long int unpack_none(transformer_state_t *xstate)
 {
@@ -54,17 +40,11 @@ unpacker_t unpacker[BLED_COMPRESSION_MAX] = {
 	unpack_zstd_stream,
 };
 
-/* Uncompress file 'src', compressed using 'type', to file 'dst' */
-int64_t bled_uncompress(const char* src, const char* dst, int type)
+static int64_t uncompress(const char* src, const char* dst, int type)
 {
 	transformer_state_t xstate;
 	int64_t ret = -1;
 
-	if (!bled_initialized) {
-		bb_error_msg("The library has not been initialized");
-		return -1;
-	}
-
 	bb_total_rb = 0;
 	init_transformer_state(&xstate);
 	xstate.src_fd = -1;
@@ -87,10 +67,13 @@ int64_t bled_uncompress(const char* src, const char* dst, int type)
 		goto err;
 	}
 
-	if (setjmp(bb_error_jmp))
+	if (!bled_sink_start(xstate.dst_fd))
 		goto err;
 
-	ret = unpacker[type](&xstate);
+	if (setjmp(bb_error_jmp) == 0)
+		ret = unpacker[type](&xstate);
+	if (!bled_sink_finish())
+		ret = -1;
 
 err:
 	free(xstate.dst_name);
@@ -102,15 +85,10 @@ err:
 }
 
 #ifdef _WIN32
-/* Uncompress using Windows handles */
-int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
+static int64_t uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type, uint64_t offset)
 {
 	transformer_state_t xstate;
-
-	if (!bled_initialized) {
-		bb_error_msg("The library has not been initialized");
-		return -1;
-	}
+	int64_t ret = -1;
 
 	bb_total_rb = 0;
 	init_transformer_state(&xstate);
@@ -134,24 +112,28 @@ int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
 		return -1;
 	}
 
-	if (setjmp(bb_error_jmp))
+	if ((offset != 0) && (type != BLED_COMPRESSION_ZSTD) && (type != BLED_COMPRESSION_GZIP)) {
+		bb_error_msg("Starting at an offset is not supported for this compression format");
+		return -1;
+	}
+	xstate.dst_offset = offset;
+
+	if (!bled_sink_start(xstate.dst_fd))
 		return -1;
 
-	return unpacker[type](&xstate);
+	if (setjmp(bb_error_jmp) == 0)
+		ret = unpacker[type](&xstate);
+	if (!bled_sink_finish())
+		ret = -1;
+	return ret;
 }
 #endif
 
-/* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size' */
-int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int type)
+static int64_t uncompress_to_buffer(const char* src, char* buf, size_t size, int type)
 {
 	transformer_state_t xstate;
 	int64_t ret = -1;
 
-	if (!bled_initialized) {
-		bb_error_msg("The library has not been initialized");
-		return -1;
-	}
-
 	if ((src == NULL) || (buf == NULL)) {
 		bb_error_msg("Invalid parameter");
 		return -1;
@@ -193,17 +175,11 @@ err:
 	return ret;
 }
 
-/* Uncompress all files from archive 'src', compressed using 'type', to destination dir 'dir' */
-int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type)
+static int64_t uncompress_to_dir(const char* src, const char* dir, int type)
 {
 	transformer_state_t xstate;
 	int64_t ret = -1;
 
-	if (!bled_initialized) {
-		bb_error_msg("The library has not been initialized");
-		return -1;
-	}
-
 	bb_total_rb = 0;
 	init_transformer_state(&xstate);
 	xstate.src_fd = -1;
@@ -237,15 +213,10 @@ err:
 	return ret;
 }
 
-int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type)
+static int64_t uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type)
 {
 	int64_t ret;
 
-	if (!bled_initialized) {
-		bb_error_msg("The library has not been initialized");
-		return -1;
-	}
-
 	if ((src == NULL) || (dst == NULL)) {
 		bb_error_msg("Invalid parameter");
 		return -1;
@@ -261,7 +232,7 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 	bb_virtual_pos = 0;
 	bb_virtual_fd = 0;
 
-	ret = bled_uncompress_to_buffer("", dst, dst_len, type);
+	ret = uncompress_to_buffer("", dst, dst_len, type);
 
 	bb_virtual_buf = NULL;
 	bb_virtual_len = 0;
@@ -270,6 +241,189 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 	return ret;
 }
 
+
+/* Create a decompression context. The parameters are the same as the ones from bled_init() */
+bled_ctx_t* bled_ctx_create(uint32_t buffer_size, printf_t print_function, read_t read_function, write_t write_function,
+	progress_t progress_function, switch_t switch_function, unsigned long* cancel_request)
+{
+	bled_ctx_t* ctx = calloc(1, sizeof(bled_ctx_t));
+
+	if (ctx == NULL)
+		return NULL;
+	// ZSTD has a minimal buffer size of (1 << ZSTD_BLOCKSIZELOG_MAX) + ZSTD_blockHeaderSize = 128 KB + 3
+	// So we set our bufsize to 256 KB
+	ctx->bufsize = buffer_size;
+	/* buffer_size must be larger than 256 KB and a power of two */
+	if (buffer_size < 0x40000 || (buffer_size & (buffer_size - 1)) != 0) {
+		if (buffer_size != 0 && print_function != NULL)
+			print_function("bled_init: invalid buffer_size, defaulting to 64 KB");
+		ctx->bufsize = 0x40000;
+	}
+	ctx->virtual_fd = -1;
+	ctx->printf_function = print_function;
+	ctx->read_function = read_function;
+	ctx->write_function = write_function;
+	ctx->progress_function = progress_function;
+	ctx->switch_function = switch_function;
+	ctx->cancel_request = cancel_request;
+	return ctx;
+}
+
+/* Set up the asynchronous output of a context */
+int bled_ctx_set_async_output(bled_ctx_t* ctx, uint32_t nb_buffers, uint32_t buffer_size, uint32_t sector_size)
+{
+	if (ctx == NULL)
+		return -1;
+	if (nb_buffers != 0) {
+		/* sector_size must be a power of two, and buffer_size a multiple of it */
+		if ((nb_buffers < 2) || (sector_size == 0) || ((sector_size & (sector_size - 1)) != 0) ||
+			(buffer_size == 0) || (buffer_size % sector_size != 0) || (buffer_size > 1024 * 1024 * 1024))
+			return -1;
+	}
+	ctx->sink_nb_buffers = nb_buffers;
+	ctx->sink_buffer_size = buffer_size;
+	ctx->sink_sector_size = sector_size;
+	return 0;
+}
+
+int bled_ctx_set_discard(bled_ctx_t* ctx, discard_t discard_function)
+{
+	if (ctx == NULL)
+		return -1;
+	ctx->discard_function = discard_function;
+	return 0;
+}
+
+int bled_ctx_set_index(bled_ctx_t* ctx, const char* path, uint32_t span)
+{
+	char* index_path = NULL;
+
+	if ((ctx == NULL) || ((path != NULL) && (span == 0)))
+		return -1;
+	if (path != NULL) {
+		index_path = _strdup(path);
+		if (index_path == NULL)
+			return -1;
+	}
+	free(ctx->gz_index_path);
+	ctx->gz_index_path = index_path;
+	ctx->gz_index_span = span;
+	return 0;
+}
+
+/* Free a decompression context */
+void bled_ctx_destroy(bled_ctx_t* ctx)
+{
+	if (ctx == NULL)
+		return;
+	free(ctx->crc32_table);
+	free(ctx->gz_index_path);
+	free(ctx);
+}
+
+/*
+ * The bled_ctx_*() calls make 'ctx' the current context of the calling thread for the
+ * duration of the operation, and restore the previous one (if any) on exit.
+ */
+#define BLED_CTX_CALL(ctx, call) do {				\
+	struct bled_ctx* prev_ctx = bled_cur_ctx;		\
+	int64_t ret;						\
+	if ((ctx) == NULL) {					\
+		bb_error_msg("Invalid decompression context");	\
+		return -1;					\
+	}							\
+	bled_cur_ctx = (ctx);					\
+	ret = call;						\
+	bled_cur_ctx = prev_ctx;				\
+	return ret;						\
+} while (0)
+
+int64_t bled_ctx_uncompress(bled_ctx_t* ctx, const char* src, const char* dst, int type)
+{
+	BLED_CTX_CALL(ctx, uncompress(src, dst, type));
+}
+
+#ifdef _WIN32
+int64_t bled_ctx_uncompress_with_handles(bled_ctx_t* ctx, HANDLE hSrc, HANDLE hDst, int type)
+{
+	BLED_CTX_CALL(ctx, uncompress_with_handles(hSrc, hDst, type, 0));
+}
+
+int64_t bled_ctx_uncompress_with_handles_at(bled_ctx_t* ctx, HANDLE hSrc, HANDLE hDst, int type, uint64_t offset)
+{
+	BLED_CTX_CALL(ctx, uncompress_with_handles(hSrc, hDst, type, offset));
+}
+#endif
+
+int64_t bled_ctx_uncompress_to_buffer(bled_ctx_t* ctx, const char* src, char* buf, size_t size, int type)
+{
+	BLED_CTX_CALL(ctx, uncompress_to_buffer(src, buf, size, type));
+}
+
+int64_t bled_ctx_uncompress_to_dir(bled_ctx_t* ctx, const char* src, const char* dir, int type)
+{
+	BLED_CTX_CALL(ctx, uncompress_to_dir(src, dir, type));
+}
+
+int64_t bled_ctx_uncompress_from_buffer_to_buffer(bled_ctx_t* ctx, const char* src, const size_t src_len,
+	char* dst, size_t dst_len, int type)
+{
+	BLED_CTX_CALL(ctx, uncompress_from_buffer_to_buffer(src, src_len, dst, dst_len, type));
+}
+
+/*
+ * Legacy API, using a single process-wide context that is set up by bled_init().
+ */
+#define BLED_CHECK_INITIALIZED() do {					\
+	if (bled_default_ctx == NULL) {					\
+		bb_error_msg("The library has not been initialized");	\
+		return -1;						\
+	}								\
+} while (0)
+
+/* Uncompress file 'src', compressed using 'type', to file 'dst' */
+int64_t bled_uncompress(const char* src, const char* dst, int type)
+{
+	BLED_CHECK_INITIALIZED();
+	return bled_ctx_uncompress(bled_default_ctx, src, dst, type);
+}
+
+#ifdef _WIN32
+/* Uncompress using Windows handles */
+int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
+{
+	BLED_CHECK_INITIALIZED();
+	return bled_ctx_uncompress_with_handles(bled_default_ctx, hSrc, hDst, type);
+}
+
+/* Uncompress using Windows handles, starting at uncompressed offset 'offset' */
+int64_t bled_uncompress_with_handles_at(HANDLE hSrc, HANDLE hDst, int type, uint64_t offset)
+{
+	BLED_CHECK_INITIALIZED();
+	return bled_ctx_uncompress_with_handles_at(bled_default_ctx, hSrc, hDst, type, offset);
+}
+#endif
+
+/* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size' */
+int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int type)
+{
+	BLED_CHECK_INITIALIZED();
+	return bled_ctx_uncompress_to_buffer(bled_default_ctx, src, buf, size, type);
+}
+
+/* Uncompress all files from archive 'src', compressed using 'type', to destination dir 'dir' */
+int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type)
+{
+	BLED_CHECK_INITIALIZED();
+	return bled_ctx_uncompress_to_dir(bled_default_ctx, src, dir, type);
+}
+
+int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type)
+{
+	BLED_CHECK_INITIALIZED();
+	return bled_ctx_uncompress_from_buffer_to_buffer(bled_default_ctx, src, src_len, dst, dst_len, type);
+}
+
 /* Initialize the library.
  * When the parameters are not NULL or zero you can:
  * - specify the buffer size to use (must be larger than 256KB and a power of two)
@@ -285,35 +439,16 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 int bled_init(uint32_t buffer_size, printf_t print_function, read_t read_function, write_t write_function,
 	progress_t progress_function, switch_t switch_function, unsigned long* cancel_request)
 {
-	if (bled_initialized)
+	if (bled_default_ctx != NULL)
 		return -1;
-	BB_BUFSIZE = buffer_size;
-	/* buffer_size must be larger than 256 KB and a power of two */
-	if (buffer_size < 0x40000 || (buffer_size & (buffer_size - 1)) != 0) {
-		if (buffer_size != 0 && print_function != NULL)
-			print_function("bled_init: invalid buffer_size, defaulting to 64 KB");
-		BB_BUFSIZE = 0x40000;
-	}
-	bled_printf = print_function;
-	bled_read = read_function;
-	bled_write = write_function;
-	bled_progress = progress_function;
-	bled_switch = switch_function;
-	bled_cancel_request = cancel_request;
-	bled_initialized = true;
-	return 0;
+	bled_default_ctx = bled_ctx_create(buffer_size, print_function, read_function, write_function,
+		progress_function, switch_function, cancel_request);
+	return (bled_default_ctx == NULL) ? -1 : 0;
 }
 
 /* This call frees any resource used by the library */
 void bled_exit(void)
 {
-	bled_printf = NULL;
-	bled_progress = NULL;
-	bled_switch = NULL;
-	bled_cancel_request = NULL;
-	if (global_crc32_table) {
-		free(global_crc32_table);
-		global_crc32_table = NULL;
-	}
-	bled_initialized = false;
+	bled_ctx_destroy(bled_default_ctx);
+	bled_default_ctx = NULL;
 }
@@ -22,6 +22,7 @@ typedef void (*progress_t) (const uint64_t read_bytes);
 typedef int (*read_t)(int fd, void* buf, unsigned int count);
 typedef int (*write_t)(int fd, const void* buf, unsigned int count);
 typedef void (*switch_t)(const char* filename, const uint64_t size);
+typedef int (*discard_t)(int fd, uint64_t offset, uint64_t size);
 
 typedef enum {
 	BLED_COMPRESSION_NONE = 0,
@@ -43,6 +44,12 @@ int64_t bled_uncompress(const char* src, const char* dst, int type);
 /* Uncompress using Windows handles */
 #ifdef _WIN32
 int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type);
+
+/* Uncompress using Windows handles, starting at uncompressed offset 'offset'.
+ * This is only supported for zstd images that use the seekable format and for gzip
+ * images (which are only fast to start at an offset with an index, see bled_ctx_set_index()),
+ * and the destination handle must already be positioned at 'offset'. */
+int64_t bled_uncompress_with_handles_at(HANDLE hSrc, HANDLE hDst, int type, uint64_t offset);
 #endif
 
 /* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size' */
@@ -54,6 +61,50 @@ int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type);
 /* Uncompress buffer 'src' of length 'src_len' to buffer 'dst' of size 'dst_len' */
 int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type);
 
+/*
+ * Reentrant API: every call takes a context, created with bled_ctx_create(), so
+ * that multiple decompressions can run concurrently, one per thread and context.
+ * The calls above are wrappers around these, using a context set by bled_init().
+ */
+typedef struct bled_ctx bled_ctx_t;
+
+/* Create a decompression context. The parameters are the same as for bled_init() */
+bled_ctx_t* bled_ctx_create(uint32_t buffer_size, printf_t print_function, read_t read_function, write_t write_function,
+    progress_t progress_function, switch_t switch_function, unsigned long* cancel_request);
+
+/* Have the output of the bled_ctx_uncompress() and bled_ctx_uncompress_with_handles() calls
+ * go through 'nb_buffers' buffers of 'buffer_size' bytes, aligned to 'sector_size', that a
+ * separate thread writes, so that decompression doesn't have to wait for the target.
+ * All the writes are then a multiple of 'sector_size', except for the last one, for which the
+ * data is padded with zeroes up to 'sector_size', but the write function, if any, gets called
+ * with the actual size. Use 0 for 'nb_buffers' to go back to synchronous writes. */
+int bled_ctx_set_async_output(bled_ctx_t* ctx, uint32_t nb_buffers, uint32_t buffer_size, uint32_t sector_size);
+
+/* Have the areas of the target that a sparse image (VTSI) does not cover be discarded, through
+ * 'discard_function', which must return 0 on success, rather than left untouched. This only
+ * applies when no write function is set, as the segments are then written at their offset. */
+int bled_ctx_set_discard(bled_ctx_t* ctx, discard_t discard_function);
+
+/* Have gzip decompression maintain an index of access points in file 'path', with a point
+ * every 'span' bytes of uncompressed data, and use it to start at an offset without having to
+ * decode the image from the start. The index is created or extended by any pass over the
+ * image, including one that fails midway, and discarded if the image no longer matches it.
+ * Use NULL for 'path' to disable. */
+int bled_ctx_set_index(bled_ctx_t* ctx, const char* path, uint32_t span);
+
+/* Free a decompression context */
+void bled_ctx_destroy(bled_ctx_t* ctx);
+
+int64_t bled_ctx_uncompress(bled_ctx_t* ctx, const char* src, const char* dst, int type);
+#ifdef _WIN32
+int64_t bled_ctx_uncompress_with_handles(bled_ctx_t* ctx, HANDLE hSrc, HANDLE hDst, int type);
+int64_t bled_ctx_uncompress_with_handles_at(bled_ctx_t* ctx, HANDLE hSrc, HANDLE hDst, int type, uint64_t offset);
+#endif
+int64_t bled_ctx_uncompress_to_buffer(bled_ctx_t* ctx, const char* src, char* buf, size_t size, int type);
+int64_t bled_ctx_uncompress_to_dir(bled_ctx_t* ctx, const char* src, const char* dir, int type);
+int64_t bled_ctx_uncompress_from_buffer_to_buffer(bled_ctx_t* ctx, const char* src, const size_t src_len,
+    char* dst, size_t dst_len, int type);
+
 /* Initialize the library.
  * When the parameters are not NULL or zero you can:
  * - specify the buffer size to use (must be larger than 64KB and a power of two)
@@ -8,6 +8,34 @@
  */
 
 #include "libbb.h"
+#include "thread.h"
+
+#if (defined(_M_X64) || defined(__x86_64__))
+#define CPU_X86_64_CRC32                1
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#elif (defined(_M_ARM64) || defined(__aarch64__))
+#define CPU_ARM64_CRC32                 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32                     (1 << 7)
+#endif
+#endif
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define BLED_ENABLE_GCC_ARCH(arch)
+#else
+#define BLED_ENABLE_GCC_ARCH(arch) __attribute__ ((target (arch)))
+#endif
 
 #if __GNUC__ >= 3	/* 2.x has "attribute", but only 3.0 has "pure */
 #define attribute(x) __attribute__(x)
@@ -27,9 +55,6 @@
 #define CRCPOLY_LE 0xedb88320
 #define CRCPOLY_BE 0x04c11db7
 
-/* This needs to be defined somewhere */
-uint32_t *global_crc32_table;
-
 static void crc32init_le(uint32_t *crc32table_le)
 {
 	unsigned i, j;
@@ -45,15 +70,28 @@ static void crc32init_le(uint32_t *crc32table_le)
 	}
 }
 
-/**
- * crc32_le() - Calculate bitwise little-endian Ethernet AUTODIN II CRC32
- * @crc - seed value for computation.  ~0 for Ethernet, sometimes 0 for
- *        other uses, or the previous crc32 value if computing incrementally.
- * @p   - pointer to buffer over which CRC is run
- * @len - length of buffer @p
- * 
+/*
+ * Slicing-by-16: the little-endian table that crc32_filltable() provides holds 16
+ * sub-tables, where sub-table k gives the CRC of a byte followed by k zero bytes, so
+ * that 16 bytes of input can be folded into the CRC with 16 independent lookups.
  */
-uint32_t attribute((pure)) crc32_le(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_le)
+#define CRC_LE_SLICES 16
+
+static void crc32init_le_slices(uint32_t *crc32table_le)
+{
+	unsigned i, k;
+	uint32_t crc;
+
+	for (i = 0; i < 1 << CRC_LE_BITS; i++) {
+		crc = crc32table_le[i];
+		for (k = 1; k < CRC_LE_SLICES; k++) {
+			crc = (crc >> 8) ^ crc32table_le[crc & 255];
+			crc32table_le[(k << CRC_LE_BITS) + i] = crc;
+		}
+	}
+}
+
+static uint32_t attribute((pure)) crc32_le_bytes(uint32_t crc, unsigned char const *p, size_t len, const uint32_t *crc32table_le)
 {
 	while (len--) {
 # if CRC_LE_BITS == 8
@@ -73,6 +111,260 @@ uint32_t attribute((pure)) crc32_le(uint32_t crc, unsigned char const *p, size_t
 	return crc;
 }
 
+/* Assumes a little-endian host, like the rest of bled */
+static uint32_t attribute((pure)) crc32_le_slice16(uint32_t crc, unsigned char const *p, size_t len, const uint32_t *crc32table_le)
+{
+	const uint32_t (*t)[1 << CRC_LE_BITS] = (const uint32_t (*)[1 << CRC_LE_BITS])crc32table_le;
+	uint32_t w[4];
+
+	for (; len >= sizeof(w); len -= sizeof(w), p += sizeof(w)) {
+		memcpy(w, p, sizeof(w));
+		w[0] ^= crc;
+		crc = t[15][w[0] & 255] ^ t[14][(w[0] >> 8) & 255] ^ t[13][(w[0] >> 16) & 255] ^ t[12][w[0] >> 24] ^
+		      t[11][w[1] & 255] ^ t[10][(w[1] >> 8) & 255] ^ t[ 9][(w[1] >> 16) & 255] ^ t[ 8][w[1] >> 24] ^
+		      t[ 7][w[2] & 255] ^ t[ 6][(w[2] >> 8) & 255] ^ t[ 5][(w[2] >> 16) & 255] ^ t[ 4][w[2] >> 24] ^
+		      t[ 3][w[3] & 255] ^ t[ 2][(w[3] >> 8) & 255] ^ t[ 1][(w[3] >> 16) & 255] ^ t[ 0][w[3] >> 24];
+	}
+	return crc32_le_bytes(crc, p, len, crc32table_le);
+}
+
+#if defined(CPU_X86_64_CRC32)
+/*
+ * Carry-less multiplication folding, as described in Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction", with the bit-reflected constants for
+ * the CRC-32 polynomial. Processes len bytes, where len must be a multiple of 16 and at
+ * least 64, and works on the raw CRC register, like crc32_le() does.
+ */
+BLED_ENABLE_GCC_ARCH("pclmul,sse4.1")
+static uint32_t crc32_le_pclmul(uint32_t crc, unsigned char const *p, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	/* Fold 4 x 128 bits in parallel */
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	p += 64;
+	len -= 64;
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+		p += 64;
+		len -= 64;
+	}
+
+	/* Fold into 128 bits, then fold the remaining 128 bit blocks */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+		p += 16;
+		len -= 16;
+	}
+
+	/* Fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_and_si128(x1, mask32);
+	x0 = _mm_clmulepi64_si128(x0, poly, 0x10);
+	x0 = _mm_and_si128(x0, mask32);
+	x0 = _mm_clmulepi64_si128(x0, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x0);
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+/* PCLMULQDQ for the folding and SSE4.1 for the final extraction */
+static bool crc32_detect_pclmul(void)
+{
+#if defined(_MSC_VER)
+	int regs0[4] = { 0,0,0,0 }, regs1[4] = { 0,0,0,0 };
+	const int PCLMUL_BIT = 1 << 1;		/* Function 1, Bit  1 of ECX */
+	const int SSE41_BIT = 1 << 19;		/* Function 1, Bit 19 of ECX */
+
+	__cpuid(regs0, 0);
+	if (regs0[0] < 0x01)
+		return false;
+	__cpuidex(regs1, 1, 0);
+	return (regs1[2] & PCLMUL_BIT) && (regs1[2] & SSE41_BIT);
+#elif defined(__GNUC__) || defined(__clang__)
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#else
+	return false;
+#endif
+}
+#endif
+
+#if defined(CPU_ARM64_CRC32)
+/* The ARMv8 CRC32 instructions use the same polynomial and work on the raw CRC register */
+#if defined(__clang__)
+BLED_ENABLE_GCC_ARCH("crc")
+#else
+BLED_ENABLE_GCC_ARCH("+crc")
+#endif
+static uint32_t crc32_le_armv8(uint32_t crc, unsigned char const *p, size_t len)
+{
+	uint64_t w;
+
+	for (; len >= sizeof(w); len -= sizeof(w), p += sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		crc = __crc32d(crc, w);
+	}
+	while (len--)
+		crc = __crc32b(crc, *p++);
+	return crc;
+}
+
+/* Optional on ARMv8.0, mandatory from ARMv8.1 onwards */
+static bool crc32_detect_armv8(void)
+{
+#if defined(_WIN32)
+	return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE);
+#elif defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+	return false;
+#endif
+}
+#endif
+
+/* Below this size, the setup of the hardware kernels costs more than it saves */
+#define CRC_HW_MIN_SIZE 64
+
+enum {
+	CRC_KERNEL_NONE = 0,
+	CRC_KERNEL_SLICE16,
+	CRC_KERNEL_PCLMUL,
+	CRC_KERNEL_ARMV8,
+};
+
+static volatile LONG crc32_le_kernel = CRC_KERNEL_NONE;
+
+/*
+ * Check a hardware kernel against the table based computation, for a range of sizes and
+ * alignments, before we trust it with any actual data.
+ */
+static bool crc32_le_selftest(LONG kernel, const uint32_t *crc32table_le)
+{
+	unsigned char buf[512 + 16];
+	uint32_t crc, ref, seed = 0x2545F491;
+	size_t i, len;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (unsigned char)(seed >> 16);
+	}
+	for (len = 0; len <= sizeof(buf) - 16; len += 37) {
+		for (i = 0; i < 16; i += 5) {
+			ref = crc32_le_bytes(0xffffffff, &buf[i], len, crc32table_le);
+			crc = crc32_le_slice16(0xffffffff, &buf[i], len, crc32table_le);
+			if (crc != ref)
+				return false;
+			switch (kernel) {
+#if defined(CPU_X86_64_CRC32)
+			case CRC_KERNEL_PCLMUL:
+				if (len < CRC_HW_MIN_SIZE)
+					break;
+				crc = crc32_le_pclmul(0xffffffff, &buf[i], len & ~(size_t)15);
+				crc = crc32_le_slice16(crc, &buf[i + (len & ~(size_t)15)], len & 15, crc32table_le);
+				break;
+#endif
+#if defined(CPU_ARM64_CRC32)
+			case CRC_KERNEL_ARMV8:
+				crc = crc32_le_armv8(0xffffffff, &buf[i], len);
+				break;
+#endif
+			default:
+				break;
+			}
+			if (crc != ref)
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Select the fastest kernel for this CPU, once, after it has passed the self test */
+static void crc32_le_select(const uint32_t *crc32table_le)
+{
+	LONG kernel = CRC_KERNEL_SLICE16;
+
+	if (atomic_load_acquire(&crc32_le_kernel) != CRC_KERNEL_NONE)
+		return;
+#if defined(CPU_X86_64_CRC32)
+	if (crc32_detect_pclmul())
+		kernel = CRC_KERNEL_PCLMUL;
+#elif defined(CPU_ARM64_CRC32)
+	if (crc32_detect_armv8())
+		kernel = CRC_KERNEL_ARMV8;
+#endif
+	if (!crc32_le_selftest(kernel, crc32table_le))
+		kernel = CRC_KERNEL_SLICE16;
+	atomic_store_release(&crc32_le_kernel, kernel);
+}
+
+/**
+ * crc32_le() - Calculate bitwise little-endian Ethernet AUTODIN II CRC32
+ * @crc - seed value for computation.  ~0 for Ethernet, sometimes 0 for
+ *        other uses, or the previous crc32 value if computing incrementally.
+ * @p   - pointer to buffer over which CRC is run
+ * @len - length of buffer @p
+ * @crc32table_le - table obtained from crc32_filltable(NULL, 0)
+ * 
+ */
+uint32_t attribute((pure)) crc32_le(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_le)
+{
+	switch (atomic_load_acquire(&crc32_le_kernel)) {
+#if defined(CPU_X86_64_CRC32)
+	case CRC_KERNEL_PCLMUL:
+		if (len >= CRC_HW_MIN_SIZE) {
+			crc = crc32_le_pclmul(crc, p, len & ~(size_t)15);
+			p += len & ~(size_t)15;
+			len &= 15;
+		}
+		break;
+#endif
+#if defined(CPU_ARM64_CRC32)
+	case CRC_KERNEL_ARMV8:
+		return crc32_le_armv8(crc, p, len);
+#endif
+	default:
+		break;
+	}
+	return crc32_le_slice16(crc, p, len, crc32table_le);
+}
+
 /**
  * crc32init_be() - allocate and initialize BE table data
  */
@@ -117,16 +409,23 @@ uint32_t attribute((pure)) crc32_be(uint32_t crc, unsigned char const *p, size_t
 	return crc;
 }
 
+/*
+ * Note that a little-endian table holds CRC_LE_SLICES sub-tables, so a caller provided
+ * crc_table must be large enough for them when endian is 0.
+ */
 uint32_t* crc32_filltable(uint32_t *crc_table, int endian)
 {
 	/* Expects the caller to do the cleanup */
 	if (!crc_table)
-		crc_table = calloc(1 << CRC_LE_BITS, sizeof(uint32_t));
+		crc_table = calloc((endian ? 1 : CRC_LE_SLICES) << CRC_LE_BITS, sizeof(uint32_t));
 	if (crc_table) {
-		if (endian)
+		if (endian) {
 			crc32init_be(crc_table);
-		else
+		} else {
 			crc32init_le(crc_table);
+			crc32init_le_slices(crc_table);
+			crc32_le_select(crc_table);
+		}
 	}
 	return crc_table;
 }
@@ -40,6 +40,7 @@
  */
 #include "libbb.h"
 #include "bb_archive.h"
+#include "thread.h"
 
 #if 0
 # define dbg(...) bb_printf(__VA_ARGS__)
@@ -102,6 +103,9 @@ struct bunzip_data {
 	/* For I/O error handling */
 	jmp_buf *jmpbuf;
 
+	/* Stop after the current block (multithreaded decoding) */
+	smallint single_block;
+
 	/* Big things go last (register-relative addressing can be larger for big offsets) */
 	uint32_t crc32Table[256];
 	uint8_t selectors[32768];  /* nSelectors=15 bits */
@@ -652,6 +656,12 @@ static int read_bunzip(bunzip_data *bd, char *outbuf, int len)
 			bd->totalCRC = bd->headerCRC + 1;
 			return RETVAL_LAST_BLOCK;
 		}
+
+		/* The next block, if any, is someone else's */
+		if (bd->single_block) {
+			bd->writeCount = RETVAL_LAST_BLOCK;
+			return len;
+		}
 	}
 
 	/* Refill the intermediate buffer by Huffman-decoding next block of input */
@@ -755,19 +765,394 @@ static void FAST_FUNC dealloc_bunzip(bunzip_data *bd)
 }
 
 
+/*
+ * Multithreaded decompression, along the lines of lbzip2. The blocks of a bzip2 stream are
+ * independent, but they are neither byte aligned nor indexed, so we scan the input for the
+ * 48-bit magic that starts each block (or ends the stream), have a pool of workers, each
+ * with its own decoder, decompress the blocks, and write the decompressed data back in order.
+ * Since a magic can also turn up inside compressed data, a worker checks that its block ends
+ * exactly where the next one starts. If that isn't the case, or if a block fails to decode,
+ * we decode the stream again on a single thread, dropping the data we already wrote, which
+ * is rare enough, and means that actual errors get reported as usual.
+ */
+#define BZ2_MT_MAX_THREADS      8
+#define BZ2_MT_MAX_BUF_SIZE     (16 << 20)	/* Maximum size of the compressed data we scan */
+#define BZ2_MT_OUT_SIZE         (1 << 20)	/* Initial size of the output of a block */
+#define BZ2_MT_MAGIC_SIZE       48
+#define BZ2_MT_MAGIC_MASK       0xffffffffffffULL
+#define BZ2_MT_BLOCK_MAGIC      0x314159265359ULL
+#define BZ2_MT_EOS_MAGIC        0x177245385090ULL
+
+typedef struct {
+	uint8_t *in;		/* compressed block, from the byte that holds its first bit */
+	size_t in_size;
+	size_t in_max;
+	uint64_t nb_bits;	/* size of the block, up to the next magic */
+	uint32_t bit_offset;	/* position of the block magic in the first byte */
+	uint32_t block_size;
+	uint8_t *out;
+	size_t out_size;
+	size_t out_max;
+	uint32_t crc;
+	bool busy;		/* only used by the main thread */
+	volatile LONG done;
+	int ret;
+} bz2_mt_job_t;
+
+typedef struct {
+	int src_fd;
+	uint8_t *buf;		/* compressed data being scanned */
+	size_t buf_size;
+	size_t buf_max;
+	uint64_t buf_pos;	/* source offset of buf[0], from where we started */
+	bunzip_data **bd;	/* One decoder per worker */
+	bz2_mt_job_t *job;
+	uint32_t nb_jobs;
+	uint32_t total_crc;
+	bool fallback;		/* set if we must start over on a single thread */
+	struct bled_ctx *ctx;
+	pool_t pool;
+} bz2_mt_t;
+
+static BOOL bz2_mt_decode(void *context, uint32_t worker, void *_job)
+{
+	bz2_mt_t *mt = (bz2_mt_t *)context;
+	bz2_mt_job_t *job = (bz2_mt_job_t *)_job;
+	bunzip_data *bd = mt->bd[worker];
+	jmp_buf jmpbuf;
+	uint8_t *out;
+	int r, len;
+
+	bled_cur_ctx = mt->ctx;
+	bd->jmpbuf = &jmpbuf;
+	bd->inbuf = job->in;
+	bd->inbufCount = (int)job->in_size;
+	bd->inbufPos = 0;
+	bd->inbufBitCount = 0;
+	bd->inbufBits = 0;
+	bd->dbufSize = job->block_size;
+	bd->writeCopies = 0;
+	bd->writeCount = 0;
+	job->out_size = 0;
+
+	r = setjmp(jmpbuf);
+	if (r == 0) {
+		if (job->bit_offset != 0)
+			get_bits(bd, job->bit_offset);
+		do {
+			if (job->out_size == job->out_max) {
+				out = realloc(job->out, 2 * job->out_max);
+				if (out == NULL) {
+					r = RETVAL_OUT_OF_MEMORY;
+					break;
+				}
+				job->out = out;
+				job->out_max *= 2;
+			}
+			len = (int)MIN(job->out_max - job->out_size, INT_MAX);
+			r = read_bunzip(bd, (char *)&job->out[job->out_size], len);
+			if (r < 0)
+				break;
+			job->out_size += len - r;
+		} while (bd->writeCount >= 0);
+	}
+	/* A block that doesn't end right before the next magic was not delimited properly */
+	if ((r >= 0) && ((uint64_t)bd->inbufPos * 8 - bd->inbufBitCount - job->bit_offset != job->nb_bits))
+		r = RETVAL_DATA_ERROR;
+	job->crc = bd->writeCRC;
+	job->ret = (r < 0) ? r : RETVAL_OK;
+	atomic_store_release(&job->done, TRUE);
+	return (job->ret == RETVAL_OK);
+}
+
+/* Wait for a job to complete and write its data */
+static bool bz2_mt_flush(transformer_state_t *xstate, bz2_mt_t *mt, bz2_mt_job_t *job, long long *n)
+{
+	size_t pos, size;
+	ssize_t nwrote;
+
+	mutex_lock(&mt->pool.lock);
+	while (!atomic_load_acquire(&job->done))
+		cond_wait(&mt->pool.done_cond, &mt->pool.lock, 100);
+	mutex_unlock(&mt->pool.lock);
+	job->busy = false;
+	if (job->ret == RETVAL_OUT_OF_MEMORY) {
+		bb_error_msg("memory allocation error");
+		return false;
+	}
+	if (job->ret != RETVAL_OK) {
+		mt->fallback = true;
+		return false;
+	}
+	mt->total_crc = ((mt->total_crc << 1) | (mt->total_crc >> 31)) ^ job->crc;
+	for (pos = 0; pos < job->out_size; pos += size) {
+		size = MIN(job->out_size - pos, BB_BUFSIZE);
+		nwrote = transformer_write(xstate, &job->out[pos], size);
+		if (nwrote < 0) {
+			bb_error_msg("write error (errno: %d)", errno);
+			return false;
+		}
+		*n += nwrote;
+	}
+	return true;
+}
+
+/* Write all the blocks we have in flight */
+static bool bz2_mt_flush_all(transformer_state_t *xstate, bz2_mt_t *mt, uint32_t next, long long *n)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < mt->nb_jobs; i++) {
+		j = (next + i) % mt->nb_jobs;
+		if (mt->job[j].busy && !bz2_mt_flush(xstate, mt, &mt->job[j], n))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Make sure that the scan buffer holds the source data up to offset 'end', while keeping
+ * the data from offset 'keep'. Returns false on error, or if the source is too short.
+ */
+static bool bz2_mt_fill(bz2_mt_t *mt, uint64_t keep, uint64_t end)
+{
+	uint8_t *buf;
+	size_t size;
+	int r;
+
+	while (mt->buf_pos + mt->buf_size < end) {
+		if (mt->buf_size == mt->buf_max) {
+			size = (size_t)(keep - mt->buf_pos);
+			if (size != 0) {
+				memmove(mt->buf, &mt->buf[size], mt->buf_size - size);
+				mt->buf_size -= size;
+				mt->buf_pos = keep;
+			} else {
+				/* A block that doesn't fit in our maximum buffer size isn't a valid one */
+				if (mt->buf_max >= BZ2_MT_MAX_BUF_SIZE) {
+					mt->fallback = true;
+					return false;
+				}
+				buf = realloc(mt->buf, 2 * mt->buf_max);
+				if (buf == NULL) {
+					bb_error_msg("memory allocation error");
+					return false;
+				}
+				mt->buf = buf;
+				mt->buf_max *= 2;
+			}
+		}
+		r = safe_read(mt->src_fd, &mt->buf[mt->buf_size], (unsigned int)MIN(mt->buf_max - mt->buf_size, BB_BUFSIZE));
+		if (r < 0) {
+			bb_error_msg("read error (errno: %d)", errno);
+			return false;
+		}
+		if (r == 0) {
+			mt->fallback = true;
+			return false;
+		}
+		mt->buf_size += r;
+	}
+	return true;
+}
+
+/* Get 'nb' bits (up to 25), from bit 'pos' of the source, which must be in the scan buffer */
+static uint32_t bz2_mt_get_bits(bz2_mt_t *mt, uint64_t pos, uint32_t nb)
+{
+	uint32_t i, v = 0, nb_bytes = (uint32_t)(((pos & 7) + nb + 7) >> 3);
+
+	for (i = 0; i < nb_bytes; i++)
+		v = (v << 8) | mt->buf[(pos >> 3) + i - mt->buf_pos];
+	return (v >> (nb_bytes * 8 - nb - (pos & 7))) & ((1U << nb) - 1);
+}
+
+static IF_DESKTOP(long long) int FAST_FUNC unpack_bz2_stream_mt(transformer_state_t *xstate, bz2_mt_t *mt,
+	uint32_t nb_workers)
+{
+	long long n = 0;
+	bz2_mt_job_t *job;
+	uint64_t reg = 0, pos, magic, start = 0, end = 0;
+	uint64_t stream, data;	/* offsets of the stream header and of its data */
+	uint32_t i, k, crc, block_size, next = 0;
+	bool found, has_block, ret = false;
+
+	mt->ctx = bled_cur_ctx;
+	mt->src_fd = xstate->src_fd;
+	mt->buf_max = 4 * BB_BUFSIZE;
+	mt->buf = xmalloc(mt->buf_max);
+	mt->nb_jobs = 2 * nb_workers;
+	mt->bd = xzalloc(nb_workers * sizeof(bunzip_data *));
+	mt->job = xzalloc(mt->nb_jobs * sizeof(bz2_mt_job_t));
+	if ((mt->buf == NULL) || (mt->bd == NULL) || (mt->job == NULL))
+		bb_error_msg_and_err("memory allocation error");
+	for (i = 0; i < nb_workers; i++) {
+		mt->bd[i] = xzalloc(sizeof(bunzip_data));
+		if (mt->bd[i] == NULL)
+			bb_error_msg_and_err("memory allocation error");
+		mt->bd[i]->in_fd = -1;
+		mt->bd[i]->single_block = 1;
+		mt->bd[i]->dbuf = xmalloc(900000 * sizeof(uint32_t));
+		if (mt->bd[i]->dbuf == NULL)
+			bb_error_msg_and_err("memory allocation error");
+		crc32_filltable(mt->bd[i]->crc32Table, 1);
+	}
+	for (i = 0; i < mt->nb_jobs; i++) {
+		mt->job[i].out_max = BZ2_MT_OUT_SIZE;
+		mt->job[i].out = xmalloc(mt->job[i].out_max);
+		if (mt->job[i].out == NULL)
+			bb_error_msg_and_err("memory allocation error");
+	}
+	if (!pool_create(&mt->pool, nb_workers, mt->nb_jobs, bz2_mt_decode, mt))
+		bb_error_msg_and_err("could not create decompression threads");
+
+	/* The caller already read the "BZ" of the first stream */
+	stream = 0;
+	while (1) { /* "Process one BZ... stream" loop */
+		if (!bz2_mt_fill(mt, stream, stream + 2))
+			goto err;
+		k = mt->buf[stream + 1 - mt->buf_pos];
+		if ((mt->buf[stream - mt->buf_pos] != 'h') || (k < '1') || (k > '9')) {
+			mt->fallback = true;
+			goto err;
+		}
+		block_size = 100000 * (k - '0');
+		data = stream + 2;
+		found = has_block = false;
+		mt->total_crc = 0;
+
+		/* Look for a magic at each bit position, and queue the data between two of them */
+		for (pos = data; ; pos++) {
+			if (!bz2_mt_fill(mt, has_block ? (start >> 3) : pos, pos + 1))
+				goto err;
+			reg = (reg << 8) | mt->buf[pos - mt->buf_pos];
+			for (k = 8; k-- > 0; ) {
+				magic = (reg >> k) & BZ2_MT_MAGIC_MASK;
+				if ((magic != BZ2_MT_BLOCK_MAGIC) && (magic != BZ2_MT_EOS_MAGIC))
+					continue;
+				end = (pos + 1) * 8 - k - BZ2_MT_MAGIC_SIZE;
+				if ((end < data * 8) || (found && (end < start + BZ2_MT_MAGIC_SIZE)))
+					continue;
+				/* The first block must immediately follow the stream header */
+				if (!found && (end != data * 8)) {
+					mt->fallback = true;
+					goto err;
+				}
+				found = true;
+				if (has_block) {
+					/* Queue the block, along with the magic that follows it */
+					job = &mt->job[next];
+					if (job->busy && !bz2_mt_flush(xstate, mt, job, &n))
+						goto err;
+					job->in_size = (size_t)(((end + BZ2_MT_MAGIC_SIZE + 7) >> 3) - (start >> 3));
+					if (job->in_size > job->in_max) {
+						free(job->in);
+						job->in = xmalloc(job->in_size);
+						if (job->in == NULL)
+							bb_error_msg_and_err("memory allocation error");
+						job->in_max = job->in_size;
+					}
+					memcpy(job->in, &mt->buf[(start >> 3) - mt->buf_pos], job->in_size);
+					job->bit_offset = (uint32_t)(start & 7);
+					job->nb_bits = end - start;
+					job->block_size = block_size;
+					job->done = FALSE;
+					job->busy = true;
+					if (!pool_submit(&mt->pool, job))
+						bb_error_msg_and_err("could not queue block");
+					next = (next + 1) % mt->nb_jobs;
+				}
+				start = end;
+				has_block = (magic == BZ2_MT_BLOCK_MAGIC);
+				if (!has_block)
+					break;
+			}
+			if (found && !has_block)
+				break;
+		}
+
+		/* End of stream magic: check the combined crc that follows it */
+		end += BZ2_MT_MAGIC_SIZE;
+		if (!bz2_mt_fill(mt, end >> 3, (end + 32 + 7) >> 3) || !bz2_mt_flush_all(xstate, mt, next, &n))
+			goto err;
+		crc = (bz2_mt_get_bits(mt, end, 16) << 16) | bz2_mt_get_bits(mt, end + 16, 16);
+		if (crc != mt->total_crc) {
+			mt->fallback = true;
+			goto err;
+		}
+
+		/* Do we have "BZ..." after the end of the stream (pbzip2)? */
+		stream = (end + 32 + 7) >> 3;
+		if (!bz2_mt_fill(mt, stream, stream + 2)) {
+			if (!mt->fallback)
+				goto err;
+			/* Not enough data for another stream */
+			mt->fallback = false;
+			break;
+		}
+		if ((mt->buf[stream - mt->buf_pos] != 'B') || (mt->buf[stream + 1 - mt->buf_pos] != 'Z'))
+			break;
+		stream += 2;
+	}
+	ret = true;
+
+err:
+	/* This waits for the blocks that are still being decoded */
+	pool_destroy(&mt->pool);
+	for (i = 0; (mt->job != NULL) && (i < mt->nb_jobs); i++) {
+		free(mt->job[i].in);
+		free(mt->job[i].out);
+	}
+	free(mt->job);
+	for (i = 0; (mt->bd != NULL) && (i < nb_workers); i++) {
+		if (mt->bd[i] != NULL)
+			free(mt->bd[i]->dbuf);
+		free(mt->bd[i]);
+	}
+	free(mt->bd);
+	free(mt->buf);
+	return (ret || mt->fallback) ? n : -1;
+}
+
 /* Decompress src_fd to dst_fd.  Stops at end of bzip data, not end of file. */
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_bz2_stream(transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long total_written = 0;)
 	bunzip_data *bd;
+	bz2_mt_t mt = { 0 };
 	char *outbuf;
 	int i, nwrote;
-	unsigned len;
+	unsigned len, skip;
+	uint32_t nb_workers;
+	uint64_t dropped = 0;
+	off_t start;
 
 	if (check_signature16(xstate, BZIP2_MAGIC))
 		return -1;
 
+	/*
+	 * Use multithreaded decompression as long as we can seek the source, to start over if
+	 * needed, and the output doesn't go to memory.
+	 */
+	nb_workers = MIN(get_cpu_count(), BZ2_MT_MAX_THREADS);
+	if ((nb_workers > 1) && (xstate->mem_output_size_max == 0) &&
+	    (bled_read == NULL) && (xstate->src_fd != bb_virtual_fd)) {
+		start = lseek(xstate->src_fd, 0, SEEK_CUR);
+		if (start != (off_t)-1) {
+			IF_DESKTOP(total_written =) unpack_bz2_stream_mt(xstate, &mt, nb_workers);
+			if (!mt.fallback)
+				return IF_DESKTOP(total_written) + 0;
+			bb_printf("Notice: Could not decompress the bzip2 data on multiple threads, retrying on one thread");
+			if (lseek(xstate->src_fd, start, SEEK_SET) != start) {
+				bb_error_msg("seek error (errno: %d)", errno);
+				return -1;
+			}
+			/* Drop the data that we already wrote */
+			dropped = IF_DESKTOP(total_written) + 0;
+			IF_DESKTOP(total_written = 0;)
+		}
+	}
+
 	outbuf = xmalloc(IOBUF_SIZE);
 	if (outbuf == NULL)
 		return -1;
@@ -788,8 +1173,10 @@ unpack_bz2_stream(transformer_state_t *xstate)
 				i = IOBUF_SIZE - i; /* number of bytes produced */
 				if (i == 0) /* EOF? */
 					break;
-				nwrote = (int)transformer_write(xstate, outbuf, i);
-				if (nwrote != i) {
+				skip = (unsigned)MIN(dropped, (unsigned)i);
+				dropped -= skip;
+				nwrote = (skip == (unsigned)i) ? 0 : (int)transformer_write(xstate, &outbuf[skip], i - skip);
+				if (nwrote != i - (int)skip) {
 					i = (nwrote == -ENOSPC)?(int)xstate->mem_output_size_max:RETVAL_SHORT_WRITE;
 					goto release_mem;
 				}
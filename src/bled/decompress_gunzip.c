@@ -55,6 +55,47 @@ enum {
 	N_MAX = 288,	/* maximum number of codes in any set */
 };
 
+/*
+ * Random access index, along the lines of zlib's zran.c
+ *
+ * When a context has an index file set, gunzip records an access point at the first block
+ * boundary after every 'span' bytes of output: the position in the source, the content of
+ * the bit buffer, the crc and length of the member so far and the last 32 KB of output,
+ * which is all deflate needs to carry on from there. A later call that needs to start at
+ * an uncompressed offset can then resume from the closest point, instead of decoding the
+ * image from the start. The points are appended to the file as they are created, so that
+ * an interrupted pass still leaves a usable index behind, which the next pass extends.
+ */
+#define GZ_INDEX_MAGIC          "BLEDGZI1"
+#define GZ_INDEX_WSIZE          (32 * 1024)
+#define GZ_INDEX_RECORD_SIZE    (sizeof(gz_point_t) + GZ_INDEX_WSIZE)
+
+typedef struct {
+	char magic[8];
+	uint64_t src_size;	/* size of the compressed image */
+	uint32_t src_trailer[2];	/* crc and length of its last member */
+	uint32_t span;
+	uint32_t nb_points;
+} gz_index_header_t;
+
+/* Each point is followed by GZ_INDEX_WSIZE bytes of window in the index file */
+typedef struct {
+	uint64_t out;		/* uncompressed offset */
+	uint64_t in;		/* offset of the next byte to read from the source */
+	uint64_t member_out;	/* uncompressed offset from the start of the member */
+	uint32_t crc;		/* crc of the member data up to 'out' */
+	uint32_t bb;		/* bit buffer */
+	uint32_t bk;		/* bits in bit buffer */
+	uint32_t reserved;
+} gz_point_t;
+
+typedef struct gz_index {
+	int fd;
+	gz_index_header_t hdr;
+	uint64_t last_out;	/* uncompressed offset of the last point */
+	uint8_t *record;	/* point + window */
+} gz_index_t;
+
 
 /* This is somewhat complex-looking arrangement, but it allows
  * to place decompressor state either in bss or in
@@ -116,6 +157,12 @@ typedef struct state_t {
 	unsigned inflate_stored_k;
 	unsigned inflate_stored_w;
 
+	/* private data of the random access index (gunzip only) */
+	struct gz_index *gunzip_index;
+	uint64_t gunzip_member_base; /* uncompressed offset of the current member */
+	uint64_t gunzip_skip; /* output bytes to drop, to start at an offset */
+	uint8_t *gunzip_resume; /* access point to restart the member from */
+
 	const char *error_msg;
 	jmp_buf error_jmp;
 } state_t;
@@ -153,6 +200,10 @@ typedef struct state_t {
 #define inflate_stored_b    (S()inflate_stored_b   )
 #define inflate_stored_k    (S()inflate_stored_k   )
 #define inflate_stored_w    (S()inflate_stored_w   )
+#define gunzip_index        (S()gunzip_index       )
+#define gunzip_member_base  (S()gunzip_member_base )
+#define gunzip_skip         (S()gunzip_skip        )
+#define gunzip_resume       (S()gunzip_resume      )
 #define error_msg           (S()error_msg          )
 #define error_jmp           (S()error_jmp          )
 
@@ -964,6 +1015,92 @@ static void calculate_gunzip_crc(STATE_PARAM_ONLY)
 	gunzip_bytes_out += gunzip_outbuf_count;
 }
 
+static bool gz_index_pread(int fd, void *buf, size_t size, off_t offset)
+{
+	int r;
+	size_t pos;
+
+	if (lseek(fd, offset, SEEK_SET) != offset)
+		return false;
+	for (pos = 0; pos < size; pos += r) {
+		r = _read(fd, (uint8_t *)buf + pos, (unsigned int)(size - pos));
+		if (r <= 0)
+			return false;
+	}
+	return true;
+}
+
+static bool gz_index_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+	int w;
+	size_t pos;
+
+	if (lseek(fd, offset, SEEK_SET) != offset)
+		return false;
+	for (pos = 0; pos < size; pos += w) {
+		w = _write(fd, (const uint8_t *)buf + pos, (unsigned int)(size - pos));
+		if (w <= 0)
+			return false;
+	}
+	return true;
+}
+
+static off_t gz_index_record_offset(uint32_t i)
+{
+	return (off_t)(sizeof(gz_index_header_t) + (uint64_t)i * GZ_INDEX_RECORD_SIZE);
+}
+
+static void gz_index_close(gz_index_t *index)
+{
+	if (index == NULL)
+		return;
+	if (index->fd >= 0)
+		_close(index->fd);
+	free(index->record);
+	free(index);
+}
+
+/* Called at block boundaries, to add an access point if we are 'span' bytes past the last one */
+static void gz_index_add_point(STATE_PARAM_ONLY)
+{
+	gz_index_t *index = gunzip_index;
+	gz_point_t *pt = (gz_point_t *)index->record;
+	uint64_t out = gunzip_member_base + gunzip_bytes_out + gunzip_outbuf_count;
+	unsigned w, size;
+	off_t pos;
+
+	if (out < index->last_out + index->hdr.span)
+		return;
+	pos = lseek(gunzip_src_fd, 0, SEEK_CUR);
+	if (pos == (off_t)-1)
+		goto err;
+	pt->out = out;
+	pt->in = pos - (bytebuffer_size - bytebuffer_offset);
+	pt->member_out = gunzip_bytes_out + gunzip_outbuf_count;
+	/* The data of the current window has not been accounted for yet */
+	pt->crc = crc32_block_endian0(gunzip_crc, gunzip_window, gunzip_outbuf_count, gunzip_crc_table);
+	pt->bb = gunzip_bb;
+	pt->bk = gunzip_bk;
+	pt->reserved = 0;
+	/* Save the last 32 KB of output, that end at the current (circular) window position */
+	w = (gunzip_outbuf_count - GZ_INDEX_WSIZE) & (GUNZIP_WSIZE - 1);
+	size = MIN(GUNZIP_WSIZE - w, GZ_INDEX_WSIZE);
+	memcpy(&index->record[sizeof(gz_point_t)], &gunzip_window[w], size);
+	memcpy(&index->record[sizeof(gz_point_t) + size], gunzip_window, GZ_INDEX_WSIZE - size);
+	/* Write the point before the header that accounts for it */
+	index->hdr.nb_points++;
+	if (!gz_index_pwrite(index->fd, index->record, GZ_INDEX_RECORD_SIZE, gz_index_record_offset(index->hdr.nb_points - 1)) ||
+	    !gz_index_pwrite(index->fd, &index->hdr, sizeof(index->hdr), 0))
+		goto err;
+	index->last_out = out;
+	return;
+
+err:
+	bb_printf("Notice: Could not update the gzip index (errno: %d)", errno);
+	gz_index_close(index);
+	gunzip_index = NULL;
+}
+
 /* One callsite in inflate_unzip_internal */
 static int inflate_get_next_window(STATE_PARAM_ONLY)
 {
@@ -979,6 +1116,8 @@ static int inflate_get_next_window(STATE_PARAM_ONLY)
 				/* NB: need_another_block is still set */
 				return 0; /* Last block */
 			}
+			if (gunzip_index != NULL)
+				gz_index_add_point(PASS_STATE_ONLY);
 			method = inflate_block(PASS_STATE &end_reached);
 			need_another_block = 0;
 		}
@@ -1028,6 +1167,17 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 	gunzip_crc_table = crc32_filltable(NULL, 0);
 	gunzip_crc = ~0;
 
+	if (gunzip_resume != NULL) {
+		/* Restart from an access point, with its history at the end of the window */
+		gz_point_t *pt = (gz_point_t *)gunzip_resume;
+		memcpy(&gunzip_window[GUNZIP_WSIZE - GZ_INDEX_WSIZE], &gunzip_resume[sizeof(gz_point_t)], GZ_INDEX_WSIZE);
+		gunzip_bb = pt->bb;
+		gunzip_bk = (unsigned char)pt->bk;
+		gunzip_crc = pt->crc;
+		gunzip_bytes_out = pt->member_out;
+		gunzip_resume = NULL;
+	}
+
 	error_msg = "corrupted data";
 	if (setjmp(error_jmp)) {
 		/* Error from deep inside zip machinery */
@@ -1038,8 +1188,13 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 
 	while (1) {
 		int r = inflate_get_next_window(PASS_STATE_ONLY);
-		nwrote = transformer_write(xstate, gunzip_window, gunzip_outbuf_count);
-		if (nwrote != (ssize_t)gunzip_outbuf_count) {
+		/* Drop the data that comes before the offset we were asked to start at */
+		unsigned skip = (unsigned)MIN(gunzip_skip, gunzip_outbuf_count);
+		gunzip_skip -= skip;
+		nwrote = 0;
+		if (gunzip_outbuf_count > skip)
+			nwrote = transformer_write(xstate, &gunzip_window[skip], gunzip_outbuf_count - skip);
+		if (nwrote != (ssize_t)(gunzip_outbuf_count - skip)) {
 			huft_free_all(PASS_STATE_ONLY);
 			n = (nwrote <0)?nwrote:-1;
 			goto ret;
@@ -1233,6 +1388,66 @@ static int check_header_gzip(STATE_PARAM transformer_state_t *xstate)
 	return 1;
 }
 
+/* Open the index of the current context, and reuse its points if it was created for the same image */
+static gz_index_t *gz_index_open(int src_fd)
+{
+	gz_index_t *index;
+	gz_index_header_t hdr;
+	gz_point_t *pt;
+	off_t cur, end;
+
+	index = xzalloc(sizeof(gz_index_t));
+	if (index == NULL)
+		return NULL;
+	index->fd = -1;
+	index->record = xmalloc(GZ_INDEX_RECORD_SIZE);
+	memcpy(index->hdr.magic, GZ_INDEX_MAGIC, sizeof(index->hdr.magic));
+	index->hdr.span = bled_cur_ctx->gz_index_span;
+	cur = lseek(src_fd, 0, SEEK_CUR);
+	end = lseek(src_fd, 0, SEEK_END);
+	if ((index->record == NULL) || (cur == (off_t)-1) || (end < 8) ||
+	    !gz_index_pread(src_fd, index->hdr.src_trailer, sizeof(index->hdr.src_trailer), end - 8) ||
+	    (lseek(src_fd, cur, SEEK_SET) != cur))
+		goto err;
+	index->hdr.src_size = end;
+
+	index->fd = _openU(bled_cur_ctx->gz_index_path, _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+	if (index->fd < 0) {
+		bb_printf("Notice: Could not open gzip index '%s' (errno: %d)", bled_cur_ctx->gz_index_path, errno);
+		goto err;
+	}
+	if (gz_index_pread(index->fd, &hdr, sizeof(hdr), 0) &&
+	    (memcmp(&hdr, &index->hdr, offsetof(gz_index_header_t, nb_points)) == 0) && (hdr.nb_points != 0) &&
+	    gz_index_pread(index->fd, index->record, sizeof(gz_point_t), gz_index_record_offset(hdr.nb_points - 1))) {
+		pt = (gz_point_t *)index->record;
+		index->hdr.nb_points = hdr.nb_points;
+		index->last_out = pt->out;
+	} else if (!gz_index_pwrite(index->fd, &index->hdr, sizeof(index->hdr), 0)) {
+		bb_printf("Notice: Could not create gzip index '%s' (errno: %d)", bled_cur_ctx->gz_index_path, errno);
+		goto err;
+	}
+	return index;
+
+err:
+	gz_index_close(index);
+	return NULL;
+}
+
+/* Load the last point at or before uncompressed offset 'offset', if any, into the index record */
+static bool gz_index_find(gz_index_t *index, uint64_t offset)
+{
+	gz_point_t *pt = (gz_point_t *)index->record;
+	uint32_t i;
+
+	for (i = index->hdr.nb_points; i > 0; i--) {
+		if (!gz_index_pread(index->fd, pt, sizeof(gz_point_t), gz_index_record_offset(i - 1)))
+			return false;
+		if (pt->out <= offset)
+			return gz_index_pread(index->fd, index->record, GZ_INDEX_RECORD_SIZE, gz_index_record_offset(i - 1));
+	}
+	return false;
+}
+
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_gz_stream(transformer_state_t *xstate)
 {
@@ -1253,6 +1468,10 @@ unpack_gz_stream(transformer_state_t *xstate)
 			return -1;
 		}
 		if (magic2 == COMPRESS_MAGIC) {
+			if (xstate->dst_offset != 0) {
+				bb_simple_error_msg("starting at an offset is not supported for .Z images");
+				return -1;
+			}
 			xstate->signature_skipped = 2;
 			return unpack_Z_stream(xstate);
 		}
@@ -1277,6 +1496,26 @@ unpack_gz_stream(transformer_state_t *xstate)
 	}
 	gunzip_src_fd = xstate->src_fd;
 
+	/* The index needs a source that we can seek and an output that isn't memory */
+	if ((bled_cur_ctx->gz_index_path != NULL) && (xstate->mem_output_size_max == 0) &&
+	    (bled_read == NULL) && (xstate->src_fd != bb_virtual_fd))
+		gunzip_index = gz_index_open(xstate->src_fd);
+
+	/* Without an access point before the offset, we decode from the start and drop the data */
+	gunzip_skip = xstate->dst_offset;
+	if ((xstate->dst_offset != 0) && (gunzip_index != NULL) && gz_index_find(gunzip_index, xstate->dst_offset)) {
+		gz_point_t *pt = (gz_point_t *)gunzip_index->record;
+		if (lseek(xstate->src_fd, (off_t)pt->in, SEEK_SET) != (off_t)pt->in) {
+			bb_error_msg("seek error (errno: %d)", errno);
+			total = -1;
+			goto ret;
+		}
+		gunzip_member_base = pt->out - pt->member_out;
+		gunzip_skip = xstate->dst_offset - pt->out;
+		gunzip_resume = gunzip_index->record;
+		goto resume;
+	}
+
  again:
 	if (!check_header_gzip(PASS_STATE xstate)) {
 		bb_simple_error_msg("corrupted data");
@@ -1284,12 +1523,14 @@ unpack_gz_stream(transformer_state_t *xstate)
 		goto ret;
 	}
 
+ resume:
 	n = inflate_unzip_internal(PASS_STATE xstate);
 	if (n < 0) {
 		total = (n == -ENOSPC) ? xstate->mem_output_size_max : n;
 		goto ret;
 	}
 	total += n;
+	gunzip_member_base += gunzip_bytes_out;
 
 	if (!top_up(PASS_STATE 8)) {
 		bb_simple_error_msg("corrupted data");
@@ -1313,7 +1554,7 @@ unpack_gz_stream(transformer_state_t *xstate)
 	}
 
 	if (!top_up(PASS_STATE 2))
-		goto ret; /* EOF */
+		goto eof;
 
 	if (bytebuffer[bytebuffer_offset] == 0x1f
 	 && bytebuffer[bytebuffer_offset + 1] == 0x8b
@@ -1324,7 +1565,13 @@ unpack_gz_stream(transformer_state_t *xstate)
 	/* GNU gzip says: */
 	/*bb_error_msg("decompression OK, trailing garbage ignored");*/
 
+ eof:
+	if ((gunzip_skip != 0) && (total >= 0)) {
+		bb_simple_error_msg("offset is beyond the end of the uncompressed data");
+		total = -1;
+	}
  ret:
+	gz_index_close(gunzip_index);
 	free(bytebuffer);
 	DEALLOC_STATE;
 	return total;
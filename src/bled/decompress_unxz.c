@@ -9,6 +9,7 @@
 
 #include "libbb.h"
 #include "bb_archive.h"
+#include "thread.h"
 
 #define XZ_EXTERN static
 // We get XZ_OPTIONS_ERROR in xz_dec_stream if this is not defined
@@ -32,17 +33,350 @@ static uint32_t XZ_FUNC xz_crc32(const uint8_t *buf, size_t size, uint32_t crc)
 	return ~crc32_block_endian0(~crc, buf, size, global_crc32_table);
 }
 
+/*
+ * Multithreaded decompression of multi-block streams, such as the ones created with 'xz -T0'.
+ * The index, at the end of the stream, gives us the location and size of each block, and
+ * since blocks are independent, we read them sequentially, have a pool of workers, each
+ * with its own decoder, decompress them, and write the decompressed data back in order.
+ * Each block is wrapped into a single block stream, so that it can go through xz_dec_run().
+ */
+#define XZ_MT_MAX_THREADS       8
+#define XZ_MT_MAX_MEMORY        (512 << 20)	/* Maximum size of the buffers for the blocks in flight */
+#define XZ_MT_MAX_INDEX_SIZE    (16 << 20)
+#define XZ_MT_WRAPPER_SIZE      (2 * STREAM_HEADER_SIZE + 32)
+
+typedef struct {
+	uint64_t unpadded_size;
+	uint64_t uncompressed_size;
+} xz_mt_block_t;
+
+typedef struct {
+	uint8_t *in;
+	size_t in_size;
+	uint8_t *out;
+	size_t out_size;
+	volatile LONG done;
+	enum xz_ret ret;
+} xz_mt_job_t;
+
+typedef struct {
+	uint8_t header[STREAM_HEADER_SIZE];
+	xz_mt_block_t *block;
+	uint32_t nb_blocks;
+	uint64_t max_in_size;
+	uint64_t max_out_size;
+	struct xz_dec **dec;	/* One decoder per worker */
+	struct bled_ctx *ctx;	/* For the CRC table, that the workers need */
+	pool_t pool;
+} xz_mt_t;
+
+static bool xz_mt_get_vli(const uint8_t *buf, size_t size, size_t *pos, uint64_t *vli)
+{
+	int i;
+
+	*vli = 0;
+	for (i = 0; (i < 9) && (*pos < size); i++) {
+		uint8_t byte = buf[(*pos)++];
+		*vli |= (uint64_t)(byte & 0x7F) << (i * 7);
+		if ((byte & 0x80) == 0)
+			return (byte != 0) || (i == 0);
+	}
+	return false;
+}
+
+static size_t xz_mt_put_vli(uint8_t *buf, uint64_t vli)
+{
+	size_t i = 0;
+
+	while (vli >= 0x80) {
+		buf[i++] = (uint8_t)vli | 0x80;
+		vli >>= 7;
+	}
+	buf[i++] = (uint8_t)vli;
+	return i;
+}
+
+/* Read raw data from the source, without accounting for it in the progress */
+static bool xz_mt_pread(int fd, off_t offset, void *buf, size_t size)
+{
+	int r;
+	size_t pos;
+
+	if (lseek(fd, offset, SEEK_SET) != offset)
+		return false;
+	for (pos = 0; pos < size; pos += r) {
+		r = _read(fd, (uint8_t *)buf + pos, (unsigned int)MIN(size - pos, BB_BUFSIZE));
+		if (r <= 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Parse the stream header and index, to find if the source is a single stream with
+ * multiple blocks. Returns false if we should use the regular streaming decoder.
+ */
+static bool xz_mt_parse_index(int fd, off_t start, xz_mt_t *mt)
+{
+	uint8_t footer[STREAM_HEADER_SIZE], *index = NULL;
+	uint64_t nb_records, unpadded, uncompressed, blocks_size = 0;
+	size_t pos, index_size;
+	off_t end;
+	uint32_t i;
+	bool r = false;
+
+	end = lseek(fd, 0, SEEK_END);
+	if ((end == (off_t)-1) || (end - start < 2 * STREAM_HEADER_SIZE))
+		return false;
+	if (!xz_mt_pread(fd, start, mt->header, STREAM_HEADER_SIZE) ||
+	    !xz_mt_pread(fd, end - STREAM_HEADER_SIZE, footer, STREAM_HEADER_SIZE))
+		return false;
+	/* We don't handle stream padding or concatenated streams */
+	if (!memeq(mt->header, HEADER_MAGIC, HEADER_MAGIC_SIZE) ||
+	    (xz_crc32(mt->header + HEADER_MAGIC_SIZE, 2, 0) != get_le32(mt->header + HEADER_MAGIC_SIZE + 2)) ||
+	    !memeq(footer + 10, FOOTER_MAGIC, FOOTER_MAGIC_SIZE) ||
+	    (xz_crc32(footer + 4, 6, 0) != get_le32(footer)) ||
+	    !memeq(footer + 8, mt->header + HEADER_MAGIC_SIZE, 2) ||
+	    (mt->header[HEADER_MAGIC_SIZE + 1] > XZ_CHECK_MAX))
+		return false;
+
+	index_size = ((size_t)get_le32(footer + 4) + 1) * 4;
+	if ((index_size > XZ_MT_MAX_INDEX_SIZE) || ((off_t)index_size > end - start - 2 * STREAM_HEADER_SIZE))
+		return false;
+	index = xmalloc(index_size);
+	if (index == NULL || !xz_mt_pread(fd, end - STREAM_HEADER_SIZE - index_size, index, index_size))
+		goto out;
+	if ((index[0] != 0) || (xz_crc32(index, index_size - 4, 0) != get_le32(index + index_size - 4)))
+		goto out;
+	pos = 1;
+	if (!xz_mt_get_vli(index, index_size - 4, &pos, &nb_records) || (nb_records < 2) ||
+	    (nb_records > (index_size - 4) / 2))
+		goto out;
+	mt->block = xzalloc((size_t)nb_records * sizeof(xz_mt_block_t));
+	if (mt->block == NULL)
+		goto out;
+	mt->nb_blocks = (uint32_t)nb_records;
+	for (i = 0; i < mt->nb_blocks; i++) {
+		if (!xz_mt_get_vli(index, index_size - 4, &pos, &unpadded) ||
+		    !xz_mt_get_vli(index, index_size - 4, &pos, &uncompressed) ||
+		    (unpadded == 0) || (unpadded > XZ_MT_MAX_MEMORY) || (uncompressed > XZ_MT_MAX_MEMORY))
+			goto out;
+		mt->block[i].unpadded_size = unpadded;
+		mt->block[i].uncompressed_size = uncompressed;
+		blocks_size += (unpadded + 3) & ~3ULL;
+		mt->max_in_size = MAX(mt->max_in_size, (unpadded + 3) & ~3ULL);
+		mt->max_out_size = MAX(mt->max_out_size, uncompressed);
+	}
+	/* The blocks and the index must account for the whole stream */
+	if (((pos + 3) & ~3) != index_size - 4)
+		goto out;
+	if (blocks_size != (uint64_t)(end - start) - 2 * STREAM_HEADER_SIZE - index_size)
+		goto out;
+	r = true;
+
+out:
+	free(index);
+	if (!r) {
+		free(mt->block);
+		mt->block = NULL;
+	}
+	return r;
+}
+
+/* Append an index and a footer to the block in a job, to turn it into a single block stream */
+static void xz_mt_wrap_block(xz_mt_t *mt, xz_mt_job_t *job, uint32_t index)
+{
+	uint8_t *buf = &job->in[job->in_size];
+	size_t i = 0, index_size;
+
+	buf[i++] = 0;
+	i += xz_mt_put_vli(&buf[i], 1);
+	i += xz_mt_put_vli(&buf[i], mt->block[index].unpadded_size);
+	i += xz_mt_put_vli(&buf[i], mt->block[index].uncompressed_size);
+	while (i & 3)
+		buf[i++] = 0;
+	put_unaligned_le32(xz_crc32(buf, i, 0), &buf[i]);
+	i += 4;
+	index_size = i;
+	put_unaligned_le32((uint32_t)(index_size / 4 - 1), &buf[i + 4]);
+	memcpy(&buf[i + 8], mt->header + HEADER_MAGIC_SIZE, 2);
+	put_unaligned_le32(xz_crc32(&buf[i + 4], 6, 0), &buf[i]);
+	memcpy(&buf[i + 10], FOOTER_MAGIC, FOOTER_MAGIC_SIZE);
+	job->in_size += index_size + STREAM_HEADER_SIZE;
+}
+
+static BOOL xz_mt_decode(void *context, uint32_t worker, void *_job)
+{
+	xz_mt_t *mt = (xz_mt_t *)context;
+	xz_mt_job_t *job = (xz_mt_job_t *)_job;
+	struct xz_dec *s = mt->dec[worker];
+	struct xz_buf b;
+	enum xz_ret ret;
+
+	bled_cur_ctx = mt->ctx;
+	b.in = job->in;
+	b.in_pos = 0;
+	b.in_size = job->in_size;
+	b.out = job->out;
+	b.out_pos = 0;
+	b.out_size = job->out_size;
+	xz_dec_reset(s);
+	do {
+		ret = xz_dec_run(s, &b);
+	} while ((ret == XZ_OK) || (ret == XZ_UNSUPPORTED_CHECK));
+	if ((ret == XZ_STREAM_END) && (b.out_pos != job->out_size))
+		ret = XZ_DATA_ERROR;
+	job->ret = ret;
+	atomic_store_release(&job->done, TRUE);
+	return (ret == XZ_STREAM_END);
+}
+
+/* Wait for a job to complete and write its data */
+static bool xz_mt_flush(transformer_state_t *xstate, xz_mt_t *mt, xz_mt_job_t *job, long long *n)
+{
+	size_t pos, size;
+	ssize_t nwrote;
+
+	mutex_lock(&mt->pool.lock);
+	while (!atomic_load_acquire(&job->done))
+		cond_wait(&mt->pool.done_cond, &mt->pool.lock, 100);
+	mutex_unlock(&mt->pool.lock);
+	switch (job->ret) {
+	case XZ_STREAM_END:
+		break;
+	case XZ_MEM_ERROR:
+		bb_error_msg("memory allocation error");
+		return false;
+	case XZ_MEMLIMIT_ERROR:
+		bb_error_msg("memory usage limit error");
+		return false;
+	case XZ_OPTIONS_ERROR:
+		bb_error_msg("unsupported XZ header option");
+		return false;
+	default:
+		bb_error_msg("corrupted archive");
+		return false;
+	}
+	for (pos = 0; pos < job->out_size; pos += size) {
+		size = MIN(job->out_size - pos, BB_BUFSIZE);
+		nwrote = transformer_write(xstate, &job->out[pos], size);
+		if (nwrote < 0) {
+			bb_error_msg("write error (errno: %d)", errno);
+			return false;
+		}
+		*n += nwrote;
+	}
+	return true;
+}
+
+static IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream_mt(transformer_state_t *xstate, xz_mt_t *mt,
+	uint32_t nb_workers, uint32_t nb_jobs)
+{
+	long long n = 0;
+	xz_mt_job_t *job = NULL;
+	size_t pos, size;
+	uint32_t i, j;
+	bool ret = false;
+	int r;
+
+	mt->ctx = bled_cur_ctx;
+	mt->dec = xzalloc(nb_workers * sizeof(struct xz_dec *));
+	job = xzalloc(nb_jobs * sizeof(xz_mt_job_t));
+	if ((mt->dec == NULL) || (job == NULL))
+		bb_error_msg_and_err("memory allocation error");
+	for (i = 0; i < nb_workers; i++) {
+		mt->dec[i] = xz_dec_init(XZ_DYNALLOC, 1 << 26);
+		if (mt->dec[i] == NULL)
+			bb_error_msg_and_err("memory allocation error");
+	}
+	for (i = 0; i < nb_jobs; i++) {
+		job[i].in = xmalloc((size_t)mt->max_in_size + XZ_MT_WRAPPER_SIZE);
+		job[i].out = xmalloc((size_t)mt->max_out_size);
+		if ((job[i].in == NULL) || (job[i].out == NULL))
+			bb_error_msg_and_err("memory allocation error");
+	}
+	if (!pool_create(&mt->pool, nb_workers, nb_jobs, xz_mt_decode, mt))
+		bb_error_msg_and_err("could not create decompression threads");
+	if (mt->header[HEADER_MAGIC_SIZE + 1] > XZ_CHECK_CRC32)
+		bb_error_msg("unsupported check; not verifying file integrity");
+	bb_printf("Decompressing %d XZ blocks using %d threads", mt->nb_blocks, nb_workers);
+
+	/* The blocks immediately follow the stream header */
+	for (i = 0; i < mt->nb_blocks + nb_jobs; i++) {
+		/* Write the oldest block we have in flight, to free its slot */
+		if ((i >= nb_jobs) && !xz_mt_flush(xstate, mt, &job[i % nb_jobs], &n))
+			goto err;
+		if (i >= mt->nb_blocks)
+			continue;
+		j = i % nb_jobs;
+		memcpy(job[j].in, mt->header, STREAM_HEADER_SIZE);
+		job[j].in_size = STREAM_HEADER_SIZE + (size_t)((mt->block[i].unpadded_size + 3) & ~3ULL);
+		for (pos = STREAM_HEADER_SIZE; pos < job[j].in_size; pos += r) {
+			size = MIN(job[j].in_size - pos, BB_BUFSIZE);
+			r = safe_read(xstate->src_fd, &job[j].in[pos], (unsigned int)size);
+			if (r <= 0)
+				bb_error_msg_and_err("read error (errno: %d)", errno);
+		}
+		xz_mt_wrap_block(mt, &job[j], i);
+		job[j].out_size = (size_t)mt->block[i].uncompressed_size;
+		job[j].done = FALSE;
+		if (!pool_submit(&mt->pool, &job[j]))
+			bb_error_msg_and_err("could not queue block");
+	}
+	ret = true;
+
+err:
+	/* This waits for the blocks that are still being decoded */
+	pool_destroy(&mt->pool);
+	for (i = 0; (job != NULL) && (i < nb_jobs); i++) {
+		free(job[i].in);
+		free(job[i].out);
+	}
+	free(job);
+	for (i = 0; (mt->dec != NULL) && (i < nb_workers); i++) {
+		if (mt->dec[i] != NULL)
+			xz_dec_end(mt->dec[i]);
+	}
+	free(mt->dec);
+	free(mt->block);
+	return ret ? n : -1;
+}
+
 IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long) int n = 0;
 	struct xz_buf b;
-	struct xz_dec *s;
+	struct xz_dec *s = NULL;
 	enum xz_ret ret = XZ_STREAM_END;
 	uint8_t *in = NULL, *out = NULL;
 	ssize_t nwrote;
+	xz_mt_t mt = { 0 };
+	uint32_t nb_workers, nb_jobs;
+	uint64_t job_size;
+	off_t start;
 
 	xz_crc32_init();
 
+	/*
+	 * Use multithreaded decompression if the stream has multiple blocks, as long as
+	 * we can seek the source to read the index and the output doesn't go to memory.
+	 */
+	nb_workers = MIN(get_cpu_count(), XZ_MT_MAX_THREADS);
+	if ((nb_workers > 1) && !xstate->signature_skipped && (xstate->mem_output_size_max == 0) &&
+	    (bled_read == NULL) && (xstate->src_fd != bb_virtual_fd)) {
+		start = lseek(xstate->src_fd, 0, SEEK_CUR);
+		if ((start != (off_t)-1) && xz_mt_parse_index(xstate->src_fd, start, &mt)) {
+			job_size = mt.max_in_size + XZ_MT_WRAPPER_SIZE + mt.max_out_size;
+			nb_jobs = (uint32_t)MIN(2 * nb_workers, XZ_MT_MAX_MEMORY / job_size);
+			nb_workers = MIN(nb_workers, nb_jobs);
+			if ((nb_jobs >= 2) && (lseek(xstate->src_fd, start + STREAM_HEADER_SIZE, SEEK_SET) != (off_t)-1))
+				return unpack_xz_stream_mt(xstate, &mt, nb_workers, nb_jobs);
+			free(mt.block);
+		}
+		if ((start == (off_t)-1) || (lseek(xstate->src_fd, start, SEEK_SET) != start))
+			bb_error_msg_and_err("seek error (errno: %d)", errno);
+	}
+
 	/*
 	 * Support up to 64 MiB dictionary. The actually needed memory
 	 * is allocated once the headers have been parsed.
@@ -10,6 +10,7 @@
 
 #include "libbb.h"
 #include "bb_archive.h"
+#include "thread.h"
 
 #if 0
 # define dbg(...) bb_printf(__VA_ARGS__)
@@ -505,6 +506,8 @@ unzip_extract(zip_header_t* zip, transformer_state_t* xstate)
 	else {
 		bb_error_msg_and_die("unsupported method %u", zip->fmt.method);
 	}
+	if (zip->fmt.method != 8)
+		n = xstate->bytes_out;
 
 	/* Validate decompression - size */
 	if (n != -ENOSPC && xstate->dst_size != xstate->bytes_out) {
@@ -515,6 +518,244 @@ unzip_extract(zip_header_t* zip, transformer_state_t* xstate)
 	return n;
 }
 
+#if ENABLE_FEATURE_UNZIP_CDF
+/*
+ * Multithreaded extraction to a directory. We go through the central directory, in order,
+ * and for each file, call the switch callback, create and preallocate the output, then read
+ * its compressed data into memory, so that the reads and the progress stay on this thread.
+ * A pool of workers, that each have their own context and inflate state, then decompresses
+ * the files and checks their CRC. Files that are too large to be held in memory, or that
+ * use a compression method other than store or deflate, are extracted by this thread.
+ */
+#define ZIP_MT_MAX_THREADS      8
+#define ZIP_MT_MAX_ENTRY_SIZE   (16 << 20)
+
+typedef struct {
+	int fd;
+	uint16_t method;
+	uint32_t crc32;
+	uint64_t cmpsize;
+	uint64_t ucmpsize;
+	uint8_t *in;
+	bool busy;		/* Only accessed by the main thread */
+	volatile LONG done;
+	long long n;
+	const char *error;
+} unzip_mt_job_t;
+
+typedef struct {
+	struct bled_ctx *ctx;	/* One context per worker, to read from the job's buffer */
+	uint32_t *crc_table;
+	unzip_mt_job_t *job;
+	uint32_t nb_jobs;
+	long long n;
+	jmp_buf error_jmp;	/* The caller's, which we restore on exit */
+	pool_t pool;
+} unzip_mt_t;
+
+/* Reserve the space of an output file upfront, without changing its size, to limit fragmentation */
+static void unzip_preallocate(int fd, uint64_t size)
+{
+#if defined(_WIN32)
+	FILE_ALLOCATION_INFO fai;
+
+	fai.AllocationSize.QuadPart = (LONGLONG)size;
+	SetFileInformationByHandle((HANDLE)_get_osfhandle(fd), FileAllocationInfo, &fai, sizeof(fai));
+#elif defined(__linux__)
+	(void)fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size);
+#endif
+}
+
+static BOOL unzip_mt_extract(void *context, uint32_t worker, void *_job)
+{
+	unzip_mt_t *mt = (unzip_mt_t *)context;
+	unzip_mt_job_t *job = (unzip_mt_job_t *)_job;
+	transformer_state_t xstate;
+	uint32_t crc = ~0;
+	size_t pos, size;
+
+	bled_cur_ctx = &mt->ctx[worker];
+	/* The worker's context is a copy of the caller's, so it must not longjmp to the caller's stack */
+	job->error = NULL;
+	if (setjmp(bb_error_jmp)) {
+		job->error = "decompression error";
+		goto out;
+	}
+	bb_virtual_buf = (char *)job->in;
+	bb_virtual_len = (size_t)job->cmpsize;
+	bb_virtual_pos = 0;
+	init_transformer_state(&xstate);
+	xstate.src_fd = bb_virtual_fd;
+	xstate.dst_fd = job->fd;
+	xstate.bytes_in = job->cmpsize;
+	xstate.dst_size = job->ucmpsize;
+
+	if (job->method == 0) {
+		for (pos = 0; pos < job->cmpsize; pos += size) {
+			size = (size_t)MIN(job->cmpsize - pos, BB_BUFSIZE);
+			if (transformer_write(&xstate, &job->in[pos], size) != (ssize_t)size) {
+				job->error = "write error";
+				break;
+			}
+			crc = crc32_le(crc, &job->in[pos], size, mt->crc_table);
+		}
+		job->n = (long long)pos;
+	} else {
+		job->n = inflate_unzip(&xstate);
+		crc = xstate.crc32;
+		if (job->n < 0)
+			job->error = "inflate error";
+	}
+	if ((job->error == NULL) && (job->crc32 != ~crc))
+		job->error = "crc error";
+	if ((job->error == NULL) && ((uint64_t)job->n != job->ucmpsize))
+		job->error = "bad length";
+out:
+	_close(job->fd);
+	job->fd = -1;
+	free(job->in);
+	job->in = NULL;
+	atomic_store_release(&job->done, TRUE);
+	return (job->error == NULL);
+}
+
+/* Wait for the file in a job slot to be extracted, if there is one */
+static bool unzip_mt_flush(unzip_mt_t *mt, unzip_mt_job_t *job)
+{
+	if (!job->busy)
+		return true;
+	job->busy = false;
+	mutex_lock(&mt->pool.lock);
+	while (!atomic_load_acquire(&job->done))
+		cond_wait(&mt->pool.done_cond, &mt->pool.lock, 100);
+	mutex_unlock(&mt->pool.lock);
+	if (job->error != NULL) {
+		bb_error_msg("%s", job->error);
+		return false;
+	}
+	mt->n += job->n;
+	return true;
+}
+
+static IF_DESKTOP(long long) int FAST_FUNC unpack_zip_stream_mt(transformer_state_t *xstate, unzip_mt_t *mt,
+	uint64_t cdf_offset, uint32_t nb_workers)
+{
+	unzip_mt_job_t *job;
+	cdf_header_t cdf;
+	zip_header_t zip;
+	uint64_t pos;
+	uint32_t i, j = 0;
+	bool ret = false;
+	long long n;
+	int r;
+
+	mt->nb_jobs = 2 * nb_workers;
+	mt->ctx = xzalloc(nb_workers * sizeof(struct bled_ctx));
+	mt->job = xzalloc(mt->nb_jobs * sizeof(unzip_mt_job_t));
+	mt->crc_table = crc32_filltable(NULL, 0);
+	if ((mt->ctx == NULL) || (mt->job == NULL) || (mt->crc_table == NULL))
+		bb_error_msg_and_err("memory allocation error");
+	for (i = 0; i < nb_workers; i++) {
+		mt->ctx[i] = *bled_cur_ctx;
+		mt->ctx[i].printf_function = NULL;
+		mt->ctx[i].progress_function = NULL;
+		mt->ctx[i].switch_function = NULL;
+		mt->ctx[i].crc32_table = NULL;
+		mt->ctx[i].sink = NULL;
+		mt->ctx[i].virtual_fd = 0;
+	}
+	for (i = 0; i < mt->nb_jobs; i++)
+		mt->job[i].fd = -1;
+	if (!pool_create(&mt->pool, nb_workers, mt->nb_jobs, unzip_mt_extract, mt))
+		bb_error_msg_and_err("could not create decompression threads");
+	/* The parsing code below may still die on a malformed archive */
+	memcpy(mt->error_jmp, bb_error_jmp, sizeof(jmp_buf));
+	if (setjmp(bb_error_jmp))
+		goto err;
+
+	while (1) {
+		cdf_offset = read_next_cdf(xstate->src_fd, cdf_offset, &cdf);
+		if (cdf_offset == 0) /* EOF? */
+			break;
+		lseek(xstate->src_fd, SWAP_LE32(cdf.fmt.relative_offset_of_local_header) + 4, SEEK_SET);
+		xread(xstate->src_fd, zip.raw, ZIP_HEADER_LEN);
+		FIX_ENDIANNESS_ZIP(zip);
+		if (zip.fmt.zip_flags & SWAP_LE16(0x0008)) {
+			zip.fmt.crc32 = cdf.fmt.crc32;
+			zip.fmt.cmpsize = cdf.fmt.cmpsize;
+			zip.fmt.ucmpsize = cdf.fmt.ucmpsize;
+		}
+		if (zip.fmt.zip_flags & SWAP_LE16(0x0001))
+			bb_error_msg_and_err("zip flag %s is not supported", "1 (encryption)");
+		unzip_set_xstate(xstate, &zip);
+		if (cdf.fmt.external_attributes & 0x40000010) {
+			free(xstate->dst_name);
+			xstate->dst_name = NULL;
+			continue;
+		}
+		/* Files are created, and reported, in the order of the archive */
+		if (transformer_switch_file(xstate) < 0)
+			goto err;
+
+		if (((zip.fmt.method != 0) && (zip.fmt.method != 8)) || (xstate->bytes_in > ZIP_MT_MAX_ENTRY_SIZE) ||
+		    ((zip.fmt.method == 0) && (xstate->bytes_in != xstate->dst_size))) {
+			n = unzip_extract(&zip, xstate);
+			if (n < 0)
+				goto err;
+			mt->n += n;
+			_close(xstate->dst_fd);
+			xstate->dst_fd = -1;
+			continue;
+		}
+
+		job = &mt->job[j];
+		j = (j + 1) % mt->nb_jobs;
+		if (!unzip_mt_flush(mt, job))
+			goto err;
+		unzip_preallocate(xstate->dst_fd, xstate->dst_size);
+		job->in = xmalloc((size_t)MAX(xstate->bytes_in, 1));
+		if (job->in == NULL)
+			bb_error_msg_and_err("memory allocation error");
+		for (pos = 0; pos < xstate->bytes_in; pos += r) {
+			r = safe_read(xstate->src_fd, &job->in[pos], (unsigned int)MIN(xstate->bytes_in - pos, BB_BUFSIZE));
+			if (r <= 0) {
+				free(job->in);
+				job->in = NULL;
+				bb_error_msg_and_err("read error (errno: %d)", errno);
+			}
+		}
+		job->fd = xstate->dst_fd;
+		xstate->dst_fd = -1;
+		job->method = zip.fmt.method;
+		job->crc32 = zip.fmt.crc32;
+		job->cmpsize = xstate->bytes_in;
+		job->ucmpsize = xstate->dst_size;
+		job->done = FALSE;
+		if (!pool_submit(&mt->pool, job)) {
+			_close(job->fd);
+			free(job->in);
+			job->in = NULL;
+			bb_error_msg_and_err("could not queue file");
+		}
+		job->busy = true;
+	}
+	for (i = 0; i < mt->nb_jobs; i++) {
+		if (!unzip_mt_flush(mt, &mt->job[(j + i) % mt->nb_jobs]))
+			goto err;
+	}
+	ret = true;
+
+err:
+	memcpy(bb_error_jmp, mt->error_jmp, sizeof(jmp_buf));
+	/* This waits for the files that are still being extracted */
+	pool_destroy(&mt->pool);
+	free(mt->job);
+	free(mt->ctx);
+	free(mt->crc_table);
+	return ret ? mt->n : -1;
+}
+#endif
+
 
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_zip_stream(transformer_state_t *xstate)
@@ -522,6 +763,19 @@ unpack_zip_stream(transformer_state_t *xstate)
 	IF_DESKTOP(long long) int n = -EFAULT;
 	bool is_dir = false;
 	uint64_t cdf_offset = find_cdf_offset(xstate->src_fd);	/* try to seek to the end, find CDE and CDF start */
+#if ENABLE_FEATURE_UNZIP_CDF
+	uint32_t nb_workers = MIN(get_cpu_count(), ZIP_MT_MAX_THREADS);
+	unzip_mt_t mt = { 0 };
+
+	/*
+	 * Extract the files on multiple threads when we have a central directory and are
+	 * writing to a directory, as long as the reads and writes don't go through callbacks.
+	 */
+	if ((nb_workers > 1) && (cdf_offset != BAD_CDF_OFFSET) && (xstate->dst_dir != NULL) &&
+	    (xstate->mem_output_size_max == 0) && (bled_read == NULL) && (bled_write == NULL) &&
+	    (xstate->src_fd != bb_virtual_fd))
+		return unpack_zip_stream_mt(xstate, &mt, cdf_offset, nb_workers);
+#endif
 
 	while (1) {
 		zip_header_t zip;
@@ -16,6 +16,7 @@
 #include "bb_archive.h"
 #include "zstd_deps.h"
 #include "zstd_internal.h"
+#include "thread.h"
 
 ALWAYS_INLINE static size_t roundupsize(size_t size, size_t align)
 {
@@ -116,6 +117,420 @@ unpack_zstd_stream_inner(transformer_state_t *xstate,
 	return IF_DESKTOP(total) + 0;
 }
 
+/*
+ * Multithreaded decompression of multi-frame streams, such as the ones created with pzstd
+ * or with the zstd seekable format API. Since frames are independent, we read them
+ * sequentially, have a pool of workers, each with its own decompression context, decompress
+ * them, and write the decompressed data back in order.
+ * If the stream ends with a seekable format seek table, we use it to get the frame sizes,
+ * which also allows us to start decompressing at an arbitrary uncompressed offset.
+ * Otherwise we walk the frame and block headers, and have the main thread decompress
+ * the frames that don't declare their content size or that are too large for a worker.
+ */
+#define ZSTD_MT_MAX_THREADS         8
+#define ZSTD_MT_MAX_MEMORY          (512 << 20)	/* Maximum size of the buffers for the frames in flight */
+#define ZSTD_MT_MAX_FRAME_SIZE      (32 << 20)	/* Larger frames are decompressed by the main thread */
+#define ZSTD_MT_MAX_INPUT_SIZE      ZSTD_COMPRESSBOUND(ZSTD_MT_MAX_FRAME_SIZE)
+#define ZSTD_SEEKABLE_MAGIC         0x8F92EAB1
+#define ZSTD_SEEKABLE_TABLE_MAGIC   (ZSTD_MAGIC_SKIPPABLE_START | 0xE)
+#define ZSTD_SEEKABLE_FOOTER_SIZE   9
+#define ZSTD_SEEKABLE_MAX_FRAMES    0x8000000
+
+typedef struct {
+	uint32_t c_size;
+	uint32_t d_size;
+} zstd_mt_frame_t;
+
+typedef struct {
+	uint8_t *in;
+	size_t in_size;
+	size_t in_alloc;
+	uint8_t *out;
+	size_t out_size;
+	size_t out_alloc;
+	volatile LONG done;
+	size_t ret;
+} zstd_mt_job_t;
+
+typedef struct {
+	transformer_state_t *xstate;
+	zstd_mt_frame_t *frame;	/* Seek table, if any */
+	uint32_t nb_frames;
+	uint32_t first_frame;
+	uint64_t skip;		/* Number of uncompressed bytes to discard before writing */
+	uint8_t *buf;		/* Read buffer */
+	size_t buf_pos;
+	size_t buf_size;
+	ZSTD_DCtx **dctx;	/* One context per worker */
+	pool_t pool;
+} zstd_mt_t;
+
+static void zstd_mt_error(size_t code)
+{
+#if defined(ZSTD_STRIP_ERROR_STRINGS) && ZSTD_STRIP_ERROR_STRINGS == 1
+	bb_error_msg("zstd decoder error: %u", (unsigned)code);
+#else
+	bb_error_msg("zstd decoder error: %s", ZSTD_getErrorName(code));
+#endif
+}
+
+static bool zstd_mt_pread(int fd, off_t offset, void *buf, size_t size)
+{
+	int r;
+	size_t pos;
+
+	if (lseek(fd, offset, SEEK_SET) != offset)
+		return false;
+	for (pos = 0; pos < size; pos += r) {
+		r = _read(fd, (uint8_t *)buf + pos, (unsigned int)MIN(size - pos, BB_BUFSIZE));
+		if (r <= 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Look for a seekable format seek table at the end of the source. Returns false if there
+ * isn't one, or if it doesn't account for the whole stream.
+ */
+static bool zstd_mt_parse_seek_table(int fd, off_t start, zstd_mt_t *mt)
+{
+	uint8_t footer[ZSTD_SEEKABLE_FOOTER_SIZE], *table = NULL;
+	uint32_t i, entry_size;
+	uint64_t table_size, frames_size = 0;
+	off_t end;
+	bool r = false;
+
+	end = lseek(fd, 0, SEEK_END);
+	if ((end == (off_t)-1) || (end - start < ZSTD_SKIPPABLEHEADERSIZE + ZSTD_SEEKABLE_FOOTER_SIZE) ||
+	    !zstd_mt_pread(fd, end - ZSTD_SEEKABLE_FOOTER_SIZE, footer, sizeof(footer)) ||
+	    (MEM_readLE32(&footer[5]) != ZSTD_SEEKABLE_MAGIC) || ((footer[4] & 0x7C) != 0))
+		return false;
+
+	mt->nb_frames = MEM_readLE32(footer);
+	if ((mt->nb_frames == 0) || (mt->nb_frames > ZSTD_SEEKABLE_MAX_FRAMES))
+		return false;
+	entry_size = (footer[4] & 0x80) ? 12 : 8;
+	table_size = (uint64_t)mt->nb_frames * entry_size + ZSTD_SEEKABLE_FOOTER_SIZE;
+	if ((uint64_t)(end - start) < table_size + ZSTD_SKIPPABLEHEADERSIZE)
+		return false;
+	table = malloc((size_t)table_size + ZSTD_SKIPPABLEHEADERSIZE);
+	mt->frame = malloc(mt->nb_frames * sizeof(zstd_mt_frame_t));
+	if ((table == NULL) || (mt->frame == NULL) ||
+	    !zstd_mt_pread(fd, end - (off_t)table_size - ZSTD_SKIPPABLEHEADERSIZE, table, (size_t)table_size + ZSTD_SKIPPABLEHEADERSIZE) ||
+	    (MEM_readLE32(table) != ZSTD_SEEKABLE_TABLE_MAGIC) || (MEM_readLE32(&table[4]) != table_size))
+		goto out;
+	for (i = 0; i < mt->nb_frames; i++) {
+		mt->frame[i].c_size = MEM_readLE32(&table[ZSTD_SKIPPABLEHEADERSIZE + i * entry_size]);
+		mt->frame[i].d_size = MEM_readLE32(&table[ZSTD_SKIPPABLEHEADERSIZE + i * entry_size + 4]);
+		frames_size += mt->frame[i].c_size;
+	}
+	r = (start + frames_size + ZSTD_SKIPPABLEHEADERSIZE + table_size == (uint64_t)end);
+
+out:
+	free(table);
+	if (!r) {
+		free(mt->frame);
+		mt->frame = NULL;
+	}
+	return r;
+}
+
+/*
+ * Make sure that at least 'size' bytes of source data are available from the read buffer,
+ * unless we reach the end of the source. Returns the number of bytes available or -1 on error.
+ */
+static ssize_t zstd_mt_fill(zstd_mt_t *mt, size_t size)
+{
+	ssize_t r;
+
+	if (mt->buf_pos + size > mt->buf_size) {
+		memmove(mt->buf, &mt->buf[mt->buf_pos], mt->buf_size - mt->buf_pos);
+		mt->buf_size -= mt->buf_pos;
+		mt->buf_pos = 0;
+		while (mt->buf_size < size) {
+			r = safe_read(mt->xstate->src_fd, &mt->buf[mt->buf_size], (unsigned int)(BB_BUFSIZE - mt->buf_size));
+			if (r < 0) {
+				bb_perror_msg(bb_msg_read_error);
+				return -1;
+			}
+			if (r == 0)
+				break;
+			mt->buf_size += r;
+		}
+	}
+	return mt->buf_size - mt->buf_pos;
+}
+
+/* Read 'size' bytes of source data into 'dst', or skip them if 'dst' is NULL */
+static bool zstd_mt_read(zstd_mt_t *mt, uint8_t *dst, uint64_t size)
+{
+	uint64_t pos;
+	ssize_t r;
+	size_t n;
+
+	for (pos = 0; pos < size; pos += n) {
+		r = zstd_mt_fill(mt, 1);
+		if (r <= 0) {
+			if (r == 0)
+				bb_error_msg("truncated zstd data");
+			return false;
+		}
+		n = (size_t)MIN(size - pos, (uint64_t)r);
+		if (dst != NULL)
+			memcpy(&dst[pos], &mt->buf[mt->buf_pos], n);
+		mt->buf_pos += n;
+	}
+	return true;
+}
+
+/* Grow a job buffer so that it can hold at least 'size' bytes */
+static bool zstd_mt_reserve(uint8_t **buf, size_t *alloc, size_t size)
+{
+	if (size <= *alloc)
+		return true;
+	size = MAX(size, MIN(2 * *alloc, ZSTD_MT_MAX_INPUT_SIZE));
+	*buf = xrealloc(*buf, size);
+	*alloc = (*buf == NULL) ? 0 : size;
+	return (*buf != NULL);
+}
+
+/* Read a complete frame, whose header has already been parsed, by walking its blocks */
+static bool zstd_mt_read_frame(zstd_mt_t *mt, zstd_mt_job_t *job, const ZSTD_frameHeader *zfh)
+{
+	uint32_t block_header, block_size;
+	bool last_block;
+
+	job->in_size = zfh->headerSize;
+	if (!zstd_mt_reserve(&job->in, &job->in_alloc, job->in_size + ZSTD_blockHeaderSize) ||
+	    !zstd_mt_read(mt, job->in, job->in_size))
+		return false;
+	do {
+		if (!zstd_mt_read(mt, &job->in[job->in_size], ZSTD_blockHeaderSize))
+			return false;
+		block_header = MEM_readLE24(&job->in[job->in_size]);
+		last_block = block_header & 1;
+		block_size = block_header >> 3;
+		switch ((block_header >> 1) & 3) {
+		case bt_rle:
+			block_size = 1;
+			break;
+		case bt_reserved:
+			bb_error_msg("corrupted zstd block");
+			return false;
+		}
+		job->in_size += ZSTD_blockHeaderSize;
+		if ((job->in_size + block_size + ZSTD_blockHeaderSize + 4 > ZSTD_MT_MAX_INPUT_SIZE) ||
+		    !zstd_mt_reserve(&job->in, &job->in_alloc, job->in_size + block_size + ZSTD_blockHeaderSize + 4)) {
+			bb_error_msg("corrupted zstd frame");
+			return false;
+		}
+		if (!zstd_mt_read(mt, &job->in[job->in_size], block_size))
+			return false;
+		job->in_size += block_size;
+	} while (!last_block);
+	if (zfh->checksumFlag) {
+		if (!zstd_mt_read(mt, &job->in[job->in_size], 4))
+			return false;
+		job->in_size += 4;
+	}
+	return true;
+}
+
+/* Write decompressed data, after discarding the bytes that precede the requested offset */
+static bool zstd_mt_write(zstd_mt_t *mt, const uint8_t *buf, size_t size, long long *n)
+{
+	size_t pos, len;
+	ssize_t nwrote;
+
+	len = (size_t)MIN(mt->skip, size);
+	mt->skip -= len;
+	for (pos = len; pos < size; pos += len) {
+		len = MIN(size - pos, BB_BUFSIZE);
+		nwrote = transformer_write(mt->xstate, &buf[pos], len);
+		if (nwrote < 0) {
+			bb_error_msg("write error (errno: %d)", errno);
+			return false;
+		}
+		*n += nwrote;
+	}
+	return true;
+}
+
+static BOOL zstd_mt_decode(void *context, uint32_t worker, void *_job)
+{
+	zstd_mt_t *mt = (zstd_mt_t *)context;
+	zstd_mt_job_t *job = (zstd_mt_job_t *)_job;
+
+	job->ret = ZSTD_decompressDCtx(mt->dctx[worker], job->out, job->out_size, job->in, job->in_size);
+	if (!ZSTD_isError(job->ret) && (job->ret != job->out_size))
+		job->ret = ERROR(corruption_detected);
+	atomic_store_release(&job->done, TRUE);
+	return !ZSTD_isError(job->ret);
+}
+
+/* Wait for a job to complete and write its data */
+static bool zstd_mt_flush(zstd_mt_t *mt, zstd_mt_job_t *job, long long *n)
+{
+	mutex_lock(&mt->pool.lock);
+	while (!atomic_load_acquire(&job->done))
+		cond_wait(&mt->pool.done_cond, &mt->pool.lock, 100);
+	mutex_unlock(&mt->pool.lock);
+	if (ZSTD_isError(job->ret)) {
+		zstd_mt_error(job->ret);
+		return false;
+	}
+	return zstd_mt_write(mt, job->out, job->out_size, n);
+}
+
+/* Decompress the next frame from the main thread, for frames that are too large for the workers */
+static bool zstd_mt_decode_inline(zstd_mt_t *mt, ZSTD_DStream *dctx, uint8_t *out_buff, size_t out_size, long long *n)
+{
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	size_t ret;
+	ssize_t r;
+
+	ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+	do {
+		r = zstd_mt_fill(mt, 1);
+		if (r <= 0) {
+			if (r == 0)
+				bb_error_msg("truncated zstd data");
+			return false;
+		}
+		input.src = &mt->buf[mt->buf_pos];
+		input.size = (size_t)r;
+		input.pos = 0;
+		do {
+			output.dst = out_buff;
+			output.size = out_size;
+			output.pos = 0;
+			ret = ZSTD_decompressStream(dctx, &output, &input);
+			if (ZSTD_isError(ret)) {
+				zstd_mt_error(ret);
+				return false;
+			}
+			if (!zstd_mt_write(mt, out_buff, output.pos, n))
+				return false;
+		} while ((ret != 0) && ((input.pos < input.size) || (output.pos == output.size)));
+		mt->buf_pos += input.pos;
+	} while (ret != 0);
+	return true;
+}
+
+static IF_DESKTOP(long long) int FAST_FUNC unpack_zstd_stream_mt(transformer_state_t *xstate, zstd_mt_t *mt,
+	uint32_t nb_workers, uint32_t nb_jobs)
+{
+	const size_t out_allocsize = roundupsize(ZSTD_DStreamOutSize(), 1024);
+	long long n = 0;
+	zstd_mt_job_t *job = NULL, *j;
+	ZSTD_DStream *dctx = NULL;
+	ZSTD_frameHeader zfh;
+	uint8_t *out_buff = NULL;
+	uint32_t i, nb_submitted = 0, nb_flushed = 0;
+	uint64_t c_size, d_size;
+	ssize_t r;
+	bool ret = false;
+
+	mt->xstate = xstate;
+	mt->buf = xmalloc(BB_BUFSIZE);
+	mt->dctx = xzalloc(nb_workers * sizeof(ZSTD_DCtx *));
+	job = xzalloc(nb_jobs * sizeof(zstd_mt_job_t));
+	out_buff = xmalloc(out_allocsize);
+	dctx = ZSTD_createDStream();
+	if ((mt->buf == NULL) || (mt->dctx == NULL) || (job == NULL) || (out_buff == NULL) || (dctx == NULL))
+		bb_error_msg_and_err("memory allocation error");
+	for (i = 0; i < nb_workers; i++) {
+		mt->dctx[i] = ZSTD_createDCtx();
+		if (mt->dctx[i] == NULL)
+			bb_error_msg_and_err("memory allocation error");
+	}
+	if (!pool_create(&mt->pool, nb_workers, nb_jobs, zstd_mt_decode, mt))
+		bb_error_msg_and_err("could not create decompression threads");
+	if (mt->frame != NULL)
+		bb_printf("Decompressing %d zstd frames using %d threads", mt->nb_frames - mt->first_frame, nb_workers);
+	else
+		bb_printf("Decompressing zstd frames using %d threads", nb_workers);
+
+	for (i = mt->first_frame; ; i++) {
+		if (mt->frame != NULL) {
+			if (i >= mt->nb_frames)
+				break;
+			c_size = mt->frame[i].c_size;
+			d_size = mt->frame[i].d_size;
+		} else {
+			r = zstd_mt_fill(mt, ZSTD_FRAMEHEADERSIZE_MAX);
+			if (r < 0)
+				goto err;
+			if (r == 0)
+				break;
+			if ((r >= ZSTD_SKIPPABLEHEADERSIZE) &&
+			    ((MEM_readLE32(&mt->buf[mt->buf_pos]) & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START)) {
+				if (!zstd_mt_read(mt, NULL, ZSTD_SKIPPABLEHEADERSIZE + (uint64_t)MEM_readLE32(&mt->buf[mt->buf_pos + 4])))
+					goto err;
+				continue;
+			}
+			if (ZSTD_getFrameHeader(&zfh, &mt->buf[mt->buf_pos], r) != 0)
+				bb_error_msg_and_err("corrupted zstd frame header");
+			c_size = 0;
+			d_size = zfh.frameContentSize;
+		}
+		if ((d_size > ZSTD_MT_MAX_FRAME_SIZE) || (c_size > ZSTD_MT_MAX_INPUT_SIZE)) {
+			/* Write all the frames in flight, then decompress this one ourselves */
+			for (; nb_flushed < nb_submitted; nb_flushed++) {
+				if (!zstd_mt_flush(mt, &job[nb_flushed % nb_jobs], &n))
+					goto err;
+			}
+			if (!zstd_mt_decode_inline(mt, dctx, out_buff, out_allocsize, &n))
+				goto err;
+			continue;
+		}
+		/* Write the oldest frame we have in flight, to free its slot */
+		if ((nb_submitted - nb_flushed >= nb_jobs) && !zstd_mt_flush(mt, &job[nb_flushed++ % nb_jobs], &n))
+			goto err;
+		j = &job[nb_submitted % nb_jobs];
+		if (!zstd_mt_reserve(&j->out, &j->out_alloc, (size_t)d_size))
+			bb_error_msg_and_err("memory allocation error");
+		j->out_size = (size_t)d_size;
+		if (mt->frame != NULL) {
+			if (!zstd_mt_reserve(&j->in, &j->in_alloc, (size_t)c_size))
+				bb_error_msg_and_err("memory allocation error");
+			if (!zstd_mt_read(mt, j->in, c_size))
+				goto err;
+			j->in_size = (size_t)c_size;
+		} else if (!zstd_mt_read_frame(mt, j, &zfh)) {
+			goto err;
+		}
+		j->done = FALSE;
+		if (!pool_submit(&mt->pool, j))
+			bb_error_msg_and_err("could not queue frame");
+		nb_submitted++;
+	}
+	for (; nb_flushed < nb_submitted; nb_flushed++) {
+		if (!zstd_mt_flush(mt, &job[nb_flushed % nb_jobs], &n))
+			goto err;
+	}
+	ret = true;
+
+err:
+	/* This waits for the frames that are still being decoded */
+	pool_destroy(&mt->pool);
+	for (i = 0; (job != NULL) && (i < nb_jobs); i++) {
+		free(job[i].in);
+		free(job[i].out);
+	}
+	free(job);
+	for (i = 0; (mt->dctx != NULL) && (i < nb_workers); i++)
+		ZSTD_freeDCtx(mt->dctx[i]);
+	free(mt->dctx);
+	ZSTD_freeDStream(dctx);
+	free(out_buff);
+	free(mt->buf);
+	free(mt->frame);
+	return ret ? n : -1;
+}
+
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_zstd_stream(transformer_state_t *xstate)
 {
@@ -125,6 +540,59 @@ unpack_zstd_stream(transformer_state_t *xstate)
 	IF_DESKTOP(long long) int result;
 	void *out_buff;
 	ZSTD_DStream *dctx;
+	zstd_mt_t mt = { 0 };
+	ZSTD_frameHeader zfh;
+	uint8_t header[ZSTD_FRAMEHEADERSIZE_MAX];
+	uint64_t offset = 0;
+	uint32_t i, nb_workers, nb_jobs;
+	off_t start, c_offset = 0;
+	bool use_mt = false;
+
+	/*
+	 * Use multithreaded decompression if the stream has a seek table or starts with a frame
+	 * that is small enough for a worker, as long as we can seek the source and the output
+	 * doesn't go to memory. Starting at an offset is only possible with a seek table.
+	 */
+	nb_workers = MIN(get_cpu_count(), ZSTD_MT_MAX_THREADS);
+	if (((nb_workers > 1) || (xstate->dst_offset != 0)) && !xstate->signature_skipped &&
+	    (xstate->mem_output_size_max == 0) && (bled_read == NULL) && (xstate->src_fd != bb_virtual_fd)) {
+		start = lseek(xstate->src_fd, 0, SEEK_CUR);
+		if ((start != (off_t)-1) && zstd_mt_parse_seek_table(xstate->src_fd, start, &mt)) {
+			for (i = 0; i < mt.nb_frames; i++) {
+				if (xstate->dst_offset < offset + mt.frame[i].d_size)
+					break;
+				offset += mt.frame[i].d_size;
+				c_offset += mt.frame[i].c_size;
+			}
+			if (i >= mt.nb_frames) {
+				free(mt.frame);
+				bb_error_msg("offset is beyond the end of the uncompressed data");
+				return -1;
+			}
+			mt.first_frame = i;
+			mt.skip = xstate->dst_offset - offset;
+			use_mt = true;
+		} else if ((start != (off_t)-1) && (xstate->dst_offset == 0) &&
+		    zstd_mt_pread(xstate->src_fd, start, header, sizeof(header)) &&
+		    (ZSTD_getFrameHeader(&zfh, header, sizeof(header)) == 0) &&
+		    (zfh.frameType == ZSTD_frame) && (zfh.frameContentSize <= ZSTD_MT_MAX_FRAME_SIZE)) {
+			/* Multi-frame streams without a seek table, such as the ones from pzstd */
+			use_mt = true;
+		}
+		if ((start == (off_t)-1) || (lseek(xstate->src_fd, start + c_offset, SEEK_SET) != start + c_offset)) {
+			free(mt.frame);
+			bb_error_msg("seek error (errno: %d)", errno);
+			return -1;
+		}
+		if (use_mt) {
+			nb_jobs = (uint32_t)MIN(2 * nb_workers, ZSTD_MT_MAX_MEMORY / (ZSTD_MT_MAX_FRAME_SIZE + ZSTD_MT_MAX_INPUT_SIZE));
+			return unpack_zstd_stream_mt(xstate, &mt, MIN(nb_workers, nb_jobs), nb_jobs);
+		}
+	}
+	if (xstate->dst_offset != 0) {
+		bb_error_msg("starting at an offset requires a seekable zstd image");
+		return -1;
+	}
 
 	dctx = ZSTD_createDStream();
 	if (!dctx) {
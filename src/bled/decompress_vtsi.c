@@ -9,6 +9,7 @@
 
 #include "libbb.h"
 #include "bb_archive.h"
+#include "thread.h"
 
 /*
  * Structure of a Ventoy Sparse Image (VTSI) file:
@@ -111,6 +112,177 @@ err:
 	return valid;
 }
 
+/*
+ * Since the footer gives us the layout of the disk, we don't need to go through the data
+ * sequentially, and instead issue large positioned reads and writes, with a few of them in
+ * flight, so that reading from the image and writing to the target overlap. The areas of
+ * the target that aren't covered by a segment are left untouched, or discarded if asked.
+ */
+#define VTSI_MT_REQUESTS    4
+#define VTSI_MT_ALIGN       4096
+
+typedef struct {
+	uint64_t src_offset;
+	uint64_t dst_offset;
+	uint32_t size;
+	bool busy;		/* Only accessed by the main thread */
+	volatile LONG done;
+	int error;
+} vtsi_mt_job_t;
+
+typedef struct {
+	int src_fd;
+	int dst_fd;
+	uint8_t *mem;
+	uint8_t *buf[VTSI_MT_REQUESTS];	/* One buffer per worker */
+	vtsi_mt_job_t job[2 * VTSI_MT_REQUESTS];
+	pool_t pool;
+} vtsi_mt_t;
+
+/* Positioned I/O, that doesn't depend on (or alter) a file position shared between threads */
+static int vtsi_pio(int fd, uint8_t *buf, uint32_t size, uint64_t offset, bool is_write)
+{
+	uint32_t pos;
+	int r;
+#if defined(_WIN32)
+	OVERLAPPED ov;
+	DWORD rw;
+#endif
+
+	for (pos = 0; pos < size; pos += r) {
+#if defined(_WIN32)
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)(offset + pos);
+		ov.OffsetHigh = (DWORD)((offset + pos) >> 32);
+		if (!(is_write ? WriteFile((HANDLE)_get_osfhandle(fd), &buf[pos], size - pos, &rw, &ov) :
+			ReadFile((HANDLE)_get_osfhandle(fd), &buf[pos], size - pos, &rw, &ov))) {
+			errno = EIO;
+			return -1;
+		}
+		r = (int)rw;
+#else
+		r = (int)(is_write ? pwrite(fd, &buf[pos], size - pos, (off_t)(offset + pos)) :
+			pread(fd, &buf[pos], size - pos, (off_t)(offset + pos)));
+		if (r < 0)
+			return -1;
+#endif
+		if (r == 0) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static BOOL vtsi_mt_copy(void *context, uint32_t worker, void *_job)
+{
+	vtsi_mt_t *mt = (vtsi_mt_t *)context;
+	vtsi_mt_job_t *job = (vtsi_mt_job_t *)_job;
+
+	job->error = 0;
+	errno = 0;
+	if ((vtsi_pio(mt->src_fd, mt->buf[worker], job->size, job->src_offset, false) < 0) ||
+	    (vtsi_pio(mt->dst_fd, mt->buf[worker], job->size, job->dst_offset, true) < 0))
+		job->error = (errno != 0) ? errno : EIO;
+	atomic_store_release(&job->done, TRUE);
+	return (job->error == 0);
+}
+
+/* Wait for the copy in a job slot to complete, if there is one, and report its progress */
+static bool vtsi_mt_flush(vtsi_mt_t *mt, vtsi_mt_job_t *job)
+{
+	if (!job->busy)
+		return true;
+	job->busy = false;
+	mutex_lock(&mt->pool.lock);
+	while (!atomic_load_acquire(&job->done))
+		cond_wait(&mt->pool.done_cond, &mt->pool.lock, 100);
+	mutex_unlock(&mt->pool.lock);
+	if (job->error != 0) {
+		bb_error_msg("could not copy data to sector %llu (errno: %d)",
+			(long long unsigned int)job->dst_offset / 512, job->error);
+		return false;
+	}
+	bb_total_rb += job->size;
+	if (bled_progress != NULL)
+		bled_progress(bb_total_rb);
+	return true;
+}
+
+/* Discard the part of the target between 'start' and 'end', if requested and still possible */
+static void vtsi_discard(discard_t *discard, int fd, uint64_t start, uint64_t end)
+{
+	if ((*discard == NULL) || (end <= start))
+		return;
+	if ((*discard)(fd, start, end - start) != 0) {
+		bb_printf("Notice: Could not discard the unused areas of the target");
+		*discard = NULL;
+	}
+}
+
+static IF_DESKTOP(long long) int vtsi_copy_segments(transformer_state_t* xstate, VTSI_FOOTER* footer,
+	VTSI_SEGMENT* segment)
+{
+	vtsi_mt_t mt = { 0 };
+	vtsi_mt_job_t *job;
+	discard_t discard = bled_discard;
+	uint64_t seg, pos, datalen, src_offset = 0, end = 0;
+	uint32_t i, j = 0;
+	long long tot = 0;
+	bool ret = false;
+
+	mt.src_fd = xstate->src_fd;
+	mt.dst_fd = xstate->dst_fd;
+	mt.mem = xmalloc((size_t)VTSI_MT_REQUESTS * MAX_READ_BUF + VTSI_MT_ALIGN);
+	if (mt.mem == NULL)
+		bb_error_msg_and_err("Failed to alloc data buffers");
+	for (i = 0; i < VTSI_MT_REQUESTS; i++)
+		mt.buf[i] = (uint8_t*)((((uintptr_t)mt.mem + VTSI_MT_ALIGN - 1) & ~(uintptr_t)(VTSI_MT_ALIGN - 1)) +
+			(size_t)i * MAX_READ_BUF);
+	if (!pool_create(&mt.pool, VTSI_MT_REQUESTS, ARRAYSIZE(mt.job), vtsi_mt_copy, &mt))
+		bb_error_msg_and_err("could not create I/O threads");
+
+	for (seg = 0; seg < footer->segment_num; seg++) {
+		datalen = segment[seg].sector_num * 512;
+		/* Like the sequential reader, we expect the data of the segments to follow each other */
+		if ((src_offset + datalen > footer->segment_offset) ||
+		    (segment[seg].disk_start_sector * 512 + datalen > footer->disk_size))
+			bb_error_msg_and_err("invalid vtsi segment %llu", (long long unsigned int)seg);
+		/* Segments are in disk order, so the gaps are between consecutive ones */
+		vtsi_discard(&discard, mt.dst_fd, end, segment[seg].disk_start_sector * 512);
+		end = MAX(end, segment[seg].disk_start_sector * 512 + datalen);
+		for (pos = 0; pos < datalen; pos += job->size) {
+			if ((bled_cancel_request != NULL) && (*bled_cancel_request != 0))
+				goto err;
+			job = &mt.job[j];
+			j = (j + 1) % ARRAYSIZE(mt.job);
+			if (!vtsi_mt_flush(&mt, job))
+				goto err;
+			job->src_offset = src_offset + pos;
+			job->dst_offset = segment[seg].disk_start_sector * 512 + pos;
+			job->size = (uint32_t)MIN(datalen - pos, MAX_READ_BUF);
+			job->done = FALSE;
+			if (!pool_submit(&mt.pool, job))
+				bb_error_msg_and_err("could not queue data copy");
+			job->busy = true;
+			tot += job->size;
+		}
+		src_offset += datalen;
+	}
+	for (i = 0; i < ARRAYSIZE(mt.job); i++) {
+		if (!vtsi_mt_flush(&mt, &mt.job[(j + i) % ARRAYSIZE(mt.job)]))
+			goto err;
+	}
+	vtsi_discard(&discard, mt.dst_fd, end, footer->disk_size);
+	ret = true;
+
+err:
+	/* This waits for the copies that are still in flight */
+	pool_destroy(&mt.pool);
+	free(mt.mem);
+	return ret ? tot : -1;
+}
+
 IF_DESKTOP(long long) int FAST_FUNC unpack_vtsi_stream(transformer_state_t* xstate)
 {
 	IF_DESKTOP(long long) int n = -EFAULT;
@@ -122,7 +294,7 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_vtsi_stream(transformer_state_t* xsta
 	uint64_t seg = 0;
 	int64_t datalen = 0;
 	uint64_t phy_offset = 0;
-	size_t max_buflen = MAX_READ_BUF;
+	size_t max_buflen = BB_BUFSIZE;
 	uint8_t* buf = NULL;
 	VTSI_SEGMENT* segment = NULL;
 	VTSI_SEGMENT* cur_seg = NULL;
@@ -154,6 +326,13 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_vtsi_stream(transformer_state_t* xsta
 	if (!check_vtsi_segment(&footer, segment))
 		goto err;
 
+	/* Write the segments to their location, unless the data goes to memory or a write function */
+	if ((xstate->mem_output_size_max == 0) && (xstate->dst_fd >= 0) && (bled_read == NULL) &&
+	    (bled_write == NULL) && (src_fd != bb_virtual_fd)) {
+		n = vtsi_copy_segments(xstate, &footer, segment);
+		goto err;
+	}
+
 	/* read data */
 	lseek(src_fd, 0, SEEK_SET);
 	for (seg = 0; seg < footer.segment_num; seg++) {
@@ -18,6 +18,7 @@
 
 #include "platform.h"
 #include "msapi_utf8.h"
+#include "bled.h"
 
 #include <ctype.h>
 #include <errno.h>
@@ -123,13 +124,62 @@ typedef unsigned int uid_t;
 #define get_le16(ptr) (*(const uint16_t *)(ptr))
 #endif
 
-extern uint32_t BB_BUFSIZE;
-extern smallint bb_got_signal;
-extern uint32_t *global_crc32_table;
-extern jmp_buf bb_error_jmp;
-extern char* bb_virtual_buf;
-extern size_t bb_virtual_len, bb_virtual_pos;
-extern int bb_virtual_fd;
+#if defined(_MSC_VER)
+#define BLED_TLS __declspec(thread)
+#else
+#define BLED_TLS __thread
+#endif
+
+/*
+ * All the state of a decompression operation. The context in use is set, per thread, by
+ * the bled_ctx_*() entry points, and the macros below let the decompressors access it.
+ */
+struct bled_ctx {
+	uint32_t bufsize;
+	smallint got_signal;
+	uint64_t total_rb;
+	uint32_t *crc32_table;
+	jmp_buf error_jmp;
+	char *virtual_buf;
+	size_t virtual_len, virtual_pos;
+	int virtual_fd;
+	printf_t printf_function;
+	read_t read_function;
+	write_t write_function;
+	progress_t progress_function;
+	switch_t switch_function;
+	unsigned long *cancel_request;
+	uint32_t sink_nb_buffers;
+	uint32_t sink_buffer_size;
+	uint32_t sink_sector_size;
+	struct bled_sink *sink;
+	discard_t discard_function;
+	char *gz_index_path;
+	uint32_t gz_index_span;
+};
+
+extern BLED_TLS struct bled_ctx *bled_cur_ctx;
+
+#define BB_BUFSIZE          (bled_cur_ctx->bufsize)
+#define bb_got_signal       (bled_cur_ctx->got_signal)
+#define bb_total_rb         (bled_cur_ctx->total_rb)
+#define global_crc32_table  (bled_cur_ctx->crc32_table)
+#define bb_error_jmp        (bled_cur_ctx->error_jmp)
+#define bb_virtual_buf      (bled_cur_ctx->virtual_buf)
+#define bb_virtual_len      (bled_cur_ctx->virtual_len)
+#define bb_virtual_pos      (bled_cur_ctx->virtual_pos)
+#define bb_virtual_fd       (bled_cur_ctx->virtual_fd)
+#define bled_printf         ((bled_cur_ctx != NULL) ? bled_cur_ctx->printf_function : NULL)
+#define bled_read           (bled_cur_ctx->read_function)
+#define bled_write          (bled_cur_ctx->write_function)
+#define bled_progress       (bled_cur_ctx->progress_function)
+#define bled_switch         (bled_cur_ctx->switch_function)
+#define bled_cancel_request (bled_cur_ctx->cancel_request)
+#define bled_discard        (bled_cur_ctx->discard_function)
+
+bool bled_sink_start(int fd);
+int bled_sink_write(const void *buffer, unsigned int count);
+bool bled_sink_finish(void);
 
 uint32_t* crc32_filltable(uint32_t *crc_table, int endian);
 uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_le);
@@ -157,13 +207,6 @@ struct timeval64 {
 	int32_t tv_usec;
 };
 
-extern void (*bled_printf) (const char* format, ...);
-extern void (*bled_progress) (const uint64_t processed_bytes);
-extern void (*bled_switch) (const char* filename, const uint64_t filesize);
-extern int (*bled_read)(int fd, void* buf, unsigned int count);
-extern int (*bled_write)(int fd, const void* buf, unsigned int count);
-extern unsigned long* bled_cancel_request;
-
 #define xfunc_die() longjmp(bb_error_jmp, 1)
 #define bb_printf(...) do { if (bled_printf != NULL) bled_printf(__VA_ARGS__); \
 	else { printf(__VA_ARGS__); putchar('\n'); } } while(0)
@@ -218,7 +261,6 @@ static inline pid_t wait(int* status) { *status = 4; return -1; }
 #define wait_any_nohang wait
 
 /* This enables the display of a progress based on the number of bytes read */
-extern uint64_t bb_total_rb;
 static inline int full_read(int fd, void *buf, unsigned int count) {
 	int rb;
 
@@ -265,6 +307,8 @@ static inline int full_write(int fd, const void* buffer, unsigned int count)
 		return -1;
 	}
 
+	if (bled_cur_ctx->sink != NULL)
+		return bled_sink_write(buffer, count);
 	return (bled_write != NULL) ? bled_write(fd, buffer, count) : _write(fd, buffer, count);
 }
 
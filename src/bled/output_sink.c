@@ -0,0 +1,178 @@
+/*
+ * Bled (Base Library for Easy Decompression)
+ *
+ * Asynchronous output sink
+ * Copyright © 2025 PsychedelicPalimpsest
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include "libbb.h"
+#include "bb_archive.h"
+#include "thread.h"
+
+/*
+ * The decompressor copies its output into a ring of large sector aligned buffers, and a
+ * separate thread writes the full ones to the target, so that decoding and device writes
+ * can overlap. Since the data is accumulated, all the writes are a multiple of the sector
+ * size, except for the very last one, which is padded with zeroes up to the sector size.
+ * When a write function was provided, it is still called with the actual size of the
+ * data for that last write, and it is up to it to use the padded size.
+ */
+#define SINK_WAIT          100
+#define SINK_ALIGN(x, y)   ((((x) + (y) - 1) / (y)) * (y))
+
+typedef struct {
+	uint8_t *data;
+	uint32_t size;
+} sink_buf_t;
+
+struct bled_sink {
+	int fd;
+	uint32_t nb_buffers;
+	uint32_t buffer_size;
+	uint32_t sector_size;
+	uint8_t *mem;
+	sink_buf_t *buf;
+	sink_buf_t *cur;	/* Buffer that is being filled by the decompressor */
+	sink_buf_t eos;		/* Queued after the last buffer, to stop the writer */
+	spsc_queue_t full_q;
+	spsc_queue_t free_q;
+	thread_t thread;
+	volatile LONG error;	/* errno of the first write that failed */
+	write_t write_function;
+};
+
+static DWORD WINAPI sink_thread(void *param)
+{
+	struct bled_sink *sink = (struct bled_sink *)param;
+	sink_buf_t *b;
+	uint32_t size;
+	int w;
+
+	for (;;) {
+		b = spsc_pop_wait(&sink->full_q, SINK_WAIT);
+		if (b == NULL)
+			continue;
+		if (b == &sink->eos)
+			break;
+		/* Once a write has failed, the remaining buffers are just recycled */
+		if (!atomic_load_acquire(&sink->error)) {
+			size = SINK_ALIGN(b->size, sink->sector_size);
+			errno = 0;
+			if (sink->write_function != NULL)
+				w = (sink->write_function(sink->fd, b->data, b->size) == (int)b->size) ? (int)size : -1;
+			else
+				w = _write(sink->fd, b->data, size);
+			if (w != (int)size)
+				atomic_store_release(&sink->error, (errno != 0) ? errno : EIO);
+		}
+		while (!spsc_push_wait(&sink->free_q, b, SINK_WAIT));
+	}
+	return 0;
+}
+
+static void sink_free(struct bled_sink *sink)
+{
+	spsc_destroy(&sink->full_q);
+	spsc_destroy(&sink->free_q);
+	free(sink->buf);
+	free(sink->mem);
+	free(sink);
+}
+
+/* Set up the asynchronous output for 'fd', if it was enabled for the current context */
+bool bled_sink_start(int fd)
+{
+	struct bled_sink *sink;
+	uint32_t i;
+
+	if (bled_cur_ctx->sink_nb_buffers == 0)
+		return true;
+	sink = xzalloc(sizeof(struct bled_sink));
+	if (sink == NULL)
+		goto err;
+	sink->fd = fd;
+	sink->nb_buffers = bled_cur_ctx->sink_nb_buffers;
+	sink->buffer_size = bled_cur_ctx->sink_buffer_size;
+	sink->sector_size = bled_cur_ctx->sink_sector_size;
+	sink->write_function = bled_write;
+	sink->mem = malloc((size_t)sink->nb_buffers * sink->buffer_size + sink->sector_size);
+	sink->buf = xzalloc(sink->nb_buffers * sizeof(sink_buf_t));
+	if ((sink->mem == NULL) || (sink->buf == NULL) ||
+	    !spsc_init(&sink->full_q, sink->nb_buffers + 1) || !spsc_init(&sink->free_q, sink->nb_buffers))
+		goto err;
+	for (i = 0; i < sink->nb_buffers; i++) {
+		sink->buf[i].data = (uint8_t *)SINK_ALIGN((uintptr_t)sink->mem, sink->sector_size) +
+			(size_t)i * sink->buffer_size;
+		spsc_push(&sink->free_q, &sink->buf[i]);
+	}
+	if (!thread_create(&sink->thread, sink_thread, sink))
+		goto err;
+	bled_cur_ctx->sink = sink;
+	return true;
+
+err:
+	bb_error_msg("could not set up the output buffers");
+	if (sink != NULL)
+		sink_free(sink);
+	return false;
+}
+
+/* Queue the data from the decompressor, to be written by the sink thread */
+int bled_sink_write(const void *buffer, unsigned int count)
+{
+	struct bled_sink *sink = bled_cur_ctx->sink;
+	const uint8_t *buf = (const uint8_t *)buffer;
+	unsigned int pos, size;
+
+	for (pos = 0; pos < count; pos += size) {
+		if (atomic_load_acquire(&sink->error)) {
+			errno = (int)sink->error;
+			return -1;
+		}
+		if (sink->cur == NULL) {
+			sink->cur = spsc_pop_wait(&sink->free_q, SINK_WAIT);
+			if (sink->cur == NULL) {
+				size = 0;
+				continue;
+			}
+			sink->cur->size = 0;
+		}
+		size = MIN(count - pos, sink->buffer_size - sink->cur->size);
+		memcpy(&sink->cur->data[sink->cur->size], &buf[pos], size);
+		sink->cur->size += size;
+		if (sink->cur->size == sink->buffer_size) {
+			while (!spsc_push_wait(&sink->full_q, sink->cur, SINK_WAIT));
+			sink->cur = NULL;
+		}
+	}
+	return (int)count;
+}
+
+/*
+ * Write the data that is still buffered and wait for the sink thread to complete.
+ * Returns false if any of the writes failed.
+ */
+bool bled_sink_finish(void)
+{
+	struct bled_sink *sink = bled_cur_ctx->sink;
+	uint32_t size;
+	bool r;
+
+	if (sink == NULL)
+		return true;
+	bled_cur_ctx->sink = NULL;
+	if ((sink->cur != NULL) && (sink->cur->size != 0)) {
+		size = SINK_ALIGN(sink->cur->size, sink->sector_size);
+		memset(&sink->cur->data[sink->cur->size], 0, size - sink->cur->size);
+		while (!spsc_push_wait(&sink->full_q, sink->cur, SINK_WAIT));
+	}
+	while (!spsc_push_wait(&sink->full_q, &sink->eos, SINK_WAIT));
+	thread_join(sink->thread);
+	r = !sink->error;
+	if (!r)
+		bb_error_msg("write error (errno: %d)", (int)sink->error);
+	sink_free(sink);
+	return r;
+}
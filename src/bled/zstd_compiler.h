@@ -166,8 +166,11 @@
 
 /* vectorization
  * older GCC (pre gcc-4.3 picked as the cutoff) uses a different syntax,
- * and some compilers, like Intel ICC and MCST LCC, do not support it at all. */
-#if !defined(__INTEL_COMPILER) && !defined(__clang__) && defined(__GNUC__) && !defined(__LCC__)
+ * and some compilers, like Intel ICC and MCST LCC, do not support it at all.
+ * With the optimize pragma from zstd_config.h in effect, GCC also won't inline
+ * the bitstream helpers into a function that combines an optimize attribute
+ * with BMI2_TARGET_ATTRIBUTE, so leave it out when DYNAMIC_BMI2 is set. */
+#if !defined(__INTEL_COMPILER) && !defined(__clang__) && defined(__GNUC__) && !defined(__LCC__) && !DYNAMIC_BMI2
 #  if (__GNUC__ == 4 && __GNUC_MINOR__ > 3) || (__GNUC__ >= 5)
 #    define DONT_VECTORIZE __attribute__((optimize("no-tree-vectorize")))
 #  else
@@ -29,14 +29,6 @@
 #endif
 #endif
 
-#if CONFIG_FEATURE_ZSTD_SMALL > 0
-/* no dynamic detection of bmi2 instruction,
- * prefer using CFLAGS setting to -march=haswell or similar */
-# if !defined(__BMI2__)
-#  define DYNAMIC_BMI2 0
-# endif
-#endif
-
 #ifdef __GNUC__
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-function"
@@ -52,6 +44,22 @@
 #define __has_feature(x) 0
 #endif
 
+/* Compile the BMI2 variants of the entropy and sequence decoders alongside the
+ * generic ones, and pick them at runtime (see ZSTD_cpuSupportsBmi2()), on x86_64
+ * with gcc or clang. The small builds leave them out, and a build for a target
+ * that always has BMI2 (-mbmi2, -march=haswell) uses it everywhere instead. */
+#ifndef DYNAMIC_BMI2
+# if CONFIG_FEATURE_ZSTD_SMALL > 0 || defined(__BMI2__) || defined(ZSTD_NO_INTRINSICS)
+#  define DYNAMIC_BMI2 0
+# elif defined(__x86_64__) && \
+       ((defined(__clang__) && __has_attribute(__target__)) || \
+        (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))))
+#  define DYNAMIC_BMI2 1
+# else
+#  define DYNAMIC_BMI2 0
+# endif
+#endif
+
 /* Include zstd_deps.h first with all the options we need enabled. */
 #define ZSTD_DEPS_NEED_MALLOC
 #define ZSTD_DEPS_NEED_MATH64
@@ -0,0 +1,310 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Block comparison kernels, with runtime SIMD dispatch
+ * Copyright © 2025 PsychedelicPalimpsest
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include <pseudo_windows.h>
+#include "rufus.h"
+
+#if (defined(_M_X64) || defined(__x86_64__))
+#define CPU_X86_64_SIMD                 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#elif (defined(_M_ARM64) || defined(__aarch64__))
+#define CPU_ARM64_SIMD                  1
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#define RUFUS_ENABLE_GCC_ARCH(arch)
+#else
+#define RUFUS_ENABLE_GCC_ARCH(arch) __attribute__ ((target (arch)))
+#endif
+
+/* Amount of data we process between two checks for an early exit */
+#define UNIFORM_STRIDE      256
+
+/* Amount of data the SIMD compare kernels check at once */
+#define COMPARE_STRIDE      64
+
+typedef BOOL (*is_uniform_t)(const uint8_t* buf, size_t size, uint32_t value);
+typedef size_t (*compare_t)(const uint8_t* a, const uint8_t* b, size_t size);
+
+static is_uniform_t is_uniform_kernel = NULL;
+static compare_t compare_kernel = NULL;
+static const char* is_uniform_name = NULL;
+
+/* Used for the data that the SIMD kernels don't cover */
+static BOOL is_uniform_c(const uint8_t* buf, size_t size, uint32_t value)
+{
+	const uint64_t v64 = ((uint64_t)value << 32) | value;
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		memcpy(&w, &buf[i], sizeof(w));
+		if (w != v64)
+			return FALSE;
+	}
+	for (; i < size; i++) {
+		if (buf[i] != ((uint8_t*)&value)[i % sizeof(uint32_t)])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Return the offset of the first byte that differs, or size if the blocks are the same */
+static size_t compare_c(const uint8_t* a, const uint8_t* b, size_t size)
+{
+	uint64_t wa, wb;
+	size_t i;
+
+	for (i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		memcpy(&wa, &a[i], sizeof(wa));
+		memcpy(&wb, &b[i], sizeof(wb));
+		if (wa != wb)
+			break;
+	}
+	for (; i < size; i++) {
+		if (a[i] != b[i])
+			return i;
+	}
+	return size;
+}
+
+#if defined(CPU_X86_64_SIMD)
+/* SSE2 is part of the x86_64 baseline, so it doesn't need to be detected */
+static BOOL is_uniform_sse2(const uint8_t* buf, size_t size, uint32_t value)
+{
+	const __m128i v = _mm_set1_epi32((int)value);
+	__m128i acc;
+	size_t i, j;
+
+	for (i = 0; i + UNIFORM_STRIDE <= size; i += UNIFORM_STRIDE) {
+		acc = _mm_setzero_si128();
+		for (j = 0; j < UNIFORM_STRIDE; j += 4 * sizeof(__m128i)) {
+			acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)&buf[i + j]), v));
+			acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)&buf[i + j + 16]), v));
+			acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)&buf[i + j + 32]), v));
+			acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)&buf[i + j + 48]), v));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+			return FALSE;
+	}
+	return is_uniform_c(&buf[i], size - i, value);
+}
+
+/* The SIMD compare kernels only locate the stride that differs, and leave the rest to compare_c() */
+static size_t compare_sse2(const uint8_t* a, const uint8_t* b, size_t size)
+{
+	__m128i eq;
+	size_t i, j;
+
+	for (i = 0; i + COMPARE_STRIDE <= size; i += COMPARE_STRIDE) {
+		eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&a[i]), _mm_loadu_si128((const __m128i*)&b[i]));
+		for (j = 16; j < COMPARE_STRIDE; j += 16)
+			eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&a[i + j]),
+				_mm_loadu_si128((const __m128i*)&b[i + j])));
+		if (_mm_movemask_epi8(eq) != 0xffff)
+			break;
+	}
+	return i + compare_c(&a[i], &b[i], size - i);
+}
+
+RUFUS_ENABLE_GCC_ARCH("avx2")
+static BOOL is_uniform_avx2(const uint8_t* buf, size_t size, uint32_t value)
+{
+	const __m256i v = _mm256_set1_epi32((int)value);
+	__m256i acc;
+	size_t i, j;
+
+	for (i = 0; i + UNIFORM_STRIDE <= size; i += UNIFORM_STRIDE) {
+		acc = _mm256_setzero_si256();
+		for (j = 0; j < UNIFORM_STRIDE; j += 4 * sizeof(__m256i)) {
+			acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&buf[i + j]), v));
+			acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&buf[i + j + 32]), v));
+			acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&buf[i + j + 64]), v));
+			acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&buf[i + j + 96]), v));
+		}
+		if (!_mm256_testz_si256(acc, acc))
+			return FALSE;
+	}
+	return is_uniform_c(&buf[i], size - i, value);
+}
+
+RUFUS_ENABLE_GCC_ARCH("avx2")
+static size_t compare_avx2(const uint8_t* a, const uint8_t* b, size_t size)
+{
+	__m256i eq;
+	size_t i;
+
+	for (i = 0; i + COMPARE_STRIDE <= size; i += COMPARE_STRIDE) {
+		eq = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&a[i]), _mm256_loadu_si256((const __m256i*)&b[i])),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&a[i + 32]), _mm256_loadu_si256((const __m256i*)&b[i + 32])));
+		if ((uint32_t)_mm256_movemask_epi8(eq) != 0xffffffff)
+			break;
+	}
+	return i + compare_c(&a[i], &b[i], size - i);
+}
+
+/*
+ * Detect if the processor supports AVX2. Unlike what is the case for SHA, we do need
+ * to check that the OS saves the YMM registers, as AVX may be disabled in some VMs.
+ */
+static BOOL DetectAVX2(void)
+{
+#if defined(_MSC_VER)
+	int regs0[4] = { 0,0,0,0 }, regs1[4] = { 0,0,0,0 }, regs7[4] = { 0,0,0,0 };
+	const int OSXSAVE_BIT = 1 << 27;	/* Function 1, Bit 27 of ECX */
+	const int AVX_BIT = 1 << 28;		/* Function 1, Bit 28 of ECX */
+	const int AVX2_BIT = 1 << 5;		/* Function 7, Bit  5 of EBX */
+
+	__cpuid(regs0, 0);
+	if (regs0[0] < 0x07)
+		return FALSE;
+	__cpuidex(regs1, 1, 0);
+	__cpuidex(regs7, 7, 0);
+	if (!(regs1[2] & OSXSAVE_BIT) || !(regs1[2] & AVX_BIT) || !(regs7[1] & AVX2_BIT))
+		return FALSE;
+	/* XCR0 bits 1 and 2: SSE and AVX state */
+	return ((_xgetbv(0) & 0x06) == 0x06) ? TRUE : FALSE;
+#elif defined(__GNUC__) || defined(__clang__)
+	/* This also checks for OS support */
+	return __builtin_cpu_supports("avx2") ? TRUE : FALSE;
+#else
+	return FALSE;
+#endif
+}
+#endif
+
+#if defined(CPU_ARM64_SIMD)
+/* NEON is mandatory on ARM64 */
+static BOOL is_uniform_neon(const uint8_t* buf, size_t size, uint32_t value)
+{
+	const uint32x4_t v = vdupq_n_u32(value);
+	uint32x4_t acc;
+	size_t i, j;
+
+	for (i = 0; i + UNIFORM_STRIDE <= size; i += UNIFORM_STRIDE) {
+		acc = vdupq_n_u32(0);
+		for (j = 0; j < UNIFORM_STRIDE; j += 4 * sizeof(uint32x4_t)) {
+			acc = vorrq_u32(acc, veorq_u32(vld1q_u32((const uint32_t*)&buf[i + j]), v));
+			acc = vorrq_u32(acc, veorq_u32(vld1q_u32((const uint32_t*)&buf[i + j + 16]), v));
+			acc = vorrq_u32(acc, veorq_u32(vld1q_u32((const uint32_t*)&buf[i + j + 32]), v));
+			acc = vorrq_u32(acc, veorq_u32(vld1q_u32((const uint32_t*)&buf[i + j + 48]), v));
+		}
+		if (vmaxvq_u32(acc) != 0)
+			return FALSE;
+	}
+	return is_uniform_c(&buf[i], size - i, value);
+}
+
+static size_t compare_neon(const uint8_t* a, const uint8_t* b, size_t size)
+{
+	uint8x16_t eq;
+	size_t i, j;
+
+	for (i = 0; i + COMPARE_STRIDE <= size; i += COMPARE_STRIDE) {
+		eq = vceqq_u8(vld1q_u8(&a[i]), vld1q_u8(&b[i]));
+		for (j = 16; j < COMPARE_STRIDE; j += 16)
+			eq = vandq_u8(eq, vceqq_u8(vld1q_u8(&a[i + j]), vld1q_u8(&b[i + j])));
+		if (vminvq_u8(eq) != 0xff)
+			break;
+	}
+	return i + compare_c(&a[i], &b[i], size - i);
+}
+#endif
+
+/* Select the fastest kernel for this CPU */
+static void SelectBlockKernels(void)
+{
+	if (is_uniform_kernel != NULL)
+		return;
+#if defined(CPU_X86_64_SIMD)
+	if (DetectAVX2()) {
+		is_uniform_name = "AVX2";
+		compare_kernel = compare_avx2;
+		is_uniform_kernel = is_uniform_avx2;
+	} else {
+		is_uniform_name = "SSE2";
+		compare_kernel = compare_sse2;
+		is_uniform_kernel = is_uniform_sse2;
+	}
+#elif defined(CPU_ARM64_SIMD)
+	is_uniform_name = "NEON";
+	compare_kernel = compare_neon;
+	is_uniform_kernel = is_uniform_neon;
+#else
+	is_uniform_name = "C";
+	compare_kernel = compare_c;
+	is_uniform_kernel = is_uniform_c;
+#endif
+}
+
+/* Return the name of the instruction set the block kernels use, for the log */
+const char* GetBlockKernelName(void)
+{
+	SelectBlockKernels();
+	return is_uniform_name;
+}
+
+/*
+ * Check whether a block only contains 0x00 or only contains 0xFF bytes, which is
+ * what we get from a zeroed drive or from erased flash. size must be a multiple of 4.
+ * On success, the 32-bit value the block is made of is returned in value.
+ */
+BOOL IsUniformBlock(const uint8_t* buf, size_t size, uint32_t* value)
+{
+	uint32_t first;
+
+	if ((buf == NULL) || (size < sizeof(uint32_t)))
+		return FALSE;
+	memcpy(&first, buf, sizeof(first));
+	// Check all bits are the same
+	if ((first != 0) && (first != 0xffffffff))
+		return FALSE;
+	SelectBlockKernels();
+	if (!is_uniform_kernel(buf, size, first))
+		return FALSE;
+	if (value != NULL)
+		*value = first;
+	return TRUE;
+}
+
+/*
+ * Compare two blocks and return the offset of the first byte that differs,
+ * or size if both blocks are identical.
+ */
+size_t CompareBlocks(const uint8_t* a, const uint8_t* b, size_t size)
+{
+	if ((a == NULL) || (b == NULL))
+		return 0;
+	SelectBlockKernels();
+	return compare_kernel(a, b, size);
+}
@@ -84,6 +84,7 @@
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
+#include "thread.h"
 
 #if (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__i386) || \
      defined(_X86_) || defined(__I86__) || defined(__x86_64__))
@@ -99,22 +100,40 @@
 
 #undef BIG_ENDIAN_HOST
 
-#define BUFFER_SIZE         (64*KB)
 #define WAIT_TIME           5000
 
-/* Number of buffers we work with */
-#define NUM_BUFFERS         3   // 2 + 1 as a mere double buffered async I/O
-                                // would modify the buffer being processed.
+/* Multi-hash engine: one worker thread per hash, all reading from a ring of shared buffers */
+typedef struct {
+	multihash_t* mh;
+	uint32_t type;
+} multihash_worker_t;
+
+struct multihash {
+	uint32_t hash_mask;
+	uint32_t buf_size;
+	uint32_t nb_bufs;
+	uint8_t* buf;
+	uint32_t* len;				// Amount of data in each buffer
+	uint64_t published;			// Number of buffers handed to the workers so far
+	uint64_t consumed[HASH_MAX];	// Number of buffers each worker is done with
+	uint32_t cur_len;			// Amount of data in the buffer being filled
+	BOOL final, abort;
+	mutex_t lock;
+	cond_t data_cond;			// Signalled when a buffer is published, or when we finalize
+	cond_t free_cond;			// Signalled when a worker is done with a buffer
+	thread_t thread[HASH_MAX];
+	BOOL has_thread[HASH_MAX];
+	HASH_CONTEXT ctx[HASH_MAX];
+	multihash_worker_t worker[HASH_MAX];
+};
 
 /* Globals */
 char hash_str[HASH_MAX][150];
-HANDLE data_ready[HASH_MAX] = { 0 }, thread_ready[HASH_MAX] = { 0 };
-DWORD read_size[NUM_BUFFERS];
 BOOL enable_extra_hashes = FALSE, validate_md5sum = FALSE;
 BOOL cpu_has_sha1_accel = FALSE, cpu_has_sha256_accel = FALSE;
-uint8_t ALIGNED(64) buffer[NUM_BUFFERS][BUFFER_SIZE];
 uint8_t* pe256ssp = NULL;
-uint32_t proc_bufnum, hash_count[HASH_MAX] = { MD5_HASHSIZE, SHA1_HASHSIZE, SHA256_HASHSIZE, SHA512_HASHSIZE };
+uint32_t hash_count[HASH_MAX] = { MD5_HASHSIZE, SHA1_HASHSIZE, SHA256_HASHSIZE, SHA512_HASHSIZE };
+uint32_t hash_buffer_size = HASH_BUFFER_SIZE;
 uint32_t pe256ssp_size = 0;
 uint64_t md5sum_totalbytes;
 StrArray modified_files = { 0 };
@@ -1911,6 +1930,234 @@ out:
 
 
 
+/*
+ * Multi-hash engine.
+ * This computes any combination of MD5, SHA1, SHA256 and SHA512 over a single stream,
+ * in a single pass, by having one worker thread per hash consume a ring of buffers that
+ * the caller fills. Threads only synchronize once per buffer, so, provided the buffers
+ * are large enough, the time spent synchronizing is negligible compared to hashing.
+ */
+static DWORD WINAPI MultiHashWorker(void* param)
+{
+	multihash_worker_t* w = (multihash_worker_t*)param;
+	multihash_t* mh = w->mh;
+	uint32_t slot, type = w->type;
+
+	mutex_lock(&mh->lock);
+	while (1) {
+		while ((mh->consumed[type] == mh->published) && !mh->final && !mh->abort)
+			cond_wait(&mh->data_cond, &mh->lock, INFINITE);
+		if (mh->abort || (mh->consumed[type] == mh->published))
+			break;
+		slot = (uint32_t)(mh->consumed[type] % mh->nb_bufs);
+		mutex_unlock(&mh->lock);
+		hash_write[type](&mh->ctx[type], &mh->buf[(size_t)slot * mh->buf_size], mh->len[slot]);
+		mutex_lock(&mh->lock);
+		mh->consumed[type]++;
+		cond_broadcast(&mh->free_cond);
+	}
+	mutex_unlock(&mh->lock);
+	return 0;
+}
+
+/* Hand the current buffer over to the workers and wait for the next one to be free. Lock must be held. */
+static BOOL MultiHashPublish(multihash_t* mh)
+{
+	uint32_t i;
+	uint64_t oldest;
+
+	mh->len[mh->published % mh->nb_bufs] = mh->cur_len;
+	mh->published++;
+	mh->cur_len = 0;
+	cond_broadcast(&mh->data_cond);
+	while (!mh->abort) {
+		for (oldest = mh->published, i = 0; i < HASH_MAX; i++) {
+			if (mh->hash_mask & (1 << i))
+				oldest = MIN(oldest, mh->consumed[i]);
+		}
+		if (mh->published - oldest < mh->nb_bufs)
+			return TRUE;
+		cond_wait(&mh->free_cond, &mh->lock, INFINITE);
+	}
+	return FALSE;
+}
+
+/*
+ * Create a multi-hash engine for the hashes in hash_mask (bit n set for hash type n),
+ * using nb_bufs buffers of buf_size bytes. Returns NULL on error.
+ */
+multihash_t* MultiHashCreate(uint32_t hash_mask, uint32_t buf_size, uint32_t nb_bufs)
+{
+	multihash_t* mh;
+	uint32_t i;
+
+	hash_mask &= (1 << HASH_MAX) - 1;
+	if (hash_mask == 0)
+		return NULL;
+	mh = (multihash_t*)_mm_malloc(sizeof(multihash_t), 64);
+	if (mh == NULL)
+		return NULL;
+	memset(mh, 0, sizeof(multihash_t));
+	mh->hash_mask = hash_mask;
+	// Keep the buffers page aligned, and a multiple of the page size (and therefore of the
+	// largest hash block size), so that callers can read from unbuffered devices into them.
+	mh->buf_size = HI_ALIGN_X_TO_Y(MAX(buf_size, 64 * KB), 4 * KB);
+	mh->nb_bufs = MAX(nb_bufs, 2);
+	mutex_init(&mh->lock);
+	cond_init(&mh->data_cond);
+	cond_init(&mh->free_cond);
+	mh->buf = (uint8_t*)_mm_malloc((size_t)mh->buf_size * mh->nb_bufs, 4 * KB);
+	mh->len = (uint32_t*)calloc(mh->nb_bufs, sizeof(uint32_t));
+	if ((mh->buf == NULL) || (mh->len == NULL))
+		goto error;
+
+	for (i = 0; i < HASH_MAX; i++) {
+		if (!(hash_mask & (1 << i)))
+			continue;
+		hash_init[i](&mh->ctx[i]);
+		mh->worker[i].mh = mh;
+		mh->worker[i].type = i;
+		mh->has_thread[i] = thread_create(&mh->thread[i], MultiHashWorker, &mh->worker[i]);
+		if (!mh->has_thread[i]) {
+			uprintf("Unable to start hash thread #%d", i);
+			goto error;
+		}
+#ifdef _WIN32
+		SetThreadPriority(mh->thread[i], default_thread_priority);
+#endif
+	}
+	return mh;
+
+error:
+	MultiHashDestroy(mh);
+	return NULL;
+}
+
+#ifdef _WIN32
+/* Apply the affinity masks from SetThreadAffinity(). affinity[0] is for the caller, so we skip it. */
+void MultiHashSetAffinity(multihash_t* mh, const DWORD_PTR* affinity)
+{
+	uint32_t i;
+
+	if ((mh == NULL) || (affinity == NULL))
+		return;
+	for (i = 0; i < HASH_MAX; i++) {
+		if (mh->has_thread[i] && (affinity[i + 1] != 0))
+			SetThreadAffinityMask(mh->thread[i], affinity[i + 1]);
+	}
+}
+#endif
+
+/*
+ * Get the free space of the buffer being filled, so that callers can read data
+ * straight into it. Call MultiHashCommit() with the amount of data that was added.
+ */
+uint8_t* MultiHashGetBuffer(multihash_t* mh, uint32_t* size)
+{
+	if ((mh == NULL) || (size == NULL))
+		return NULL;
+	*size = mh->buf_size - mh->cur_len;
+	return &mh->buf[(size_t)(mh->published % mh->nb_bufs) * mh->buf_size + mh->cur_len];
+}
+
+/* Add len bytes of data that were written to the buffer returned by MultiHashGetBuffer() */
+BOOL MultiHashCommit(multihash_t* mh, uint32_t len)
+{
+	BOOL r = TRUE;
+
+	if ((mh == NULL) || (len > mh->buf_size - mh->cur_len))
+		return FALSE;
+	mh->cur_len += len;
+	if (mh->cur_len == mh->buf_size) {
+		mutex_lock(&mh->lock);
+		r = MultiHashPublish(mh);
+		mutex_unlock(&mh->lock);
+	}
+	return r;
+}
+
+/* Add data to all the hashes. The data is copied, so buf can be reused as soon as this returns. */
+BOOL MultiHashWrite(multihash_t* mh, const uint8_t* buf, size_t len)
+{
+	uint8_t* dst;
+	uint32_t size;
+
+	while (len > 0) {
+		dst = MultiHashGetBuffer(mh, &size);
+		if (dst == NULL)
+			return FALSE;
+		size = (uint32_t)MIN(len, size);
+		memcpy(dst, buf, size);
+		if (!MultiHashCommit(mh, size))
+			return FALSE;
+		buf += size;
+		len -= size;
+	}
+	return TRUE;
+}
+
+/*
+ * Wait for the workers to process all the data and finalize the hashes. For each hash
+ * that was requested, sum[type] receives hash_count[type] bytes. The engine can only
+ * be destroyed after this.
+ */
+BOOL MultiHashFinal(multihash_t* mh, uint8_t sum[HASH_MAX][MAX_HASHSIZE])
+{
+	uint32_t i;
+	BOOL r;
+
+	if (mh == NULL)
+		return FALSE;
+	mutex_lock(&mh->lock);
+	if (mh->cur_len != 0) {
+		mh->len[mh->published % mh->nb_bufs] = mh->cur_len;
+		mh->published++;
+		mh->cur_len = 0;
+	}
+	mh->final = TRUE;
+	cond_broadcast(&mh->data_cond);
+	mutex_unlock(&mh->lock);
+
+	for (i = 0; i < HASH_MAX; i++) {
+		if (mh->has_thread[i])
+			thread_join(mh->thread[i]);
+		mh->has_thread[i] = FALSE;
+	}
+	r = !mh->abort;
+	for (i = 0; r && (i < HASH_MAX); i++) {
+		if (!(mh->hash_mask & (1 << i)))
+			continue;
+		hash_final[i](&mh->ctx[i]);
+		if (sum != NULL)
+			memcpy(sum[i], mh->ctx[i].buf, hash_count[i]);
+	}
+	return r;
+}
+
+/* Stop the workers, if still running, and free the engine */
+void MultiHashDestroy(multihash_t* mh)
+{
+	uint32_t i;
+
+	if (mh == NULL)
+		return;
+	mutex_lock(&mh->lock);
+	mh->abort = TRUE;
+	cond_broadcast(&mh->data_cond);
+	cond_broadcast(&mh->free_cond);
+	mutex_unlock(&mh->lock);
+	for (i = 0; i < HASH_MAX; i++) {
+		if (mh->has_thread[i])
+			thread_join(mh->thread[i]);
+	}
+	cond_destroy(&mh->free_cond);
+	cond_destroy(&mh->data_cond);
+	mutex_destroy(&mh->lock);
+	_mm_free(mh->buf);
+	free(mh->len);
+	_mm_free(mh);
+}
+
 // TODO: Find a linux implmentation
 #ifdef _WIN32
 
@@ -1987,53 +2234,16 @@ INT_PTR CALLBACK HashCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lPa
 	return (INT_PTR)FALSE;
 }
 
-/* Individual thread that computes one of MD5, SHA1, SHA256 or SHA512 in parallel */
-DWORD WINAPI IndividualHashThread(void* param)
-{
-	HASH_CONTEXT hash_ctx = { {0} }; // There's a memset in hash_init, but static analyzers still bug us
-	uint32_t i = (uint32_t)(uintptr_t)param, j;
-
-	hash_init[i](&hash_ctx);
-	// Signal that we're ready to service requests
-	if (!SetEvent(thread_ready[i]))
-		goto error;
-
-	// Wait for requests
-	while (1) {
-		if (WaitForSingleObject(data_ready[i], WAIT_TIME) != WAIT_OBJECT_0) {
-			uprintf("Failed to wait for event for hash thread #%d: %s", i, WindowsErrorString());
-			return 1;
-		}
-		if (read_size[proc_bufnum] != 0) {
-			hash_write[i](&hash_ctx, buffer[proc_bufnum], (size_t)read_size[proc_bufnum]);
-			if (!SetEvent(thread_ready[i]))
-				goto error;
-		} else {
-			hash_final[i](&hash_ctx);
-			memset(&hash_str[i], 0, ARRAYSIZE(hash_str[i]));
-			for (j = 0; j < hash_count[i]; j++) {
-				hash_str[i][2 * j] = ((hash_ctx.buf[j] >> 4) < 10) ?
-					((hash_ctx.buf[j] >> 4) + '0') : ((hash_ctx.buf[j] >> 4) - 0xa + 'a');
-				hash_str[i][2 * j + 1] = ((hash_ctx.buf[j] & 15) < 10) ?
-					((hash_ctx.buf[j] & 15) + '0') : ((hash_ctx.buf[j] & 15) - 0xa + 'a');
-			}
-			hash_str[i][2 * j] = 0;
-			return 0;
-		}
-	}
-error:
-	uprintf("Failed to set event for hash thread #%d: %s", i, WindowsErrorString());
-	return 1;
-}
-
 DWORD WINAPI HashThread(void* param)
 {
 	DWORD_PTR* thread_affinity = (DWORD_PTR*)param;
-	HANDLE hash_thread[HASH_MAX] = { NULL, NULL, NULL, NULL };
-	DWORD wr;
+	multihash_t* mh = NULL;
+	uint8_t sum[HASH_MAX][MAX_HASHSIZE], *buf;
+	DWORD read_size;
 	VOID* fd = NULL;
 	uint64_t processed_bytes;
-	int i, read_bufnum, r = -1;
+	uint32_t j, buf_size;
+	int i, r = -1;
 	int num_hashes = HASH_MAX - (enable_extra_hashes ? 0 : 1);
 
 	if ((image_path == NULL) || (thread_affinity == NULL))
@@ -2048,25 +2258,12 @@ DWORD WINAPI HashThread(void* param)
 		// is usually in this first mask, for other tasks.
 		SetThreadAffinityMask(GetCurrentThread(), thread_affinity[0]);
 
-	for (i = 0; i < num_hashes; i++) {
-		// NB: Can't use a single manual-reset event for data_ready as we
-		// wouldn't be able to ensure the event is reset before the thread
-		// gets into its next wait loop
-		data_ready[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
-		thread_ready[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
-		if ((data_ready[i] == NULL) || (thread_ready[i] == NULL)) {
-			uprintf("Unable to create hash thread event: %s", WindowsErrorString());
-			goto out;
-		}
-		hash_thread[i] = CreateThread(NULL, 0, IndividualHashThread, (LPVOID)(uintptr_t)i, 0, NULL);
-		if (hash_thread[i] == NULL) {
-			uprintf("Unable to start hash thread #%d", i);
-			goto out;
-		}
-		SetThreadPriority(hash_thread[i], default_thread_priority);
-		if (thread_affinity[i+1] != 0)
-			SetThreadAffinityMask(hash_thread[i], thread_affinity[i+1]);
+	mh = MultiHashCreate((1 << num_hashes) - 1, hash_buffer_size, HASH_BUFFER_COUNT);
+	if (mh == NULL) {
+		uprintf("Unable to start hash threads");
+		goto out;
 	}
+	MultiHashSetAffinity(mh, thread_affinity);
 
 	fd = CreateFileAsync(image_path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
 	if (fd == NULL) {
@@ -2074,61 +2271,44 @@ DWORD WINAPI HashThread(void* param)
 		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
 		goto out;
 	}
-
-	read_bufnum = 0;
-	proc_bufnum = 1;
-	read_size[proc_bufnum] = 1;	// To avoid early loop exit
 	UpdateProgressWithInfoInit(hMainDialog, FALSE);
 
-	// Start the initial read
-	ReadFileAsync(fd, buffer[read_bufnum], BUFFER_SIZE);
-
-	for (processed_bytes = 0; read_size[proc_bufnum] != 0; processed_bytes += read_size[proc_bufnum]) {
+	// The hash threads process the previous buffers while we read into the next one
+	for (processed_bytes = 0; ; processed_bytes += read_size) {
 		// 0. Update the progress and check for cancel
 		UpdateProgressWithInfo(OP_NOOP_WITH_TASKBAR, MSG_271, processed_bytes, img_report.image_size);
 		CHECK_FOR_USER_CANCEL;
 
-		// 1. Wait for the current read operation to complete (and update the read size)
-		if ((!WaitFileAsync(fd, DRIVE_ACCESS_TIMEOUT)) ||
-			(!GetSizeAsync(fd, &read_size[read_bufnum]))) {
+		// 1. Read straight into the multi-hash engine's buffer
+		buf = MultiHashGetBuffer(mh, &buf_size);
+		if ((!ReadFileAsync(fd, buf, buf_size)) || (!WaitFileAsync(fd, DRIVE_ACCESS_TIMEOUT)) ||
+			(!GetSizeAsync(fd, &read_size))) {
 			uprintf("Read error: %s", WindowsErrorString());
 			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
 			goto out;
 		}
+		if (read_size == 0)
+			break;
 
-		// 2. Switch to the next reading buffer
-		read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
-
-		// 3. Launch the next asynchronous read operation
-		ReadFileAsync(fd, buffer[read_bufnum], BUFFER_SIZE);
-
-		// 4. Wait for all the hash threads to indicate that they are ready to process data
-		wr = WaitForMultipleObjects(num_hashes, thread_ready, TRUE, WAIT_TIME);
-		if (wr != WAIT_OBJECT_0) {
-			if (wr == STATUS_TIMEOUT)
-				SetLastError(ERROR_TIMEOUT);
-			uprintf("Hash threads failed to signal: %s", WindowsErrorString());
+		// 2. Hand the data over to the hash threads
+		if (!MultiHashCommit(mh, read_size))
 			goto out;
-		}
-
-		// 5. Set the target buffer we want to process to the buffer we just read data into
-		// Note that this variable should only be updated AFTER all the threads have signalled.
-		proc_bufnum = (read_bufnum + NUM_BUFFERS - 1) % NUM_BUFFERS;
-
-		// 6. Signal the waiting threads that there is data available
-		for (i = 0; i < num_hashes; i++) {
-			if (!SetEvent(data_ready[i])) {
-				uprintf("Could not signal hash thread %d: %s", i, WindowsErrorString());
-				goto out;
-			}
-		}
 	}
 
-	// Our last event with read_size=0 signaled the threads to exit - wait for that to happen
-	if (WaitForMultipleObjects(num_hashes, hash_thread, TRUE, WAIT_TIME) != WAIT_OBJECT_0) {
-		uprintf("Hash threads did not finalize: %s", WindowsErrorString());
+	if (!MultiHashFinal(mh, sum)) {
+		uprintf("Hash threads did not finalize");
 		goto out;
 	}
+	for (i = 0; i < num_hashes; i++) {
+		memset(&hash_str[i], 0, ARRAYSIZE(hash_str[i]));
+		for (j = 0; j < hash_count[i]; j++) {
+			hash_str[i][2 * j] = ((sum[i][j] >> 4) < 10) ?
+				((sum[i][j] >> 4) + '0') : ((sum[i][j] >> 4) - 0xa + 'a');
+			hash_str[i][2 * j + 1] = ((sum[i][j] & 15) < 10) ?
+				((sum[i][j] & 15) + '0') : ((sum[i][j] & 15) - 0xa + 'a');
+		}
+		hash_str[i][2 * j] = 0;
+	}
 
 	uprintf("  MD5:    %s", hash_str[0]);
 	uprintf("  SHA1:   %s", hash_str[1]);
@@ -2143,12 +2323,7 @@ DWORD WINAPI HashThread(void* param)
 	r = 0;
 
 out:
-	for (i = 0; i < num_hashes; i++) {
-		if (hash_thread[i] != NULL)
-			TerminateThread(hash_thread[i], 1);
-		safe_closehandle(data_ready[i]);
-		safe_closehandle(thread_ready[i]);
-	}
+	MultiHashDestroy(mh);
 	CloseFileAsync(fd);
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)FALSE, 0);
 	if (r == 0)
@@ -2580,6 +2755,7 @@ int TestHashes(void)
 	/* Display accelerations available */
 	uprintf("SHA1   acceleration: %s", (cpu_has_sha1_accel ? "TRUE" : "FALSE"));
 	uprintf("SHA256 acceleration: %s", (cpu_has_sha256_accel ? "TRUE" : "FALSE"));
+	uprintf("Block comparison:    %s", GetBlockKernelName());
 
 	for (j = 0; j < HASH_MAX; j++) {
 		size_t copy_msg_len[4];
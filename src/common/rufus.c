@@ -29,4 +29,5 @@ BOOL usb_debug, use_fake_units, preserve_timestamps = FALSE, fast_zeroing = FALS
 BOOL zero_drive = FALSE, list_non_usb_removable_drives = FALSE, enable_file_indexing, large_drive = FALSE;
 BOOL write_as_image = FALSE, write_as_esp = FALSE, use_vds = FALSE, ignore_boot_marker = FALSE;
 BOOL appstore_version = FALSE, is_vds_available = TRUE, persistent_log = FALSE, has_ffu_support = FALSE;
-BOOL expert_mode = FALSE, use_rufus_mbr = TRUE;
\ No newline at end of file
+BOOL expert_mode = FALSE, use_rufus_mbr = TRUE, sparse_write = FALSE;
+BOOL hash_on_write = FALSE, read_back_on_write = FALSE, verify_after_write = FALSE;
\ No newline at end of file
@@ -133,8 +133,13 @@
 #define MAX_FAT32_SIZE              (2 * TB)	// Threshold above which we disable FAT32 formatting
 #define FAT32_CLUSTER_THRESHOLD     1.011f		// For FAT32, cluster size changes don't occur at power of 2 boundaries but slightly above
 #define DD_BUFFER_SIZE              (32 * MB)	// Minimum size of buffer to use for DD operations
+#define DD_PIPELINE_BUFFERS         4			// Default number of DD_BUFFER_SIZE buffers in the DD write pipeline
+#define HASH_BUFFER_SIZE            (4 * MB)	// Default size of the multi-hash engine buffers
+#define HASH_BUFFER_COUNT           4			// Number of buffers in the multi-hash engine ring
 #define UBUFFER_SIZE                4096
 #define ISO_BUFFER_SIZE             (64 * KB)	// Buffer size used for ISO data extraction
+#define ISO_COPY_BUFFER_SIZE        (1 * MB)	// Default size of the buffers used by the ISO file copy threads
+#define ISO_COPY_MAX_THREADS        8			// Default maximum number of ISO file copy threads
 #define RSA_SIGNATURE_SIZE          256
 #define CBN_SELCHANGE_INTERNAL      (CBN_SELCHANGE + 256)
 #if defined(RUFUS_TEST)
@@ -526,6 +531,18 @@ extern hash_init_t* hash_init[HASH_MAX];
 extern hash_write_t* hash_write[HASH_MAX];
 extern hash_final_t* hash_final[HASH_MAX];
 
+/* Multi-hash engine */
+typedef struct multihash multihash_t;
+extern multihash_t* MultiHashCreate(uint32_t hash_mask, uint32_t buf_size, uint32_t nb_bufs);
+extern uint8_t* MultiHashGetBuffer(multihash_t* mh, uint32_t* size);
+extern BOOL MultiHashCommit(multihash_t* mh, uint32_t len);
+extern BOOL MultiHashWrite(multihash_t* mh, const uint8_t* buf, size_t len);
+extern BOOL MultiHashFinal(multihash_t* mh, uint8_t sum[HASH_MAX][MAX_HASHSIZE]);
+extern void MultiHashDestroy(multihash_t* mh);
+#ifdef _WIN32
+extern void MultiHashSetAffinity(multihash_t* mh, const DWORD_PTR* affinity);
+#endif
+
 #ifndef __VA_GROUP__
 #define __VA_GROUP__(...)  __VA_ARGS__
 #endif
@@ -633,6 +650,9 @@ extern uint32_t FindResourceRva(const wchar_t* name, uint8_t* root, uint8_t* dir
 extern DWORD ListDirectoryContent(StrArray* arr, char* dir, uint8_t type);
 extern BOOL DetectSHA1Acceleration(void);
 extern BOOL DetectSHA256Acceleration(void);
+extern BOOL IsUniformBlock(const uint8_t* buf, size_t size, uint32_t* value);
+extern size_t CompareBlocks(const uint8_t* a, const uint8_t* b, size_t size);
+extern const char* GetBlockKernelName(void);
 extern BOOL HashFile(const unsigned type, const char* path, uint8_t* sum);
 extern BOOL PE256Buffer(uint8_t* buf, uint32_t len, uint8_t* hash);
 extern void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name);
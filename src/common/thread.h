@@ -0,0 +1,542 @@
+/*
+* Rufus: The Reliable USB Formatting Utility
+* Portable threading primitives
+* Copyright © 2025 PsychedelicPalimpsest
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Everything here is static inline, so that this header can be used from any
+ * of our libraries (bled, libcdio, ...) without having to worry about the order
+ * in which they are linked. It maps to SRW locks and condition variables on
+ * Windows and to pthreads everywhere else.
+ */
+
+#include <pseudo_windows.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#pragma once
+
+#ifndef INFINITE
+#define INFINITE 0xFFFFFFFF
+#endif
+
+typedef DWORD (WINAPI *thread_func_t)(void* param);
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+typedef SRWLOCK mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#else
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+typedef struct {
+	thread_func_t func;
+	void* param;
+} thread_start_t;
+
+static __inline void* thread_trampoline(void* arg)
+{
+	thread_start_t start = *(thread_start_t*)arg;
+	free(arg);
+	return (void*)(uintptr_t)start.func(start.param);
+}
+#endif
+
+/* Threads */
+static __inline BOOL thread_create(thread_t* thread, thread_func_t func, void* param)
+{
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, func, param, 0, NULL);
+	return (*thread != NULL);
+#else
+	thread_start_t* start = malloc(sizeof(thread_start_t));
+	if (start == NULL)
+		return FALSE;
+	start->func = func;
+	start->param = param;
+	if (pthread_create(thread, NULL, thread_trampoline, start) != 0) {
+		free(start);
+		return FALSE;
+	}
+	return TRUE;
+#endif
+}
+
+static __inline DWORD thread_join(thread_t thread)
+{
+#ifdef _WIN32
+	DWORD ret = (DWORD)-1;
+	WaitForSingleObject(thread, INFINITE);
+	GetExitCodeThread(thread, &ret);
+	CloseHandle(thread);
+	return ret;
+#else
+	void* ret = NULL;
+	pthread_join(thread, &ret);
+	return (DWORD)(uintptr_t)ret;
+#endif
+}
+
+static __inline void thread_yield(void)
+{
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+static __inline uint32_t get_cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (si.dwNumberOfProcessors == 0) ? 1 : si.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n <= 0) ? 1 : (uint32_t)n;
+#endif
+}
+
+/* Mutexes and condition variables */
+static __inline void mutex_init(mutex_t* m)
+{
+#ifdef _WIN32
+	InitializeSRWLock(m);
+#else
+	pthread_mutex_init(m, NULL);
+#endif
+}
+
+static __inline void mutex_destroy(mutex_t* m)
+{
+#ifndef _WIN32
+	pthread_mutex_destroy(m);
+#endif
+}
+
+static __inline void mutex_lock(mutex_t* m)
+{
+#ifdef _WIN32
+	AcquireSRWLockExclusive(m);
+#else
+	pthread_mutex_lock(m);
+#endif
+}
+
+static __inline void mutex_unlock(mutex_t* m)
+{
+#ifdef _WIN32
+	ReleaseSRWLockExclusive(m);
+#else
+	pthread_mutex_unlock(m);
+#endif
+}
+
+static __inline void cond_init(cond_t* c)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(c);
+#else
+	pthread_cond_init(c, NULL);
+#endif
+}
+
+static __inline void cond_destroy(cond_t* c)
+{
+#ifndef _WIN32
+	pthread_cond_destroy(c);
+#endif
+}
+
+/* Returns FALSE on timeout. Spurious wakeups are possible, so always recheck the predicate. */
+static __inline BOOL cond_wait(cond_t* c, mutex_t* m, DWORD timeout_ms)
+{
+#ifdef _WIN32
+	return SleepConditionVariableSRW(c, m, timeout_ms, 0);
+#else
+	struct timespec ts;
+	if (timeout_ms == INFINITE)
+		return (pthread_cond_wait(c, m) == 0);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return (pthread_cond_timedwait(c, m, &ts) == 0);
+#endif
+}
+
+static __inline void cond_signal(cond_t* c)
+{
+#ifdef _WIN32
+	WakeConditionVariable(c);
+#else
+	pthread_cond_signal(c);
+#endif
+}
+
+static __inline void cond_broadcast(cond_t* c)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(c);
+#else
+	pthread_cond_broadcast(c);
+#endif
+}
+
+/* Atomics */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define atomic_load_acquire(p)      InterlockedCompareExchange((volatile LONG*)(p), 0, 0)
+#define atomic_store_release(p, v)  InterlockedExchange((volatile LONG*)(p), (LONG)(v))
+#define atomic_fetch_add(p, v)      InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v))
+#define atomic_fetch_add64(p, v)    InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+#define atomic_fence()              MemoryBarrier()
+#else
+#define atomic_load_acquire(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_release(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_fetch_add(p, v)      __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_fetch_add64(p, v)    __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_fence()              __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/*
+ * Single producer, single consumer queue of pointers.
+ * Push and pop are lock-free. The mutex and condition variable are only
+ * used to park a thread when the queue is empty (consumer) or full (producer),
+ * and are only ever touched by the other side when it knows someone is parked.
+ */
+typedef struct {
+	void** slot;
+	uint32_t size;              // Must be a power of 2
+	volatile uint32_t head;     // Only written by the consumer
+	volatile uint32_t tail;     // Only written by the producer
+	volatile LONG waiting;      // Number of parked threads
+	mutex_t lock;
+	cond_t cond;
+} spsc_queue_t;
+
+static __inline BOOL spsc_init(spsc_queue_t* q, uint32_t min_size)
+{
+	memset(q, 0, sizeof(spsc_queue_t));
+	for (q->size = 2; q->size < min_size; q->size <<= 1);
+	q->slot = calloc(q->size, sizeof(void*));
+	if (q->slot == NULL)
+		return FALSE;
+	mutex_init(&q->lock);
+	cond_init(&q->cond);
+	return TRUE;
+}
+
+static __inline void spsc_destroy(spsc_queue_t* q)
+{
+	if (q->slot == NULL)
+		return;
+	free(q->slot);
+	q->slot = NULL;
+	cond_destroy(&q->cond);
+	mutex_destroy(&q->lock);
+}
+
+static __inline void spsc_wake(spsc_queue_t* q)
+{
+	// Pairs with the fence in spsc_park(), so that we can't miss a parked thread
+	atomic_fence();
+	if (q->waiting) {
+		mutex_lock(&q->lock);
+		cond_broadcast(&q->cond);
+		mutex_unlock(&q->lock);
+	}
+}
+
+static __inline BOOL spsc_push(spsc_queue_t* q, void* item)
+{
+	uint32_t tail = q->tail;
+	if (tail - atomic_load_acquire(&q->head) >= q->size)
+		return FALSE;
+	q->slot[tail & (q->size - 1)] = item;
+	atomic_store_release(&q->tail, tail + 1);
+	spsc_wake(q);
+	return TRUE;
+}
+
+static __inline void* spsc_pop(spsc_queue_t* q)
+{
+	uint32_t head = q->head;
+	void* item;
+	if (head == atomic_load_acquire(&q->tail))
+		return NULL;
+	item = q->slot[head & (q->size - 1)];
+	atomic_store_release(&q->head, head + 1);
+	spsc_wake(q);
+	return item;
+}
+
+/* Park the calling thread until the other side makes progress, or timeout expires */
+static __inline void spsc_park(spsc_queue_t* q, uint32_t head, uint32_t tail, DWORD timeout_ms)
+{
+	mutex_lock(&q->lock);
+	q->waiting++;
+	atomic_fence();
+	if (q->head == head && q->tail == tail)
+		cond_wait(&q->cond, &q->lock, timeout_ms);
+	q->waiting--;
+	mutex_unlock(&q->lock);
+}
+
+/* Blocking variants. These return FALSE/NULL on timeout, so that callers can check for cancellation. */
+/* The indexes are sampled before the first attempt, so that progress made in between isn't missed. */
+static __inline BOOL spsc_push_wait(spsc_queue_t* q, void* item, DWORD timeout_ms)
+{
+	uint32_t head = atomic_load_acquire(&q->head), tail = q->tail;
+	if (spsc_push(q, item))
+		return TRUE;
+	spsc_park(q, head, tail, timeout_ms);
+	return spsc_push(q, item);
+}
+
+static __inline void* spsc_pop_wait(spsc_queue_t* q, DWORD timeout_ms)
+{
+	uint32_t head = q->head, tail = atomic_load_acquire(&q->tail);
+	void* item = spsc_pop(q);
+	if (item != NULL)
+		return item;
+	spsc_park(q, head, tail, timeout_ms);
+	return spsc_pop(q);
+}
+
+/*
+ * Work-stealing pool. Each worker owns a small queue, that jobs are distributed
+ * to in a round robin fashion. A worker processes its own queue from the tail
+ * and, once that is empty, steals from the head of the other workers' queues.
+ * Jobs are expected to be coarse (e.g. a file), so the queues use a mutex.
+ */
+typedef BOOL (*pool_func_t)(void* context, uint32_t worker, void* job);
+
+typedef struct {
+	void** slot;
+	uint32_t size;              // Must be a power of 2
+	uint32_t head;
+	uint32_t tail;
+	mutex_t lock;
+} pool_queue_t;
+
+struct pool;
+
+typedef struct {
+	struct pool* pool;
+	uint32_t index;
+	thread_t thread;
+	BOOL started;
+} pool_worker_t;
+
+typedef struct pool {
+	pool_queue_t* queue;
+	pool_worker_t* worker;
+	uint32_t nb_workers;
+	uint32_t next;              // Queue that the next job goes to
+	pool_func_t func;
+	void* context;
+	volatile LONG queued;       // Jobs waiting in the queues
+	volatile LONG pending;      // Jobs waiting or being processed
+	volatile LONG stop;
+	volatile LONG failed;       // Set if any job failed
+	mutex_t lock;
+	cond_t work_cond;           // Signalled when a job is queued
+	cond_t done_cond;           // Signalled when a job is completed
+} pool_t;
+
+static __inline BOOL pool_queue_push(pool_queue_t* q, void* job)
+{
+	BOOL r = FALSE;
+	mutex_lock(&q->lock);
+	if (q->tail - q->head < q->size) {
+		q->slot[q->tail++ & (q->size - 1)] = job;
+		r = TRUE;
+	}
+	mutex_unlock(&q->lock);
+	return r;
+}
+
+static __inline void* pool_queue_pop(pool_queue_t* q, BOOL steal)
+{
+	void* job = NULL;
+	mutex_lock(&q->lock);
+	if (q->tail != q->head)
+		job = steal ? q->slot[q->head++ & (q->size - 1)] : q->slot[--q->tail & (q->size - 1)];
+	mutex_unlock(&q->lock);
+	return job;
+}
+
+static __inline void* pool_get_job(pool_t* p, uint32_t index)
+{
+	uint32_t i;
+	void* job = pool_queue_pop(&p->queue[index], FALSE);
+	for (i = 1; (job == NULL) && (i < p->nb_workers); i++)
+		job = pool_queue_pop(&p->queue[(index + i) % p->nb_workers], TRUE);
+	if (job != NULL)
+		atomic_fetch_add(&p->queued, -1);
+	return job;
+}
+
+static __inline DWORD WINAPI pool_worker_thread(void* param)
+{
+	pool_worker_t* w = (pool_worker_t*)param;
+	pool_t* p = w->pool;
+	void* job;
+
+	while (1) {
+		job = pool_get_job(p, w->index);
+		if (job == NULL) {
+			// Queued jobs are still processed after a stop request, so that they can be released
+			mutex_lock(&p->lock);
+			if (atomic_load_acquire(&p->queued) == 0) {
+				if (p->stop) {
+					mutex_unlock(&p->lock);
+					break;
+				}
+				cond_wait(&p->work_cond, &p->lock, INFINITE);
+			}
+			mutex_unlock(&p->lock);
+			continue;
+		}
+		if (!p->func(p->context, w->index, job))
+			atomic_store_release(&p->failed, TRUE);
+		atomic_fetch_add(&p->pending, -1);
+		mutex_lock(&p->lock);
+		cond_broadcast(&p->done_cond);
+		mutex_unlock(&p->lock);
+	}
+	return 0;
+}
+
+/* Stop the workers, once they have processed all the queued jobs, and release the pool */
+static __inline void pool_destroy(pool_t* p)
+{
+	uint32_t i;
+
+	if (p->nb_workers == 0)
+		return;
+	if (p->worker != NULL) {
+		mutex_lock(&p->lock);
+		p->stop = TRUE;
+		cond_broadcast(&p->work_cond);
+		mutex_unlock(&p->lock);
+		for (i = 0; i < p->nb_workers; i++) {
+			if (p->worker[i].started)
+				thread_join(p->worker[i].thread);
+		}
+	}
+	if (p->queue != NULL) {
+		for (i = 0; i < p->nb_workers; i++) {
+			free(p->queue[i].slot);
+			mutex_destroy(&p->queue[i].lock);
+		}
+	}
+	free(p->queue);
+	free(p->worker);
+	cond_destroy(&p->work_cond);
+	cond_destroy(&p->done_cond);
+	mutex_destroy(&p->lock);
+	memset(p, 0, sizeof(pool_t));
+}
+
+/* Create a pool of nb_workers threads, each with a queue that can hold at least queue_size jobs */
+static __inline BOOL pool_create(pool_t* p, uint32_t nb_workers, uint32_t queue_size, pool_func_t func, void* context)
+{
+	uint32_t i;
+
+	memset(p, 0, sizeof(pool_t));
+	if ((nb_workers == 0) || (func == NULL))
+		return FALSE;
+	p->nb_workers = nb_workers;
+	p->func = func;
+	p->context = context;
+	mutex_init(&p->lock);
+	cond_init(&p->work_cond);
+	cond_init(&p->done_cond);
+	p->queue = calloc(nb_workers, sizeof(pool_queue_t));
+	p->worker = calloc(nb_workers, sizeof(pool_worker_t));
+	if ((p->queue == NULL) || (p->worker == NULL))
+		goto error;
+	for (i = 0; i < nb_workers; i++) {
+		for (p->queue[i].size = 2; p->queue[i].size < queue_size; p->queue[i].size <<= 1);
+		mutex_init(&p->queue[i].lock);
+		p->queue[i].slot = calloc(p->queue[i].size, sizeof(void*));
+		if (p->queue[i].slot == NULL)
+			goto error;
+	}
+	for (i = 0; i < nb_workers; i++) {
+		p->worker[i].pool = p;
+		p->worker[i].index = i;
+		p->worker[i].started = thread_create(&p->worker[i].thread, pool_worker_thread, &p->worker[i]);
+		if (!p->worker[i].started)
+			goto error;
+	}
+	return TRUE;
+
+error:
+	pool_destroy(p);
+	return FALSE;
+}
+
+/* Queue a job. This fails if all the queues are full, so callers should size them accordingly. */
+static __inline BOOL pool_submit(pool_t* p, void* job)
+{
+	uint32_t i;
+
+	atomic_fetch_add(&p->pending, 1);
+	for (i = 0; i < p->nb_workers; i++) {
+		if (pool_queue_push(&p->queue[(p->next + i) % p->nb_workers], job))
+			break;
+	}
+	if (i >= p->nb_workers) {
+		atomic_fetch_add(&p->pending, -1);
+		return FALSE;
+	}
+	p->next = (p->next + i + 1) % p->nb_workers;
+	atomic_fetch_add(&p->queued, 1);
+	mutex_lock(&p->lock);
+	cond_signal(&p->work_cond);
+	mutex_unlock(&p->lock);
+	return TRUE;
+}
+
+/* Wait for all the submitted jobs to complete. Returns FALSE on timeout. */
+static __inline BOOL pool_wait(pool_t* p, DWORD timeout_ms)
+{
+	BOOL r;
+
+	mutex_lock(&p->lock);
+	if (atomic_load_acquire(&p->pending) != 0)
+		cond_wait(&p->done_cond, &p->lock, timeout_ms);
+	r = (atomic_load_acquire(&p->pending) == 0);
+	mutex_unlock(&p->lock);
+	return r;
+}
@@ -87,4 +87,35 @@ BOOL WaitFileAsync(void* h, DWORD dwTimeout);
 /// <param name="h">An async handle, created by a call to CreateFileAsync()</param>
 /// <param name="lpNumberOfBytes">A pointer that receives the number of bytes transferred.</param>
 /// <returns>TRUE on success, FALSE on error</returns>
-BOOL GetSizeAsync(void* h, LPDWORD lpNumberOfBytes);
\ No newline at end of file
+BOOL GetSizeAsync(void* h, LPDWORD lpNumberOfBytes);
+
+/// <summary>
+/// Return the maximum number of read or write operations that can be in flight at once
+/// for an asynchronous handle. When more than one operation is in flight, WaitFileAsync()
+/// and GetSizeAsync() always apply to the oldest one, in submission order.
+/// </summary>
+/// <param name="h">An async handle, created by a call to CreateFileAsync()</param>
+/// <returns>The queue depth, or 0 on error</returns>
+DWORD GetQueueDepthAsync(void* h);
+
+/// <summary>
+/// Register a buffer that all subsequent asynchronous I/O will be using, so that
+/// the backend can avoid mapping it for every request. This is only a hint and
+/// must be called when no operation is in flight.
+/// </summary>
+/// <param name="h">An async handle, created by a call to CreateFileAsync()</param>
+/// <param name="lpBuffer">The buffer to register, or NULL to unregister</param>
+/// <param name="dwBufferSize">The size of the buffer</param>
+/// <returns>TRUE on success, FALSE on error</returns>
+BOOL RegisterBufferAsync(void* h, LPVOID lpBuffer, DWORD dwBufferSize);
+
+/// <summary>
+/// Zero a range of a file or device, using whatever the platform provides to do so
+/// without transferring the data. On success, the file pointer is moved to the end
+/// of the range, as if the zeroes had been written.
+/// </summary>
+/// <param name="h">A regular (non async) file or device handle</param>
+/// <param name="offset">The start of the range</param>
+/// <param name="size">The size of the range</param>
+/// <returns>TRUE on success, FALSE on error or if the operation is not supported</returns>
+BOOL ZeroFileRange(HANDLE h, uint64_t offset, uint64_t size);
@@ -68,6 +68,10 @@ struct struct_io_stats {
 	int			reserved;
 	unsigned long long	bytes_read;
 	unsigned long long	bytes_written;
+	/* The following are only valid if num_fields >= 5 */
+	unsigned long long	cache_hits;
+	unsigned long long	cache_misses;
+	unsigned long long	write_requests;
 };
 
 struct struct_io_manager {
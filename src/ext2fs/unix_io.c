@@ -1,7 +1,8 @@
 /*
  * unix_io.c --- This is the Unix I/O interface to the I/O manager.
  *
- * Implements a one-block write-through cache.
+ * Implements a hashed LRU write-back block cache, whose dirty blocks are
+ * written in block order, with adjacent blocks merged into single writes.
  * This was found at: https://github.com/cubieb/2PORTONT/blob/60dcf39dcc630eb72d2652ccdfebdbcff8a97f05/sdk/user/e2fsprogs/lib/ext2fs/unix_io.c#
  *
  * Copyright (C) 1993, 1994, 1995 Theodore Ts'o.
@@ -18,6 +19,7 @@
 #define _LARGEFILE64_SOURCE
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
@@ -47,20 +49,34 @@
 struct unix_cache {
 	char		*buf;
 	unsigned long	block;
-	int		access_time;
-	int		dirty:1;
-	int		in_use:1;
+	int		dirty;
+	struct unix_cache *hash_next;
+	struct unix_cache *lru_prev;	/* More recently used */
+	struct unix_cache *lru_next;	/* Less recently used, or next free */
 };
 
-#define CACHE_SIZE 8
-#define WRITE_VIA_CACHE_SIZE 4	/* Must be smaller than CACHE_SIZE */
+/*
+ * Default number of cached blocks, which can be changed with the
+ * "cache_blocks=<n>" option. A value of 0 disables the cache.
+ */
+#define CACHE_BLOCKS 1024
+#define WRITE_VIA_CACHE_SIZE 32		/* Larger I/O bypasses the cache */
+#define FLUSH_MAX_SIZE (1024 * 1024)	/* Largest merged write on flush */
 
 struct unix_private_data {
 	int	magic;
 	int	dev;
 	int	flags;
-	int	access_time;
-	struct unix_cache cache[CACHE_SIZE];
+	int	cache_blocks;		/* Cache capacity, in blocks */
+	int	hash_shift;
+	struct unix_cache *cache;	/* Array of cache_blocks entries */
+	struct unix_cache **hash;
+	struct unix_cache *lru_head;	/* Most recently used */
+	struct unix_cache *lru_tail;	/* Least recently used */
+	struct unix_cache *free_list;
+	struct unix_cache **dirty;	/* Scratch array for flush */
+	char	*flush_buf;		/* Buffer to merge adjacent blocks */
+	struct struct_io_stats io_stats;
 };
 
 static errcode_t unix_open(const char *name, int flags, io_channel *channel);
@@ -73,17 +89,22 @@ static errcode_t unix_write_blk(io_channel channel, unsigned long block,
 static errcode_t unix_flush(io_channel channel);
 static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 				int size, const void *data);
+static errcode_t unix_set_option(io_channel channel, const char *option,
+				 const char *arg);
+static errcode_t unix_get_stats(io_channel channel, io_stats *stats);
 
 static struct struct_io_manager struct_unix_manager = {
-	EXT2_ET_MAGIC_IO_MANAGER,
-	"Unix I/O Manager",
-	unix_open,
-	unix_close,
-	unix_set_blksize,
-	unix_read_blk,
-	unix_write_blk,
-	unix_flush,
-	unix_write_byte
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "Unix I/O Manager",
+	.open		= unix_open,
+	.close		= unix_close,
+	.set_blksize	= unix_set_blksize,
+	.read_blk	= unix_read_blk,
+	.write_blk	= unix_write_blk,
+	.flush		= unix_flush,
+	.write_byte	= unix_write_byte,
+	.set_option	= unix_set_option,
+	.get_stats	= unix_get_stats
 };
 
 io_manager unix_io_manager = &struct_unix_manager;
@@ -102,6 +123,7 @@ static errcode_t raw_read_blk(io_channel channel,
 	int		actual = 0;
 
 	size = (count < 0) ? -count : count * channel->block_size;
+	data->io_stats.bytes_read += size;
 	location = (ext2_loff_t) block * channel->block_size;
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
@@ -115,7 +137,7 @@ static errcode_t raw_read_blk(io_channel channel,
 		goto error_out;
 	}
 	return 0;
-	
+
 error_out:
 	memset((char *) buf+actual, 0, size-actual);
 	if (channel->read_error)
@@ -142,20 +164,22 @@ static errcode_t raw_write_blk(io_channel channel,
 		else
 			size = count * channel->block_size;
 	}
+	data->io_stats.bytes_written += size;
+	data->io_stats.write_requests++;
 
 	location = (ext2_loff_t) block * channel->block_size;
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 		goto error_out;
 	}
-	
+
 	actual = write(data->dev, buf, size);
 	if (actual != size) {
 		retval = EXT2_ET_SHORT_WRITE;
 		goto error_out;
 	}
 	return 0;
-	
+
 error_out:
 	if (channel->write_error)
 		retval = (channel->write_error)(channel, block, count, buf,
@@ -168,126 +192,320 @@ error_out:
  * Here we implement the cache functions
  */
 
+static unsigned int hash_block(struct unix_private_data *data,
+			       unsigned long block)
+{
+	return (unsigned int) (((unsigned long long) block * 0x9E3779B97F4A7C15ULL)
+			       >> (64 - data->hash_shift));
+}
+
+/* Put all the cache entries on the free list */
+static void reset_cache(struct unix_private_data *data)
+{
+	int			i;
+
+	data->lru_head = data->lru_tail = NULL;
+	data->free_list = NULL;
+	if (data->hash)
+		memset(data->hash, 0,
+		       sizeof(struct unix_cache *) << data->hash_shift);
+	for (i = data->cache_blocks - 1; i >= 0; i--) {
+		data->cache[i].dirty = 0;
+		data->cache[i].lru_next = data->free_list;
+		data->free_list = &data->cache[i];
+	}
+}
+
+static void free_cache(io_channel channel,
+		       struct unix_private_data *data);
+
 /* Allocate the cache buffers */
 static errcode_t alloc_cache(io_channel channel,
 			     struct unix_private_data *data)
 {
 	errcode_t		retval;
-	struct unix_cache	*cache;
 	int			i;
-	
-	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
+
+	data->cache = NULL;
+	data->hash = NULL;
+	data->dirty = NULL;
+	data->flush_buf = NULL;
+	for (data->hash_shift = 1; (1 << data->hash_shift) < data->cache_blocks;
+	     data->hash_shift++);
+	if (data->cache_blocks == 0)
+		goto out;
+
+	if ((retval = ext2fs_get_memzero(data->cache_blocks *
+					 sizeof(struct unix_cache),
+					 (void **) &data->cache)) ||
+	    (retval = ext2fs_get_memzero(sizeof(struct unix_cache *) <<
+					 data->hash_shift,
+					 (void **) &data->hash)) ||
+	    (retval = ext2fs_get_mem(data->cache_blocks *
+				     sizeof(struct unix_cache *),
+				     (void **) &data->dirty)) ||
+	    (retval = ext2fs_get_mem(FLUSH_MAX_SIZE > channel->block_size ?
+				     FLUSH_MAX_SIZE : channel->block_size,
+				     (void **) &data->flush_buf)))
+		goto error;
+	for (i = 0; i < data->cache_blocks; i++) {
 		if ((retval = ext2fs_get_mem(channel->block_size,
-					     (void **) &cache->buf)))
-			return retval;
+					     (void **) &data->cache[i].buf)))
+			goto error;
 	}
+out:
+	reset_cache(data);
 	return 0;
+
+error:
+	/* Leave a usable channel, without a cache */
+	free_cache(channel, data);
+	data->cache_blocks = 0;
+	reset_cache(data);
+	return retval;
 }
 
 /* Free the cache buffers */
-static void free_cache(io_channel channel, 
+static void free_cache(io_channel channel,
 		       struct unix_private_data *data)
+{
+	int			i;
+
+	if (data->cache) {
+		for (i = 0; i < data->cache_blocks; i++) {
+			if (data->cache[i].buf)
+				ext2fs_free_mem((void **) &data->cache[i].buf);
+		}
+		ext2fs_free_mem((void **) &data->cache);
+	}
+	if (data->hash)
+		ext2fs_free_mem((void **) &data->hash);
+	if (data->dirty)
+		ext2fs_free_mem((void **) &data->dirty);
+	if (data->flush_buf)
+		ext2fs_free_mem((void **) &data->flush_buf);
+	data->lru_head = data->lru_tail = data->free_list = NULL;
+}
+
+static void lru_unlink(struct unix_private_data *data,
+		       struct unix_cache *cache)
+{
+	if (cache->lru_prev)
+		cache->lru_prev->lru_next = cache->lru_next;
+	else
+		data->lru_head = cache->lru_next;
+	if (cache->lru_next)
+		cache->lru_next->lru_prev = cache->lru_prev;
+	else
+		data->lru_tail = cache->lru_prev;
+}
+
+static void lru_push(struct unix_private_data *data,
+		     struct unix_cache *cache)
+{
+	cache->lru_prev = NULL;
+	cache->lru_next = data->lru_head;
+	if (data->lru_head)
+		data->lru_head->lru_prev = cache;
+	else
+		data->lru_tail = cache;
+	data->lru_head = cache;
+}
+
+/* Remove a block from the cache, discarding its data even if dirty */
+static void drop_cached_block(struct unix_private_data *data,
+			      struct unix_cache *cache)
+{
+	struct unix_cache	**pcache;
+
+	for (pcache = &data->hash[hash_block(data, cache->block)]; *pcache;
+	     pcache = &(*pcache)->hash_next) {
+		if (*pcache == cache) {
+			*pcache = cache->hash_next;
+			break;
+		}
+	}
+	lru_unlink(data, cache);
+	cache->dirty = 0;
+	cache->lru_next = data->free_list;
+	data->free_list = cache;
+}
+
+static int dirty_cmp(const void *a, const void *b)
+{
+	unsigned long block_a = (*(struct unix_cache * const *) a)->block;
+	unsigned long block_b = (*(struct unix_cache * const *) b)->block;
+
+	return (block_a > block_b) - (block_a < block_b);
+}
+
+/*
+ * Flush all of the blocks in the cache. The dirty blocks are written
+ * in ascending order, and runs of adjacent ones with a single write.
+ */
+static errcode_t flush_cached_blocks(io_channel channel,
+				     struct unix_private_data *data,
+				     int invalidate)
+
+{
+	struct unix_cache	*cache;
+	errcode_t		retval, retval2;
+	int			i, j, k, ndirty, max_run;
+
+	retval2 = 0;
+	ndirty = 0;
+	for (cache = data->lru_head; cache; cache = cache->lru_next) {
+		if (cache->dirty)
+			data->dirty[ndirty++] = cache;
+	}
+	if (ndirty > 1)
+		qsort(data->dirty, ndirty, sizeof(struct unix_cache *),
+		      dirty_cmp);
+
+	max_run = FLUSH_MAX_SIZE / channel->block_size;
+	for (i = 0; i < ndirty; i = j) {
+		for (j = i + 1; j < ndirty && j - i < max_run; j++) {
+			if (data->dirty[j]->block != data->dirty[j - 1]->block + 1)
+				break;
+		}
+		if (j - i == 1) {
+			retval = raw_write_blk(channel, data,
+					       data->dirty[i]->block, 1,
+					       data->dirty[i]->buf);
+		} else {
+			for (k = i; k < j; k++)
+				memcpy(data->flush_buf +
+				       (size_t) (k - i) * channel->block_size,
+				       data->dirty[k]->buf, channel->block_size);
+			retval = raw_write_blk(channel, data,
+					       data->dirty[i]->block, j - i,
+					       data->flush_buf);
+		}
+		if (retval) {
+			retval2 = retval;
+			continue;
+		}
+		for (k = i; k < j; k++)
+			data->dirty[k]->dirty = 0;
+	}
+
+	if (invalidate)
+		reset_cache(data);
+	return retval2;
+}
+
+/* Drop the cached copies of blocks that are about to be overwritten */
+static void invalidate_cached_blocks(struct unix_private_data *data,
+				     unsigned long block, int count)
+{
+	struct unix_cache	*cache, *next;
+	int			i;
+
+	if (count < data->cache_blocks) {
+		for (i = 0; i < count; i++) {
+			for (cache = data->hash[hash_block(data, block + i)];
+			     cache; cache = cache->hash_next) {
+				if (cache->block == block + i) {
+					drop_cached_block(data, cache);
+					break;
+				}
+			}
+		}
+	} else {
+		for (cache = data->lru_head; cache; cache = next) {
+			next = cache->lru_next;
+			if (cache->block >= block &&
+			    cache->block - block < (unsigned long) count)
+				drop_cached_block(data, cache);
+		}
+	}
+}
+
+/*
+ * Copy the dirty cached blocks of a range over the data that was just
+ * read directly from the device, as the cache has the latest version.
+ */
+static void merge_dirty_blocks(io_channel channel,
+			       struct unix_private_data *data,
+			       unsigned long block, int count, char *buf)
 {
 	struct unix_cache	*cache;
 	int			i;
-	
-	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem((void **) &cache->buf);
-		cache->buf = 0;
+
+	if (count < data->cache_blocks) {
+		for (i = 0; i < count; i++) {
+			for (cache = data->hash[hash_block(data, block + i)];
+			     cache; cache = cache->hash_next) {
+				if (cache->block == block + i) {
+					if (cache->dirty)
+						memcpy(buf + (size_t) i * channel->block_size,
+						       cache->buf, channel->block_size);
+					break;
+				}
+			}
+		}
+	} else {
+		for (cache = data->lru_head; cache; cache = cache->lru_next) {
+			if (cache->dirty && cache->block >= block &&
+			    cache->block - block < (unsigned long) count)
+				memcpy(buf + (size_t) (cache->block - block) *
+				       channel->block_size,
+				       cache->buf, channel->block_size);
+		}
 	}
 }
 
 /*
  * Try to find a block in the cache.  If get_cache is non-zero, then
- * if the block isn't in the cache, evict the oldest block in the
- * cache and create a new cache entry for the requested block.
+ * if the block isn't in the cache, evict the least recently used block
+ * and create a new cache entry for the requested block. If that block
+ * is dirty, all the dirty blocks are written out, so that they can
+ * be merged, and the entries that follow it can be reused for free.
  */
 static struct unix_cache *find_cached_block(io_channel channel,
 					    struct unix_private_data *data,
 					    unsigned long block,
 					    int get_cache)
 {
-	struct unix_cache	*cache, *unused_cache, *oldest_cache;
-	int			i;
-	
-	unused_cache = oldest_cache = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		if (!cache->in_use) {
-			unused_cache = cache;
-			continue;
-		}
+	struct unix_cache	*cache;
+	unsigned int		h;
+
+	if (data->cache_blocks == 0)
+		return 0;
+
+	h = hash_block(data, block);
+	for (cache = data->hash[h]; cache; cache = cache->hash_next) {
 		if (cache->block == block) {
-			cache->access_time = ++data->access_time;
+			if (cache != data->lru_head) {
+				lru_unlink(data, cache);
+				lru_push(data, cache);
+			}
 			return cache;
 		}
-		if (!oldest_cache ||
-		    (cache->access_time < oldest_cache->access_time))
-			oldest_cache = cache;
 	}
 	if (!get_cache)
 		return 0;
-	
+
 	/*
 	 * Try to allocate cache slot.
 	 */
-	if (unused_cache)
-		cache = unused_cache;
-	else {
-		cache = oldest_cache;
-		if (cache->dirty)
-			raw_write_blk(channel, data,
-				      cache->block, 1, cache->buf);
+	if (!data->free_list) {
+		cache = data->lru_tail;
+		if (cache->dirty &&
+		    flush_cached_blocks(channel, data, 0) && cache->dirty)
+			return 0;
+		drop_cached_block(data, cache);
 	}
-	cache->in_use = 1;
+	cache = data->free_list;
+	data->free_list = cache->lru_next;
 	cache->block = block;
-	cache->access_time = ++data->access_time;
+	cache->dirty = 0;
+	cache->hash_next = data->hash[h];
+	data->hash[h] = cache;
+	lru_push(data, cache);
 	return cache;
 }
 
-/*
- * Flush all of the blocks in the cache
- */
-static errcode_t flush_cached_blocks(io_channel channel,
-				     struct unix_private_data *data,
-				     int invalidate)
-
-{
-	struct unix_cache	*cache;
-	errcode_t		retval, retval2;
-	int			i;
-	
-	retval2 = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		if (!cache->in_use)
-			continue;
-		
-		if (invalidate)
-			cache->in_use = 0;
-		
-		if (!cache->dirty)
-			continue;
-		
-		retval = raw_write_blk(channel, data,
-				       cache->block, 1, cache->buf);
-		if (retval)
-			retval2 = retval;
-		else
-			cache->dirty = 0;
-	}
-	return retval2;
-}
-
 
 
 static errcode_t unix_open(const char *name, int flags, io_channel *channel)
@@ -324,10 +542,12 @@ static errcode_t unix_open(const char *name, int flags, io_channel *channel)
 
 	memset(data, 0, sizeof(struct unix_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->io_stats.num_fields = 5;
+	data->cache_blocks = CACHE_BLOCKS;
 
 	if ((retval = alloc_cache(io, data)))
 		goto cleanup;
-	
+
 	open_flags = (flags & IO_FLAG_RW) ? O_RDWR : O_RDONLY;
 #ifdef O_LARGEFILE
 	open_flags |= O_LARGEFILE;
@@ -349,8 +569,11 @@ cleanup:
 		free_cache(io, data);
 		ext2fs_free_mem((void **) &data);
 	}
-	if (io)
+	if (io) {
+		if (io->name)
+			ext2fs_free_mem((void **) &io->name);
 		ext2fs_free_mem((void **) &io);
+	}
 	return retval;
 }
 
@@ -391,7 +614,7 @@ static errcode_t unix_set_blksize(io_channel channel, int blksize)
 	if (channel->block_size != blksize) {
 		if ((retval = flush_cached_blocks(channel, data, 0)))
 			return retval;
-		
+
 		channel->block_size = blksize;
 		free_cache(channel, data);
 		if ((retval = alloc_cache(channel, data)))
@@ -424,6 +647,19 @@ static errcode_t unix_read_blk(io_channel channel, unsigned long block,
 		return raw_read_blk(channel, data, block, count, buf);
 	}
 
+	/*
+	 * If we're doing a very large read, do it directly, so that it
+	 * doesn't evict (and write back) the whole cache, and then pick
+	 * up the blocks of the range that are only up to date in the cache.
+	 */
+	if (count > WRITE_VIA_CACHE_SIZE || count > data->cache_blocks / 2) {
+		if ((retval = raw_read_blk(channel, data, block, count, buf)))
+			return retval;
+		if (data->cache_blocks != 0)
+			merge_dirty_blocks(channel, data, block, count, buf);
+		return 0;
+	}
+
 	cp = buf;
 	while (count > 0) {
 		/* If it's in the cache, use it! */
@@ -431,6 +667,7 @@ static errcode_t unix_read_blk(io_channel channel, unsigned long block,
 #ifdef DEBUG
 			printf("Using cached block %d\n", block);
 #endif
+			data->io_stats.cache_hits++;
 			memcpy(cp, cache->buf, channel->block_size);
 			count--;
 			block++;
@@ -447,9 +684,10 @@ static errcode_t unix_read_blk(io_channel channel, unsigned long block,
 #ifdef DEBUG
 		printf("Reading %d blocks starting at %d\n", i, block);
 #endif
+		data->io_stats.cache_misses += i;
 		if ((retval = raw_read_blk(channel, data, block, i, cp)))
 			return retval;
-		
+
 		/* Save the results in the cache */
 		for (j=0; j < i; j++) {
 			count--;
@@ -476,15 +714,25 @@ static errcode_t unix_write_blk(io_channel channel, unsigned long block,
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
 	/*
-	 * If we're doing an odd-sized write or a very large write,
-	 * flush out the cache completely and then do a direct write.
+	 * If we're doing an odd-sized write, flush out the cache
+	 * completely and then do a direct write.
 	 */
-	if (count < 0 || count > WRITE_VIA_CACHE_SIZE) {
+	if (count < 0) {
 		if ((retval = flush_cached_blocks(channel, data, 1)))
 			return retval;
 		return raw_write_blk(channel, data, block, count, buf);
 	}
 
+	/*
+	 * If we're doing a very large write, drop the blocks it
+	 * overwrites from the cache and then do a direct write.
+	 */
+	if (count > WRITE_VIA_CACHE_SIZE || count > data->cache_blocks / 2) {
+		if (data->cache_blocks != 0)
+			invalidate_cached_blocks(data, block, count);
+		return raw_write_blk(channel, data, block, count, buf);
+	}
+
 	/*
 	 * For a moderate-sized multi-block write, first force a write
 	 * if we're in write-through cache mode, and then fill the
@@ -493,17 +741,24 @@ static errcode_t unix_write_blk(io_channel channel, unsigned long block,
 	writethrough = channel->flags & CHANNEL_FLAGS_WRITETHROUGH;
 	if (writethrough)
 		retval = raw_write_blk(channel, data, block, count, buf);
-	
+
 	cp = buf;
 	while (count > 0) {
-		cache = find_cached_block(channel, data, block, 1);
+		cache = find_cached_block(channel, data, block, 0);
+		if (cache)
+			data->io_stats.cache_hits++;
+		else {
+			data->io_stats.cache_misses++;
+			cache = find_cached_block(channel, data, block, 1);
+		}
 		if (!cache) {
 			/*
 			 * Oh shit, we couldn't get cache descriptor.
 			 * Force the write directly.
 			 */
-			if ((retval2 = raw_write_blk(channel, data, block,
-						1, cp)))
+			if (!writethrough &&
+			    (retval2 = raw_write_blk(channel, data, block,
+						     1, cp)))
 				retval = retval2;
 		} else {
 			memcpy(cache->buf, cp, channel->block_size);
@@ -535,7 +790,9 @@ static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 
 	if (lseek(data->dev, offset, SEEK_SET) < 0)
 		return errno;
-	
+
+	data->io_stats.bytes_written += size;
+	data->io_stats.write_requests++;
 	actual = write(data->dev, buf, size);
 	if (actual != size)
 		return EXT2_ET_SHORT_WRITE;
@@ -544,13 +801,13 @@ static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 }
 
 /*
- * Flush data buffers to disk.  
+ * Flush data buffers to disk.
  */
 static errcode_t unix_flush(io_channel channel)
 {
 	struct unix_private_data *data;
 	errcode_t retval = 0;
-	
+
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	data = (struct unix_private_data *) channel->private_data;
 	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
@@ -560,6 +817,50 @@ static errcode_t unix_flush(io_channel channel)
 	return retval;
 }
 
+/*
+ * The only option we support is "cache_blocks=<n>", to set the
+ * number of blocks the cache can hold (0 to disable caching).
+ */
+static errcode_t unix_set_option(io_channel channel, const char *option,
+				 const char *arg)
+{
+	struct unix_private_data *data;
+	unsigned long	tmp;
+	char		*end;
+	errcode_t	retval;
 
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (strcmp(option, "cache_blocks") != 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+	if (!arg)
+		return EXT2_ET_INVALID_ARGUMENT;
+	tmp = strtoul(arg, &end, 0);
+	if (*end || tmp > 1024 * 1024)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	if ((retval = flush_cached_blocks(channel, data, 0)))
+		return retval;
+	free_cache(channel, data);
+	data->cache_blocks = (int) tmp;
+	return alloc_cache(channel, data);
+}
 
-#endif
\ No newline at end of file
+static errcode_t unix_get_stats(io_channel channel, io_stats *stats)
+{
+	struct unix_private_data *data;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (stats)
+		*stats = &data->io_stats;
+	return 0;
+}
+
+
+
+#endif
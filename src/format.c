@@ -31,6 +31,7 @@
 #include <ctype.h>
 #include <locale.h>
 #include <assert.h>
+#include <errno.h>
 #if !defined(__MINGW32__)
 #include <vds.h>
 #endif
@@ -41,6 +42,7 @@
 #include "resource.h"
 #include "settings.h"
 #include "winio.h"
+#include "thread.h"
 #include "msapi_utf8.h"
 #include "localization.h"
 
@@ -58,26 +60,106 @@
 #include "bled/bled.h"
 #include "../res/grub/grub_version.h"
 
-/* Numbers of buffer used for asynchronous DD reads */
-#define NUM_BUFFERS 2
+/* How long the DD pipeline stages wait on each other before checking for cancellation (ms) */
+#define DD_PIPELINE_WAIT    100
+/* Granularity at which zeroed data is detected for sparse writes */
+#define SPARSE_CHUNK_SIZE   (1 * MB)
+
+/* Maximum number of blocks fast-zeroing skips reading between two probes */
+#define FZ_MAX_BACKOFF      64
+/* Maximum number of ranges of differing sectors that VerifyDrive() reports */
+#define VERIFY_MAX_RANGES   32
+
+/*
+ * Fast-zeroing back-off state. Reading a block back is only worth it if the writes it
+ * saves take longer than the reads, so we keep running averages of the time it takes
+ * to read and write a block, along with the proportion of probed blocks that were empty.
+ */
+typedef struct {
+	uint64_t read_time;		// In ms, as 24.8 fixed point
+	uint64_t write_time;	// In ms, as 24.8 fixed point
+	uint32_t hit_rate;		// In 1/256th
+	uint32_t backoff;
+	uint32_t skip;
+} fz_throttle_t;
+
+/* A buffer travelling through the DD write pipeline */
+typedef struct {
+	uint8_t* buf;
+	DWORD size;			// Size of the data, rounded up to the sector size. 0 for end of stream.
+	DWORD data_size;	// Size of the data, as read from the source
+	uint64_t offset;	// Offset of the data on the target
+	uint64_t zero_map;	// For sparse writes, bit n is set if chunk n only contains zeroes
+} dd_block_t;
+
+/* Optional processing applied to each block between the read and the write stage */
+typedef BOOL (*dd_transform_t)(dd_block_t* block, void* context);
+
+/*
+ * The DD write pipeline. Blocks cycle from the free queue to the reader, then to
+ * the (optional) transform stage and then to the writer, which hands them back.
+ */
+typedef struct {
+	HANDLE hSource;
+	uint64_t target_size;
+	DWORD buf_size;
+	uint32_t nb_blocks;
+	dd_block_t* block;
+	dd_block_t eos;				// End of stream marker
+	spsc_queue_t free_q;		// writer → reader
+	spsc_queue_t read_q;		// reader → transform
+	spsc_queue_t write_q;		// reader or transform → writer
+	dd_transform_t transform;
+	void* transform_context;
+	thread_t reader, transformer;
+	BOOL has_reader, has_transformer;
+	uint32_t inflight;			// Reads the reader could not retire from the source on exit
+	volatile LONG abort;
+} dd_pipeline_t;
+
+/* State of VerifyDrive(), which the bled write callback also needs access to */
+typedef struct {
+	dd_pipeline_t* target;		// Reads the data back from the target
+	dd_block_t* blk;			// Current target block, for compressed images
+	DWORD pos;					// Position in the current target block
+	uint64_t offset;			// Offset of the target data we compare next
+	uint64_t size;				// Amount of data verified so far
+	uint64_t seek;				// Last target position set by bled, for VTSI images
+	BOOL is_vtsi;
+	uint64_t bad_sectors;
+	uint64_t last_bad;			// LBA of the last differing sector
+	uint32_t nb_ranges;
+	BOOL truncated;				// Set if there were more ranges than we could record
+	struct {
+		uint64_t start;
+		uint64_t end;
+	} range[VERIFY_MAX_RANGES];	// Ranges of differing LBAs
+} verify_state_t;
 
 /*
  * Globals
  */
 const char* FileSystemLabel[FS_MAX] = { "FAT", "FAT32", "NTFS", "UDF", "exFAT", "ReFS", "ext2", "ext3", "ext4" };
 DWORD ErrorStatus = 0, LastWriteError = 0;
+uint32_t dd_buffer_count = DD_PIPELINE_BUFFERS;
 badblocks_report report = { 0 };
 static float format_percent = 0.0f;
 static int task_number = 0, actual_fs_type;
-static unsigned int sec_buf_pos = 0;
+static BOOL sparse_enabled = FALSE;
+static uint64_t sparse_pending = 0, sparse_bytes = 0;
+static multihash_t* write_hash = NULL;
+static uint64_t write_hash_size = 0;
+static verify_state_t verify;
 extern const int nb_steps[FS_MAX];
 extern const char* md5sum_name[2];
 extern uint32_t dur_mins, dur_secs;
 extern uint32_t wim_nb_files, wim_proc_files, wim_extra_files;
 extern BOOL force_large_fat32, enable_ntfs_compression, lock_drive, zero_drive, fast_zeroing, enable_file_indexing;
-extern BOOL write_as_image, use_vds, write_as_esp, is_vds_available, has_ffu_support, use_rufus_mbr;
+extern BOOL write_as_image, use_vds, write_as_esp, is_vds_available, has_ffu_support, use_rufus_mbr, sparse_write;
+extern BOOL enable_extra_hashes, hash_on_write, read_back_on_write, verify_after_write;
+extern uint32_t hash_count[HASH_MAX], hash_buffer_size;
 extern char* archive_path;
-uint8_t *grub2_buf = NULL, *sec_buf = NULL;
+uint8_t *grub2_buf = NULL, *sparse_buf = NULL;
 long grub2_len;
 
 /*
@@ -1096,87 +1178,588 @@ static void update_progress(const uint64_t processed_bytes)
 	}
 }
 
+/*
+ * Commit the run of zeroes that sector_write_sparse() has been accumulating, at
+ * the current position of the target. Large runs are zeroed by the target itself
+ * and small ones (or all runs, if the target can't do it) are written out as usual.
+ */
+static BOOL sparse_flush(HANDLE h)
+{
+	LARGE_INTEGER li = { 0 }, pos;
+	DWORD size, written;
+
+	if (sparse_pending == 0)
+		return TRUE;
+	if (!SetFilePointerEx(h, li, &pos, FILE_CURRENT))
+		return FALSE;
+	if (sparse_pending >= SPARSE_CHUNK_SIZE) {
+		if (ZeroFileRange(h, pos.QuadPart, sparse_pending)) {
+			sparse_bytes += sparse_pending;
+			sparse_pending = 0;
+			return TRUE;
+		}
+		uprintf("\r\nNotice: The target does not support sparse writes (%s)", WindowsErrorString());
+		sparse_enabled = FALSE;
+		if (!SetFilePointerEx(h, pos, NULL, FILE_BEGIN))
+			return FALSE;
+	}
+	for (; sparse_pending > 0; sparse_pending -= size) {
+		size = (DWORD)MIN(sparse_pending, SPARSE_CHUNK_SIZE);
+		if (!WriteFile(h, sparse_buf, size, &written, NULL) || (written != size))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Write the data in [start, end) of buf, after any run of zeroes that precedes it */
+static BOOL sparse_write_span(int fd, const uint8_t* buf, unsigned int start, unsigned int end)
+{
+	if (start >= end)
+		return TRUE;
+	if (!sparse_flush((HANDLE)_get_osfhandle(fd)))
+		return FALSE;
+	return (_write(fd, &buf[start], end - start) == (int)(end - start));
+}
+
+/*
+ * Same as _write(), except that, when sparse write is enabled, the data is scanned in
+ * chunks of SPARSE_CHUNK_SIZE (which is a multiple of the sector size), like DdSparseScan()
+ * does, and writing the chunks that only contain zeroes is deferred.
+ */
+static int sector_write_sparse(int fd, const uint8_t* buf, unsigned int count)
+{
+	unsigned int pos, len, start = 0;
+	uint32_t value;
+
+	for (pos = 0; sparse_enabled && (pos < count); pos += len) {
+		len = MIN(SPARSE_CHUNK_SIZE, count - pos);
+		if (!IsUniformBlock(&buf[pos], len, &value) || (value != 0))
+			continue;
+		// Consecutive chunks with data are written at once, before we start accumulating zeroes
+		if (!sparse_write_span(fd, buf, start, pos))
+			return -1;
+		sparse_pending += len;
+		start = pos + len;
+	}
+	return sparse_write_span(fd, buf, start, count) ? (int)count : -1;
+}
+
+/* Used by bled, to zero the areas of the target that a VTSI image doesn't cover */
+static int sector_discard(int fd, uint64_t offset, uint64_t size)
+{
+	return ZeroFileRange((HANDLE)_get_osfhandle(fd), offset, size) ? 0 : -1;
+}
+
 // Some compressed images use streams that aren't multiple of the sector
-// size and cause write failures => Use a write override that alleviates
-// the problem. See GitHub issue #1422 for details.
+// size and cause write failures. See GitHub issue #1422 for details.
+// The bled output sink takes care of this, by buffering the data so that
+// we only ever get full sectors, except for the very last write, where the
+// sink pads the data with zeroes up to the sector size.
 static int sector_write(int fd, const void* _buf, unsigned int count)
 {
 	const uint8_t* buf = (const uint8_t*)_buf;
-	unsigned int sec_size = (unsigned int)SelectedDrive.SectorSize;
-	int written, fill_size = 0;
+	unsigned int size;
 
-	if (sec_size == 0)
-		sec_size = 512;
-	if_not_assert(sec_size <= 64 * KB)
-		return -1;
 	if_not_assert(count <= 1 * GB)
 		return -1;
 
-	// If we are on a sector boundary and count is multiple of the
-	// sector size, just issue a regular write
-	if ((sec_buf_pos == 0) && (count % sec_size == 0))
-		return _write(fd, buf, count);
-
-	// If we have an existing partial sector, fill and write it
-	if (sec_buf_pos > 0) {
-		if_not_assert(sec_size >= sec_buf_pos)
-			return -1;
-		fill_size = min(sec_size - sec_buf_pos, count);
-		memcpy(&sec_buf[sec_buf_pos], buf, fill_size);
-		sec_buf_pos += fill_size;
-		// If we don't have a full sector just buffer it for next call
-		if (sec_buf_pos < sec_size)
-			return (int)count;
-		sec_buf_pos = 0;
-		written = _write(fd, sec_buf, sec_size);
-		if (written != sec_size)
-			return written;
-	}
-
-	// Now write as many full sectors as we can
-	uint32_t sec_num = (count - fill_size) / sec_size;
-	written = _write(fd, &buf[fill_size], sec_num * sec_size);
-	if (written < 0)
-		return written;
-	if (written != sec_num * sec_size) {
-		// Detect overflows
-		// coverity[overflow]
-		int v = fill_size + written;
-		if_not_assert(v >= fill_size)
+	// Hash the data as it comes out of the decompressor
+	if (write_hash != NULL) {
+		if (!MultiHashWrite(write_hash, buf, count))
 			return -1;
-		else
-			return v;
+		write_hash_size += count;
 	}
-	sec_buf_pos = count - fill_size - written;
-	if_not_assert(sec_buf_pos < sec_size)
-		return -1;
 
-	// Keep leftover bytes, if any, in the sector buffer
-	if (sec_buf_pos != 0)
-		memcpy(sec_buf, &buf[fill_size + written], sec_buf_pos);
+	size = HI_ALIGN_X_TO_Y(count, SelectedDrive.SectorSize);
+	if (sector_write_sparse(fd, buf, size) != (int)size)
+		return -1;
 	return (int)count;
 }
 
+/* Write a block to the current position of the target, with retries */
+static BOOL WriteBlockWithRetry(HANDLE hPhysicalDrive, const uint8_t* buf, DWORD size, uint64_t wb)
+{
+	BOOL s;
+	DWORD i, write_size;
+	LARGE_INTEGER li;
+
+	for (i = 1; i <= WRITE_RETRIES; i++) {
+		CHECK_FOR_USER_CANCEL;
+		s = WriteFile(hPhysicalDrive, buf, size, &write_size, NULL);
+		if ((s) && (write_size == size))
+			return TRUE;
+		if (s)
+			uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, size);
+		else
+			uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
+		if (i < WRITE_RETRIES) {
+			li.QuadPart = wb;
+			uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
+			Sleep(WRITE_TIMEOUT);
+			if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+				uprintf("Write error: Could not reset position - %s", WindowsErrorString());
+				goto out;
+			}
+		} else {
+			ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+			goto out;
+		}
+		Sleep(200);
+	}
+out:
+	return FALSE;
+}
+
+/* Add a sample to one of the fast-zeroing running averages */
+static void FzAddSample(uint64_t* avg, uint64_t duration_ms)
+{
+	uint64_t sample = duration_ms << 8;
+	*avg = (*avg == 0) ? sample : *avg - *avg / 4 + sample / 4;
+}
+
+/* Whether fast-zeroing should read the next block back, or just write it */
+static BOOL FzShouldProbe(fz_throttle_t* t)
+{
+	if (t->skip == 0)
+		return TRUE;
+	t->skip--;
+	return FALSE;
+}
+
+/* Update the back-off after a block has been read back */
+static void FzProbeResult(fz_throttle_t* t, BOOL empty)
+{
+	t->hit_rate = t->hit_rate - t->hit_rate / 4 + (empty ? 256 / 4 : 0);
+	// Keep probing as long as we find empty blocks, or as long as the time we expect
+	// to save on writes is larger than the time we spend reading. Else back off.
+	if (empty || ((uint64_t)t->hit_rate * t->write_time > 256ULL * t->read_time))
+		t->backoff = 0;
+	else
+		t->backoff = (t->backoff == 0) ? 1 : MIN(2 * t->backoff, FZ_MAX_BACKOFF);
+	t->skip = t->backoff;
+}
+
+/* For sparse writes: flag the chunks of a block that only contain zeroes */
+static void DdSparseScan(dd_block_t* blk)
+{
+	DWORD pos, len;
+	uint32_t i, value;
+
+	blk->zero_map = 0;
+	for (i = 0, pos = 0; (i < 64) && (pos < blk->size); i++, pos += len) {
+		len = MIN(SPARSE_CHUNK_SIZE, blk->size - pos);
+		if (IsUniformBlock(&blk->buf[pos], len, &value) && (value == 0))
+			blk->zero_map |= 1ULL << i;
+	}
+}
+
+/* Transform stage of WriteDrive(), which processes a block while the previous one is being written */
+static BOOL DdWriteTransform(dd_block_t* blk, void* context)
+{
+	if (sparse_enabled)
+		DdSparseScan(blk);
+	if (write_hash != NULL) {
+		if (!MultiHashWrite(write_hash, blk->buf, blk->data_size))
+			return FALSE;
+		write_hash_size += blk->data_size;
+	}
+	return TRUE;
+}
+
+/* Whether the chunk of a block that contains pos was flagged as empty */
+static __inline BOOL IsZeroChunk(const dd_block_t* blk, DWORD pos)
+{
+	DWORD i = pos / SPARSE_CHUNK_SIZE;
+	return (i < 64) && ((blk->zero_map >> i) & 1);
+}
+
+/*
+ * Write a block that went through DdSparseScan(), by zeroing the runs of empty
+ * chunks on the target rather than writing them. Falls back to regular writes for
+ * the rest of the session if the target doesn't support it.
+ */
+static BOOL WriteSparseBlock(HANDLE hPhysicalDrive, dd_block_t* blk)
+{
+	DWORD pos, len;
+	BOOL zero;
+	LARGE_INTEGER li;
+
+	for (pos = 0; pos < blk->size; pos += len) {
+		if (!sparse_enabled || (blk->zero_map == 0))
+			return WriteBlockWithRetry(hPhysicalDrive, &blk->buf[pos], blk->size - pos, blk->offset + pos);
+		// Coalesce consecutive chunks of the same kind
+		zero = IsZeroChunk(blk, pos);
+		for (len = 0; (pos + len < blk->size) && (IsZeroChunk(blk, pos + len) == zero);
+			len += MIN(SPARSE_CHUNK_SIZE, blk->size - pos - len));
+		if (zero) {
+			if (ZeroFileRange(hPhysicalDrive, blk->offset + pos, len)) {
+				sparse_bytes += len;
+				continue;
+			}
+			uprintf("\r\nNotice: The target does not support sparse writes (%s)", WindowsErrorString());
+			sparse_enabled = FALSE;
+			li.QuadPart = blk->offset + pos;
+			if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+				uprintf("Write error: Could not reset position - %s", WindowsErrorString());
+				return FALSE;
+			}
+		}
+		if (!WriteBlockWithRetry(hPhysicalDrive, &blk->buf[pos], len, blk->offset + pos))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Abort the pipeline from any of its stages */
+static void dd_abort(dd_pipeline_t* p, DWORD error)
+{
+	if ((error != 0) && !IS_ERROR(ErrorStatus))
+		ErrorStatus = error;
+	p->abort = TRUE;
+}
+
+/*
+ * Reader stage: keep as many asynchronous reads in flight as the backend and
+ * the number of free blocks allow, and forward them in order once completed.
+ */
+static DWORD WINAPI DdReaderThread(void* param)
+{
+	dd_pipeline_t* p = (dd_pipeline_t*)param;
+	spsc_queue_t* out_q = (p->transform != NULL) ? &p->read_q : &p->write_q;
+	dd_block_t *blk, **inflight = NULL;
+	DWORD read_size;
+	uint32_t depth, head = 0, count = 0;
+	uint64_t submitted = 0, completed = 0;
+	BOOL eof = FALSE;
+
+	depth = MIN(MAX(GetQueueDepthAsync(p->hSource), 1), p->nb_blocks);
+	inflight = calloc(depth, sizeof(dd_block_t*));
+	if (inflight == NULL) {
+		dd_abort(p, RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY));
+		goto out;
+	}
+
+	while (!p->abort) {
+		// 1. Queue new reads. It is VERY IMPORTANT here that we don't attempt to read past
+		// the source or target sizes, as mounted VHDs will SCREW YOU if you attempt to do so
+		// and will even start returning ERRONEOUS DATA for sectors before the end of the disk.
+		while (!eof && (count < depth) && (submitted < p->target_size)) {
+			blk = (count == 0) ? spsc_pop_wait(&p->free_q, DD_PIPELINE_WAIT) : spsc_pop(&p->free_q);
+			if (blk == NULL)
+				break;
+			blk->size = (DWORD)MIN(p->buf_size, p->target_size - submitted);
+			if (!ReadFileAsync(p->hSource, blk->buf, blk->size)) {
+				uprintf("\r\nRead error: %s", WindowsErrorString());
+				dd_abort(p, RUFUS_ERROR(ERROR_READ_FAULT));
+				goto out;
+			}
+			inflight[(head + count++) % depth] = blk;
+			submitted += blk->size;
+		}
+		if (count == 0) {
+			if (eof || submitted >= p->target_size)
+				break;
+			continue;
+		}
+
+		// 2. Wait for the oldest read to complete. If the wait itself fails, the read
+		// is still owned by the source, and will be retired by the drain below.
+		if (!WaitFileAsync(p->hSource, DRIVE_ACCESS_TIMEOUT)) {
+			uprintf("\r\nRead error: %s", WindowsErrorString());
+			dd_abort(p, RUFUS_ERROR(ERROR_READ_FAULT));
+			goto out;
+		}
+		blk = inflight[head];
+		head = (head + 1) % depth;
+		count--;
+		if (!GetSizeAsync(p->hSource, &read_size)) {
+			uprintf("\r\nRead error: %s", WindowsErrorString());
+			spsc_push(&p->free_q, blk);
+			dd_abort(p, RUFUS_ERROR(ERROR_READ_FAULT));
+			goto out;
+		}
+
+		// 3. A short read means we reached the end of the source, in which case
+		// any data from the reads that we queued after this one is irrelevant.
+		if (eof || read_size == 0) {
+			eof = TRUE;
+			spsc_push(&p->free_q, blk);
+			continue;
+		}
+		if (read_size < blk->size)
+			eof = TRUE;
+
+		// 4. WriteFile fails unless the size is a multiple of sector size
+		blk->data_size = read_size;
+		if (read_size % SelectedDrive.SectorSize != 0) {
+			if_not_assert(HI_ALIGN_X_TO_Y(read_size, SelectedDrive.SectorSize) <= p->buf_size) {
+				dd_abort(p, RUFUS_ERROR(ERROR_READ_FAULT));
+				goto out;
+			}
+			read_size = HI_ALIGN_X_TO_Y(read_size, SelectedDrive.SectorSize);
+		}
+		blk->size = read_size;
+		blk->offset = completed;
+		blk->zero_map = 0;
+		completed += read_size;
+
+		// 5. Hand the block over to the next stage
+		while (!spsc_push_wait(out_q, blk, DD_PIPELINE_WAIT))
+			if (p->abort)
+				goto out;
+	}
+
+out:
+	// Never return with reads in flight, as the source would keep writing into
+	// blocks that are about to be recycled, or released by DdPipelineExit().
+	while (count > 0) {
+		WaitFileAsync(p->hSource, DRIVE_ACCESS_TIMEOUT);
+		errno = 0;
+		if (!GetSizeAsync(p->hSource, &read_size) && (errno == EINPROGRESS))
+			break;
+		spsc_push(&p->free_q, inflight[head]);
+		head = (head + 1) % depth;
+		count--;
+	}
+	p->inflight = count;
+	if (!p->abort)
+		spsc_push(out_q, &p->eos);
+	free(inflight);
+	return 0;
+}
+
+/* Transform stage: apply the transform to each block and forward it to the writer */
+static DWORD WINAPI DdTransformThread(void* param)
+{
+	dd_pipeline_t* p = (dd_pipeline_t*)param;
+	dd_block_t* blk;
+
+	while (!p->abort) {
+		blk = spsc_pop_wait(&p->read_q, DD_PIPELINE_WAIT);
+		if (blk == NULL)
+			continue;
+		if ((blk != &p->eos) && !p->transform(blk, p->transform_context)) {
+			dd_abort(p, RUFUS_ERROR(ERROR_WRITE_FAULT));
+			break;
+		}
+		while (!spsc_push_wait(&p->write_q, blk, DD_PIPELINE_WAIT))
+			if (p->abort)
+				return 0;
+		if (blk == &p->eos)
+			break;
+	}
+	return 0;
+}
+
+/* Stop the pipeline threads and release all the pipeline resources */
+static void DdPipelineExit(dd_pipeline_t* p)
+{
+	p->abort = TRUE;
+	if (p->has_reader)
+		thread_join(p->reader);
+	if (p->has_transformer)
+		thread_join(p->transformer);
+	p->has_reader = FALSE;
+	p->has_transformer = FALSE;
+	if (p->block != NULL && p->block[0].buf != NULL) {
+		// Leaking the buffers is a lot better than having the source write into freed memory
+		if (p->inflight == 0)
+			_mm_free(p->block[0].buf);
+		else
+			uprintf("Warning: %u DD read(s) still in flight - not releasing the pipeline buffers", p->inflight);
+	}
+	safe_free(p->block);
+	spsc_destroy(&p->free_q);
+	spsc_destroy(&p->read_q);
+	spsc_destroy(&p->write_q);
+}
+
+/* Allocate the pipeline buffers and start the reader and transform stages */
+static BOOL DdPipelineInit(dd_pipeline_t* p, HANDLE hSource, uint64_t target_size,
+	dd_transform_t transform, void* transform_context)
+{
+	uint32_t i;
+	uint8_t* buffer;
+
+	memset(p, 0, sizeof(dd_pipeline_t));
+	p->hSource = hSource;
+	p->target_size = target_size;
+	p->transform = transform;
+	p->transform_context = transform_context;
+	p->nb_blocks = MIN(MAX(dd_buffer_count, 2), 64);
+	// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
+	p->buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+
+	p->block = calloc(p->nb_blocks, sizeof(dd_block_t));
+	buffer = (uint8_t*)_mm_malloc((size_t)p->buf_size * p->nb_blocks, SelectedDrive.SectorSize);
+	if ((p->block == NULL) || (buffer == NULL)) {
+		_mm_free(buffer);
+		goto error;
+	}
+	if_not_assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0) {
+		_mm_free(buffer);
+		goto error;
+	}
+	RegisterBufferAsync(hSource, buffer, p->buf_size * p->nb_blocks);
+
+	// All queues must be able to hold every block plus the end of stream marker
+	if (!spsc_init(&p->free_q, p->nb_blocks + 1) || !spsc_init(&p->read_q, p->nb_blocks + 1) ||
+		!spsc_init(&p->write_q, p->nb_blocks + 1))
+		goto error;
+	for (i = 0; i < p->nb_blocks; i++) {
+		p->block[i].buf = &buffer[(size_t)i * p->buf_size];
+		spsc_push(&p->free_q, &p->block[i]);
+	}
+
+	if (transform != NULL) {
+		p->has_transformer = thread_create(&p->transformer, DdTransformThread, p);
+		if (!p->has_transformer)
+			goto thread_error;
+	}
+	p->has_reader = thread_create(&p->reader, DdReaderThread, p);
+	if (!p->has_reader)
+		goto thread_error;
+	uprintf("Using %d x %s buffers", p->nb_blocks, SizeToHumanReadable(p->buf_size, FALSE, FALSE));
+	return TRUE;
+
+error:
+	ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+	uprintf("Could not allocate disk write buffer");
+	DdPipelineExit(p);
+	return FALSE;
+
+thread_error:
+	ErrorStatus = RUFUS_ERROR(ERROR_CANT_START_THREAD);
+	uprintf("Could not start disk write thread");
+	DdPipelineExit(p);
+	return FALSE;
+}
+
+/*
+ * Log the digests of the data that WriteDrive() wrote and, if requested, read that
+ * data back from the target, to check that it produces the same digests.
+ */
+static BOOL CheckWriteHash(HANDLE hPhysicalDrive, uint32_t hash_mask)
+{
+	const char* hash_name[HASH_MAX] = { "MD5   ", "SHA1  ", "SHA256", "SHA512" };
+	uint8_t written[HASH_MAX][MAX_HASHSIZE], read_back[HASH_MAX][MAX_HASHSIZE], *buf;
+	char str[2 * MAX_HASHSIZE + 1];
+	BOOL s, r = FALSE;
+	DWORD size, read_size;
+	uint32_t i, j, buf_size;
+	uint64_t rb;
+	LARGE_INTEGER li;
+	multihash_t* mh = NULL;
+
+	if (!MultiHashFinal(write_hash, written)) {
+		uprintf("Could not compute the digests of the written data");
+		goto out;
+	}
+	uprintf("Digests of the %s written:", SizeToHumanReadable(write_hash_size, FALSE, FALSE));
+	for (i = 0; i < HASH_MAX; i++) {
+		if (!(hash_mask & (1 << i)))
+			continue;
+		for (j = 0; j < hash_count[i]; j++)
+			sprintf(&str[2 * j], "%02x", written[i][j]);
+		uprintf("  %s: %s", hash_name[i], str);
+	}
+	if (!read_back_on_write) {
+		r = TRUE;
+		goto out;
+	}
+
+	uprintf("Reading back the data to check its digests:");
+	mh = MultiHashCreate(hash_mask, hash_buffer_size, HASH_BUFFER_COUNT);
+	if (mh == NULL) {
+		uprintf("Could not start hashing threads");
+		goto out;
+	}
+	li.QuadPart = 0;
+	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+		uprintf("Could not rewind device: %s", WindowsErrorString());
+		goto out;
+	}
+	for (rb = 0; rb < write_hash_size; rb += size) {
+		UpdateProgressWithInfo(OP_FORMAT, MSG_271, rb, write_hash_size);
+		CHECK_FOR_USER_CANCEL;
+		// The engine buffers are page aligned and always consumed in full, except for the
+		// last one, so we can read from the device straight into them.
+		buf = MultiHashGetBuffer(mh, &buf_size);
+		size = (DWORD)MIN(buf_size, HI_ALIGN_X_TO_Y(write_hash_size - rb, SelectedDrive.SectorSize));
+		s = ReadFile(hPhysicalDrive, buf, size, &read_size, NULL);
+		if ((!s) || (read_size != size)) {
+			uprintf("Read error at sector %lld: %s", rb / SelectedDrive.SectorSize, WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			goto out;
+		}
+		size = (DWORD)MIN(size, write_hash_size - rb);
+		if (!MultiHashCommit(mh, size))
+			goto out;
+	}
+	if (!MultiHashFinal(mh, read_back)) {
+		uprintf("Could not compute the digests of the data read back");
+		goto out;
+	}
+	for (i = 0; i < HASH_MAX; i++) {
+		if (!(hash_mask & (1 << i)))
+			continue;
+		if (memcmp(written[i], read_back[i], hash_count[i]) != 0) {
+			for (j = 0; j < hash_count[i]; j++)
+				sprintf(&str[2 * j], "%02x", read_back[i][j]);
+			uprintf("  %s mismatch: %s", hash_name[i], str);
+			ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+			goto out;
+		}
+	}
+	uprintf("  The data read back matches");
+	r = TRUE;
+
+out:
+	MultiHashDestroy(mh);
+	if (!r && !IS_ERROR(ErrorStatus))
+		ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+	return r;
+}
+
 /* Write an image file or zero a drive */
 static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 {
-	BOOL s, ret = FALSE;
+	BOOL s, ret = FALSE, is_vtsi;
 	LARGE_INTEGER li;
 	HANDLE hSourceImage = INVALID_HANDLE_VALUE;
-	DWORD i, read_size[NUM_BUFFERS] = { 0 }, write_size, comp_size, buf_size;
+	DWORD read_size, write_size, comp_size, buf_size;
 	uint64_t wb, target_size = bZeroDrive ? SelectedDrive.DiskSize : MIN((uint64_t)SelectedDrive.DiskSize, img_report.image_size);
 	uint64_t cur_value, last_value = 0;
 	int64_t bled_ret;
+	bled_ctx_t* bled = NULL;
 	uint8_t* buffer = NULL;
-	uint32_t zero_data, *cmp_buffer = NULL;
+	uint32_t *cmp_buffer = NULL;
 	char* vhd_path = NULL;
-	int throttle_fast_zeroing = 0, read_bufnum = 0, proc_bufnum = 1;
+	uint64_t start_time;
+	uint32_t hash_mask = (1 << (HASH_MAX - (enable_extra_hashes ? 0 : 1))) - 1;
+	fz_throttle_t throttle = { 0, 0, 128, 0, 0 };
+	dd_pipeline_t pipeline = { 0 };
+	dd_block_t* blk;
 
 	if (SelectedDrive.SectorSize < 512) {
 		uprintf("Unexpected sector size (%d) - Aborting", SelectedDrive.SectorSize);
 		return FALSE;
 	}
 
+	// Sparse write only makes sense when writing an image
+	sparse_enabled = sparse_write && !bZeroDrive;
+	sparse_pending = 0;
+	sparse_bytes = 0;
+
+	// Optionally hash the data we write, so that it can be reported and read back
+	write_hash_size = 0;
+	// VTSI images are written at the offsets their segments specify, rather than as a stream
+	if (hash_on_write && !bZeroDrive && (img_report.compression_type != BLED_COMPRESSION_VTSI)) {
+		write_hash = MultiHashCreate(hash_mask, hash_buffer_size, HASH_BUFFER_COUNT);
+		if (write_hash == NULL)
+			uprintf("Could not start hashing threads - The written data will not be hashed");
+	}
+
 	// We poked the MBR and other stuff, so we need to rewind
 	li.QuadPart = 0;
 	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
@@ -1210,47 +1793,42 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 				goto out;
 		}
 
-		read_size[0] = buf_size;
+		read_size = buf_size;
 		for (wb = 0, write_size = 0; wb < target_size; wb += write_size) {
 			UpdateProgressWithInfo(OP_FORMAT, fast_zeroing ? MSG_306 : MSG_286, wb, target_size);
 			cur_value = (wb * 80) / target_size;
 			for (; cur_value > last_value && last_value < 80; last_value++)
 				uprintfs("+");
 			// Don't overflow our projected size (mostly for VHDs)
-			if (wb + read_size[0] > target_size)
-				read_size[0] = (DWORD)(target_size - wb);
+			if (wb + read_size > target_size)
+				read_size = (DWORD)(target_size - wb);
 
 			// WriteFile fails unless the size is a multiple of sector size
-			if (read_size[0] % SelectedDrive.SectorSize != 0)
-				read_size[0] = ((read_size[0] + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+			if (read_size % SelectedDrive.SectorSize != 0)
+				read_size = ((read_size + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
 
 			// Fast-zeroing: Depending on your hardware, reading from flash may be much faster than writing, so
 			// we might speed things up by skipping empty blocks, or skipping the write if the data is the same.
 			// Notes: A block is declared empty when all bits are either 0 (zeros) or 1 (flash block erased).
-			// Also, a back-off strategy is used to limit reading.
-			if (throttle_fast_zeroing) {
-				throttle_fast_zeroing--;
-			} else if (fast_zeroing) {
+			// Also, an adaptive back-off strategy, based on the measured throughput, is used to limit reading.
+			if (fast_zeroing && FzShouldProbe(&throttle)) {
 				CHECK_FOR_USER_CANCEL;
 
 				// Read block and compare against the block that needs to be written
-				s = ReadFile(hPhysicalDrive, cmp_buffer, read_size[0], &comp_size, NULL);
-				if ((!s) || (comp_size != read_size[0])) {
+				start_time = GetTickCount64();
+				s = ReadFile(hPhysicalDrive, cmp_buffer, read_size, &comp_size, NULL);
+				if ((!s) || (comp_size != read_size)) {
 					uprintf("\r\nRead error: Could not read data for fast zeroing comparison - %s", WindowsErrorString());
 					goto out;
 				}
+				FzAddSample(&throttle.read_time, GetTickCount64() - start_time);
 
-				// Check for an empty block by comparing with the first element
-				zero_data = cmp_buffer[0];
-				// Check all bits are the same
-				if ((zero_data == 0) || (zero_data == 0xffffffff)) {
-					// Compare the rest of the block against the first element
-					for (i = 1; (i < read_size[0] / sizeof(uint32_t)) && (cmp_buffer[i] == zero_data); i++);
-					if (i >= read_size[0] / sizeof(uint32_t)) {
-						// Block is empty, skip write
-						write_size = read_size[0];
-						continue;
-					}
+				// Check for an empty block
+				if (IsUniformBlock((uint8_t*)cmp_buffer, read_size, NULL)) {
+					// Block is empty, skip write
+					FzProbeResult(&throttle, TRUE);
+					write_size = read_size;
+					continue;
 				}
 
 				// Move the file pointer position back for writing
@@ -1259,35 +1837,14 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 					uprintf("\r\nError: Could not reset position - %s", WindowsErrorString());
 					goto out;
 				}
-				// Throttle read operations
-				throttle_fast_zeroing = 15;
+				FzProbeResult(&throttle, FALSE);
 			}
 
-			for (i = 1; i <= WRITE_RETRIES; i++) {
-				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, buffer, read_size[0], &write_size, NULL);
-				if ((s) && (write_size == read_size[0]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[0]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
-						goto out;
-					}
-				} else {
-					ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
-					goto out;
-				}
-				Sleep(200);
-			}
-			if (i > WRITE_RETRIES)
+			start_time = GetTickCount64();
+			if (!WriteBlockWithRetry(hPhysicalDrive, buffer, read_size, wb))
 				goto out;
+			FzAddSample(&throttle.write_time, GetTickCount64() - start_time);
+			write_size = read_size;
 		}
 		uprintfs("\r\n");
 	} else if (img_report.compression_type != BLED_COMPRESSION_NONE && img_report.compression_type < BLED_COMPRESSION_MAX) {
@@ -1299,28 +1856,44 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
 			goto out;
 		}
-		sec_buf = (uint8_t*)_mm_malloc(SelectedDrive.SectorSize, SelectedDrive.SectorSize);
-		if (sec_buf == NULL) {
+		if (sparse_enabled) {
+			// Used to write runs of zeroes that are too small to be worth zeroing on the target
+			sparse_buf = (uint8_t*)_mm_malloc(SPARSE_CHUNK_SIZE, SelectedDrive.SectorSize);
+			if (sparse_buf == NULL) {
+				ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+				uprintf("Could not allocate disk write buffer");
+				goto out;
+			}
+			memset(sparse_buf, 0, SPARSE_CHUNK_SIZE);
+		}
+		// Have the decompressor hand its output to a separate writer thread, so
+		// that decompression doesn't have to wait for the drive and vice versa
+		// VTSI images are written by bled, at the location of each of their segments
+		is_vtsi = (img_report.compression_type == BLED_COMPRESSION_VTSI);
+		bled = bled_ctx_create(256 * KB, uprintf, NULL, is_vtsi ? NULL : sector_write, update_progress, NULL, &ErrorStatus);
+		if ((bled == NULL) || (!is_vtsi && bled_ctx_set_async_output(bled, DD_PIPELINE_BUFFERS, DD_BUFFER_SIZE,
+			SelectedDrive.SectorSize) != 0)) {
+			bled_ctx_destroy(bled);
 			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
 			uprintf("Could not allocate disk write buffer");
 			goto out;
 		}
-		if_not_assert((uintptr_t)sec_buf% SelectedDrive.SectorSize == 0)
-			goto out;
-		sec_buf_pos = 0;
-		bled_init(256 * KB, uprintf, NULL, sector_write, update_progress, NULL, &ErrorStatus);
-		bled_ret = bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, img_report.compression_type);
-		bled_exit();
+		// With sparse writes, we also zero the gaps between VTSI segments, instead of leaving them as is
+		if (is_vtsi && sparse_enabled)
+			bled_ctx_set_discard(bled, sector_discard);
+		bled_ret = bled_ctx_uncompress_with_handles(bled, hSourceImage, hPhysicalDrive, img_report.compression_type);
+		bled_ctx_destroy(bled);
 		uprintfs("\r\n");
-		if ((bled_ret >= 0) && (sec_buf_pos != 0)) {
-			// A disk image that doesn't end up on disk boundary should be a rare
-			// enough case, so we dont bother checking the write operation and
-			// just issue a notice about it in the log.
-			uprintf("Notice: Compressed image data didn't end on block boundary.");
-			// Gonna assert that WriteFile() and _write() share the same file offset
-			WriteFile(hPhysicalDrive, sec_buf, SelectedDrive.SectorSize, &write_size, NULL);
+		// Commit any trailing run of zeroes
+		if ((bled_ret >= 0) && !sparse_flush(hPhysicalDrive)) {
+			uprintf("Could not write compressed image: %s", WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+			goto out;
 		}
-		safe_mm_free(sec_buf);
+		// A disk image that doesn't end up on disk boundary should be a rare
+		// enough case, so we just issue a notice about it in the log.
+		if ((bled_ret > 0) && (bled_ret % SelectedDrive.SectorSize != 0))
+			uprintf("Notice: Compressed image data didn't end on block boundary.");
 		if ((bled_ret < 0) && (SCODE_CODE(ErrorStatus) != ERROR_CANCELLED)) {
 			// Unfortunately, different compression backends return different negative error codes
 			uprintf("Could not write compressed image: %lld", bled_ret);
@@ -1347,100 +1920,357 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			goto out;
 		}
 
-		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-		buffer = (uint8_t*)_mm_malloc(buf_size * NUM_BUFFERS, SelectedDrive.SectorSize);
-		if (buffer == NULL) {
-			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
-			uprintf("Could not allocate disk write buffer");
+		if (!DdPipelineInit(&pipeline, hSourceImage, target_size, (sparse_enabled || write_hash != NULL) ? DdWriteTransform : NULL, NULL))
 			goto out;
-		}
-		if_not_assert((uintptr_t)buffer% SelectedDrive.SectorSize == 0)
-			goto out;
-
-		// Start the initial read
-		ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size));
 
-		read_size[proc_bufnum] = 1;	// To avoid early loop exit
-		for (wb = 0; read_size[proc_bufnum] != 0; wb += read_size[proc_bufnum]) {
+		// The reader (and transform) stages run in their own threads, so all we
+		// have to do here is write the blocks we get, in order, as they come.
+		wb = 0;
+		while (1) {
 			// 0. Update the progress
 			UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, target_size);
 			cur_value = (wb * 80) / target_size;
 			for ( ; cur_value > last_value && last_value < 80; last_value++)
 				uprintfs("+");
 
-			if (wb >= target_size)
+			// 1. Wait for the next block
+			blk = spsc_pop_wait(&pipeline.write_q, DD_PIPELINE_WAIT);
+			if (blk == NULL) {
+				CHECK_FOR_USER_CANCEL;
+				if (pipeline.abort)
+					goto out;
+				continue;
+			}
+			if (blk == &pipeline.eos)
 				break;
 
-			// 1. Wait for the current read operation to complete (and update the read size)
-			if ((!WaitFileAsync(hSourceImage, DRIVE_ACCESS_TIMEOUT)) ||
-				(!GetSizeAsync(hSourceImage, &read_size[read_bufnum]))) {
-				uprintf("\r\nRead error: %s", WindowsErrorString());
-				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			// 2. Synchronously write the current data buffer
+			s = sparse_enabled ? WriteSparseBlock(hPhysicalDrive, blk) :
+				WriteBlockWithRetry(hPhysicalDrive, blk->buf, blk->size, wb);
+			if (!s)
 				goto out;
-			}
+			wb += blk->size;
 
+			// 3. Give the buffer back to the reader
+			spsc_push(&pipeline.free_q, blk);
+		}
+		uprintfs("\r\n");
+	}
+	if (sparse_bytes != 0)
+		uprintf("Sparse write: %s of zeroed data skipped", SizeToHumanReadable(sparse_bytes, FALSE, FALSE));
+	if ((write_hash != NULL) && !CheckWriteHash(hPhysicalDrive, hash_mask))
+		goto out;
+	RefreshDriveLayout(hPhysicalDrive);
+	ret = TRUE;
+out:
+	// Must be done before we close the source, as we may have reads in flight
+	DdPipelineExit(&pipeline);
+	MultiHashDestroy(write_hash);
+	write_hash = NULL;
+	if (img_report.compression_type != BLED_COMPRESSION_NONE && img_report.compression_type < BLED_COMPRESSION_MAX)
+		safe_closehandle(hSourceImage);
+	else
+		CloseFileAsync(hSourceImage);
+	if (vhd_path != NULL)
+		VhdUnmountImage();
+	safe_mm_free(buffer);
+	safe_mm_free(cmp_buffer);
+	safe_mm_free(sparse_buf);
+	return ret;
+}
 
-			// 2. WriteFile fails unless the size is a multiple of sector size
-			if (read_size[read_bufnum] % SelectedDrive.SectorSize != 0) {
-				if_not_assert(HI_ALIGN_X_TO_Y(read_size[read_bufnum], SelectedDrive.SectorSize) <= buf_size)
-					goto out;
-				read_size[read_bufnum] = HI_ALIGN_X_TO_Y(read_size[read_bufnum], SelectedDrive.SectorSize);
+/* Record a differing sector, merging it with the previous range if contiguous */
+static void VerifyAddMismatch(uint64_t lba)
+{
+	// A sector may be split between two comparisons
+	if (lba == verify.last_bad)
+		return;
+	verify.last_bad = lba;
+	verify.bad_sectors++;
+	if ((verify.nb_ranges != 0) && (verify.range[verify.nb_ranges - 1].end + 1 == lba)) {
+		verify.range[verify.nb_ranges - 1].end = lba;
+	} else if (verify.nb_ranges < VERIFY_MAX_RANGES) {
+		verify.range[verify.nb_ranges].start = lba;
+		verify.range[verify.nb_ranges].end = lba;
+		verify.nb_ranges++;
+	} else {
+		verify.truncated = TRUE;
+	}
+}
+
+/* Compare the next size bytes of the source against the data read back from the target */
+static void VerifyCompare(const uint8_t* src, const uint8_t* dst, size_t size)
+{
+	size_t pos = 0;
+	uint64_t lba;
+
+	while (pos < size) {
+		pos += CompareBlocks(&src[pos], &dst[pos], size - pos);
+		if (pos >= size)
+			break;
+		lba = (verify.offset + pos) / SelectedDrive.SectorSize;
+		VerifyAddMismatch(lba);
+		// No need to look at the rest of this sector
+		pos = (size_t)((lba + 1) * SelectedDrive.SectorSize - verify.offset);
+	}
+	verify.offset += size;
+	verify.size += size;
+}
+
+/* Wait for the next block read back from the target. Returns NULL on error or at the end of the target. */
+static dd_block_t* VerifyGetTargetBlock(void)
+{
+	dd_block_t* blk;
+
+	while (1) {
+		blk = spsc_pop_wait(&verify.target->write_q, DD_PIPELINE_WAIT);
+		if (blk != NULL)
+			return (blk == &verify.target->eos) ? NULL : blk;
+		if (verify.target->abort || IS_ERROR(ErrorStatus))
+			return NULL;
+	}
+}
+
+/* Make sure that verify.blk points to target data, or report an error */
+static BOOL VerifyFillTargetBlock(void)
+{
+	if (verify.blk != NULL)
+		return TRUE;
+	verify.blk = VerifyGetTargetBlock();
+	if (verify.blk == NULL) {
+		if (!IS_ERROR(ErrorStatus)) {
+			uprintf("Could not read back data past %s", SizeToHumanReadable(verify.offset, FALSE, FALSE));
+			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+		}
+		return FALSE;
+	}
+	verify.pos = 0;
+	return TRUE;
+}
+
+/* Consume len bytes of the current target block, and give it back to the reader once done */
+static void VerifyAdvanceTargetBlock(DWORD len)
+{
+	verify.pos += len;
+	if (verify.pos >= verify.blk->data_size) {
+		spsc_push(&verify.target->free_q, verify.blk);
+		verify.blk = NULL;
+	}
+}
+
+/*
+ * Skip the target data up to offset. This is used for the gaps between VTSI segments,
+ * which are in disk order, so that bled never asks us to go back.
+ */
+static BOOL VerifySeekTarget(uint64_t offset)
+{
+	DWORD len;
+
+	if (offset < verify.offset) {
+		uprintf("Could not verify image segment at %s: Segments are out of order",
+			SizeToHumanReadable(offset, FALSE, FALSE));
+		ErrorStatus = RUFUS_ERROR(ERROR_SEEK);
+		return FALSE;
+	}
+	while (verify.offset < offset) {
+		if (!VerifyFillTargetBlock())
+			return FALSE;
+		len = (DWORD)MIN(offset - verify.offset, verify.blk->data_size - verify.pos);
+		verify.offset += len;
+		VerifyAdvanceTargetBlock(len);
+	}
+	return TRUE;
+}
+
+/* bled write override, that compares the uncompressed data instead of writing it */
+static int verify_write(int fd, const void* _buf, unsigned int count)
+{
+	const uint8_t* buf = (const uint8_t*)_buf;
+	unsigned int pos = 0;
+	int64_t offset;
+	DWORD len;
+
+	// VTSI images seek the target to the location of each segment, and since we don't
+	// write anything, these seeks are the only thing that moves the target position.
+	if (verify.is_vtsi) {
+		offset = _lseeki64(fd, 0, SEEK_CUR);
+		if ((offset >= 0) && ((uint64_t)offset != verify.seek)) {
+			verify.seek = (uint64_t)offset;
+			if (!VerifySeekTarget(verify.seek))
+				return -1;
+		}
+	}
+
+	while (pos < count) {
+		if (!VerifyFillTargetBlock())
+			return -1;
+		len = MIN(count - pos, verify.blk->data_size - verify.pos);
+		VerifyCompare(&buf[pos], &verify.blk->buf[verify.pos], len);
+		pos += len;
+		VerifyAdvanceTargetBlock(len);
+	}
+	return (int)count;
+}
+
+static void verify_progress(const uint64_t processed_bytes)
+{
+	UpdateProgressWithInfo(OP_FORMAT, MSG_271, processed_bytes, img_report.image_size);
+}
+
+/*
+ * Read the data we wrote back from the target, with as many reads in flight as
+ * the DD pipeline allows, and compare it against the source image, which gets
+ * uncompressed again if needed. Differences are reported as ranges of LBAs.
+ */
+static BOOL VerifyDrive(HANDLE hPhysicalDrive)
+{
+	BOOL ret = FALSE, compressed = (img_report.compression_type != BLED_COMPRESSION_NONE &&
+		img_report.compression_type < BLED_COMPRESSION_MAX);
+	HANDLE hSourceImage = INVALID_HANDLE_VALUE, hTarget = NULL;
+	char *physical_path = NULL, *vhd_path = NULL;
+	uint64_t target_size = MIN((uint64_t)SelectedDrive.DiskSize, img_report.image_size);
+	int64_t bled_ret;
+	uint32_t i;
+	bled_ctx_t* bled = NULL;
+	dd_pipeline_t source = { 0 }, target = { 0 };
+	dd_block_t *src_blk = NULL, *dst_blk;
+
+	memset(&verify, 0, sizeof(verify));
+	verify.last_bad = UINT64_MAX;
+	verify.seek = UINT64_MAX;
+	verify.is_vtsi = (img_report.compression_type == BLED_COMPRESSION_VTSI);
+	verify.target = &target;
+
+	uprintf("Verifying written data:");
+	UpdateProgressWithInfoInit(NULL, FALSE);
+	// Make sure that what we read back comes from the media
+	if (!FlushFileBuffers(hPhysicalDrive))
+		uprintf("Warning: Could not flush device: %s", WindowsErrorString());
+
+	if (img_report.compression_type == IMG_COMPRESSION_VHD ||
+		img_report.compression_type == IMG_COMPRESSION_VHDX) {
+		vhd_path = VhdMountImageAndGetSize(image_path, &target_size);
+		if (vhd_path == NULL || target_size == 0)
+			goto out;
+	}
+
+	// The write handle is still open, so we must share both read and write access
+	physical_path = GetPhysicalName(SelectedDrive.DeviceNumber);
+	if (physical_path != NULL)
+		hTarget = CreateFileAsync(physical_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_NO_BUFFERING);
+	if (hTarget == NULL) {
+		uprintf("Could not open target for verification: %s", WindowsErrorString());
+		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+		goto out;
+	}
+	// We don't know the uncompressed size beforehand, so just read as much as bled asks for.
+	// Only a few blocks are ever read ahead, and they get drained when we stop the reader.
+	// Otherwise, since the target is unbuffered, the last read must be rounded up to the sector
+	// size, and only the part of the final block that the source provides is compared.
+	if (!DdPipelineInit(&target, hTarget, compressed ? (uint64_t)SelectedDrive.DiskSize :
+		MIN(HI_ALIGN_X_TO_Y(target_size, SelectedDrive.SectorSize), (uint64_t)SelectedDrive.DiskSize), NULL, NULL))
+		goto out;
+
+	if (compressed) {
+		hSourceImage = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hSourceImage == INVALID_HANDLE_VALUE) {
+			uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+			goto out;
+		}
+		// Nothing gets written to the target, as the write override does the comparison
+		bled = bled_ctx_create(256 * KB, uprintf, NULL, verify_write, verify_progress, NULL, &ErrorStatus);
+		if (bled == NULL) {
+			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+			goto out;
+		}
+		bled_ret = bled_ctx_uncompress_with_handles(bled, hSourceImage, hPhysicalDrive, img_report.compression_type);
+		bled_ctx_destroy(bled);
+		if (bled_ret < 0) {
+			if (!IS_ERROR(ErrorStatus)) {
+				uprintf("Could not uncompress image: %lld", bled_ret);
+				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
 			}
+			goto out;
+		}
+	} else {
+		hSourceImage = CreateFileAsync(vhd_path != NULL ? vhd_path : image_path, GENERIC_READ,
+			FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+		if (hSourceImage == NULL) {
+			uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+			goto out;
+		}
+		if (!DdPipelineInit(&source, hSourceImage, target_size, NULL, NULL))
+			goto out;
 
-			// 3. Switch to the next reading buffer
-			proc_bufnum = read_bufnum;
-			read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
-
-			// 3. Launch the next asynchronous read operation
-			// It is VERY IMPORTANT here that we don't attempt to read past the source
-			// or target sizes, as mounted VHDs will SCREW YOU if you attempt to do so
-			// and will even start returning ERRONEOUS DATA for sectors before the end
-			// of the disk... So we make sure to adjust the size not to ever overflow.
-			// Also we need to make sure we add read_size[proc_bufnum] to wb since we
-			// have already read the data and are about to write it.
-			ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size - (wb + read_size[proc_bufnum])));
-
-			// 4. Synchronously write the current data buffer
-			for (i = 1; i <= WRITE_RETRIES; i++) {
-				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, &buffer[proc_bufnum * buf_size], read_size[proc_bufnum], &write_size, NULL);
-				if ((s) && (write_size == read_size[proc_bufnum]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[proc_bufnum]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
+		// Both pipelines use the same block size, so their blocks line up
+		while (1) {
+			UpdateProgressWithInfo(OP_FORMAT, MSG_271, verify.size, target_size);
+			if (src_blk == NULL) {
+				src_blk = spsc_pop_wait(&source.write_q, DD_PIPELINE_WAIT);
+				if (src_blk == NULL) {
+					CHECK_FOR_USER_CANCEL;
+					if (source.abort)
 						goto out;
-					}
-				} else {
-					ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
-					goto out;
+					continue;
 				}
-				Sleep(200);
+				if (src_blk == &source.eos)
+					break;
+			}
+			dst_blk = spsc_pop_wait(&target.write_q, DD_PIPELINE_WAIT);
+			if (dst_blk == NULL) {
+				CHECK_FOR_USER_CANCEL;
+				if (target.abort)
+					goto out;
+				continue;
 			}
-			if (i > WRITE_RETRIES)
+			if ((dst_blk == &target.eos) || (dst_blk->data_size < src_blk->data_size)) {
+				uprintf("Could not read back data past %s", SizeToHumanReadable(verify.size, FALSE, FALSE));
+				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
 				goto out;
+			}
+			VerifyCompare(src_blk->buf, dst_blk->buf, src_blk->data_size);
+			spsc_push(&source.free_q, src_blk);
+			spsc_push(&target.free_q, dst_blk);
+			src_blk = NULL;
 		}
-		uprintfs("\r\n");
 	}
-	RefreshDriveLayout(hPhysicalDrive);
-	ret = TRUE;
+
+	if (verify.bad_sectors == 0) {
+		uprintf("  %s verified: The data read back matches the image", SizeToHumanReadable(verify.size, FALSE, FALSE));
+		ret = TRUE;
+		goto out;
+	}
+	uprintf("  %lld sector(s) differ from the image, at LBA:", verify.bad_sectors);
+	for (i = 0; i < verify.nb_ranges; i++) {
+		if (verify.range[i].start == verify.range[i].end)
+			uprintf("    %lld", verify.range[i].start);
+		else
+			uprintf("    %lld-%lld", verify.range[i].start, verify.range[i].end);
+	}
+	if (verify.truncated)
+		uprintf("    (more ranges omitted)");
+	ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+
 out:
-	if (img_report.compression_type != BLED_COMPRESSION_NONE && img_report.compression_type < BLED_COMPRESSION_MAX)
+	// Must be done before we close the handles, as we may have reads in flight
+	DdPipelineExit(&source);
+	DdPipelineExit(&target);
+	verify.target = NULL;
+	verify.blk = NULL;
+	CloseFileAsync(hTarget);
+	if (compressed)
 		safe_closehandle(hSourceImage);
 	else
 		CloseFileAsync(hSourceImage);
 	if (vhd_path != NULL)
 		VhdUnmountImage();
-	safe_mm_free(buffer);
-	safe_mm_free(cmp_buffer);
+	safe_free(physical_path);
+	if (!ret && !IS_ERROR(ErrorStatus))
+		ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
 	return ret;
 }
 
@@ -1694,6 +2524,8 @@ DWORD WINAPI FormatThread(void* param)
 			}
 		} else {
 			WriteDrive(hPhysicalDrive, FALSE);
+			if (verify_after_write && !IS_ERROR(ErrorStatus))
+				VerifyDrive(hPhysicalDrive);
 		}
 		goto out;
 	}
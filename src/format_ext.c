@@ -45,6 +45,9 @@ extern io_manager nt_io_manager;
 #else
 extern io_manager unix_io_manager;
 #define IO_MANAGER unix_io_manager
+// Have the write-back cache of the Unix I/O manager hold enough blocks for the
+// bitmaps, group descriptors and directories we create, so that they are merged
+#define IO_MANAGER_OPTIONS "cache_blocks=8192"
 #endif
 
 
@@ -358,6 +361,11 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		uprintf("Could not initialize %s features: %s", FSName, error_message(r));
 		goto out;
 	}
+#if defined(IO_MANAGER_OPTIONS)
+	r = io_channel_set_options(ext2fs->io, IO_MANAGER_OPTIONS);
+	if (r != 0)
+		uprintf("Could not set %s I/O options: %s", FSName, error_message(r));
+#endif
 
 	// Zero 16 blocks of data from the start of our volume
 	buf = calloc(16, ext2fs->io->block_size);
@@ -498,6 +506,17 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		ext2fs_file_close(ext2fd);
 	}
 
+	// Report the I/O statistics, if the manager keeps them, after having written all
+	// the metadata, so that ext2fs_close() has nothing left to write
+	if (ext2fs->io->manager->get_stats != NULL) {
+		io_stats stats = NULL;
+		if ((ext2fs_flush(ext2fs) == 0) && (ext2fs->io->manager->get_stats(ext2fs->io, &stats) == 0) &&
+			(stats != NULL) && (stats->num_fields >= 5))
+			uprintf("I/O: %s written in %llu requests, %llu cache hits, %llu cache misses",
+				SizeToHumanReadable(stats->bytes_written, FALSE, FALSE), stats->write_requests,
+				stats->cache_hits, stats->cache_misses);
+	}
+
 	// Finally we can call close() to get the file system gets created
 	r = ext2fs_close(ext2fs);
 	if (r == 0) {
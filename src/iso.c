@@ -45,6 +45,7 @@
 #include "rufus.h"
 #include "ui.h"
 #include "drive.h"
+#include "thread.h"
 #include "libfat.h"
 #include "missing.h"
 #include "resource.h"
@@ -57,6 +58,21 @@
 _Static_assert(256 * KB >= ISO_BLOCKSIZE, "Can't set PROGRESS_THRESHOLD");
 #define PROGRESS_THRESHOLD        ((256 * KB) / ISO_BLOCKSIZE)
 
+// Maximum size of the reads we issue when copying the scheduled files, and maximum
+// gap between two extents, below which we read the gap rather than seek over it
+#define SCHEDULE_READ_SIZE        (4 * MB)
+#define SCHEDULE_MAX_GAP          ((64 * KB) / ISO_BLOCKSIZE)
+
+// Scan results cache. The key is derived from the image size and modification time
+// along with the ISO9660 volume descriptors (LSN 16-31) and the UDF anchor (LSN 256)
+#define SCAN_CACHE_DIR            "iso_cache"
+#define SCAN_CACHE_MAGIC          "RUFUSISC"
+#define SCAN_CACHE_VERSION        2
+#define SCAN_CACHE_VD_LSN         16
+#define SCAN_CACHE_VD_BLOCKS      16
+#define SCAN_CACHE_ANCHOR_LSN     256
+#define SCAN_CACHE_MAX_ENTRIES    64
+
 // Needed for UDF symbolic link testing
 #define S_IFLNK                   0xA000
 #define S_ISLNK(m)                (((m) & S_IFMT) == S_IFLNK)
@@ -80,14 +96,50 @@ typedef struct {
 	BOOLEAN is_old_c32[NB_OLD_C32];
 } EXTRACT_PROPS;
 
+// A file payload, that the copy pool writes to its destination
+typedef struct iso_copy_job {
+	struct iso_copy_job* next;
+	uint8_t* buf;
+	DWORD size;
+	uint64_t nb_blocks;
+	FILETIME ft[3];
+	char path[MAX_PATH];		// Sanitized destination
+	char md5_path[MAX_PATH];	// Path used in md5sum.txt
+} ISO_COPY_JOB;
+
+// A file which payload is read once the whole tree has been walked, in LSN order
+typedef struct {
+	lsn_t lsn;
+	DWORD size;
+	FILETIME ft[3];
+	char* sanpath;
+	char* fullpath;
+} ISO_SCHEDULE_ENTRY;
+
+// Header of the files we use to cache the scan results, which is followed by img_report
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t report_size;
+	uint8_t key[SHA1_HASHSIZE];
+	uint8_t report_hash[SHA1_HASHSIZE];
+	uint64_t total_blocks;
+	uint64_t extra_blocks;
+	uint8_t has_ldlinux_c32;
+	uint8_t reserved[7];
+} ISO_SCAN_CACHE_HEADER;
+
 RUFUS_IMG_REPORT img_report;
 int64_t iso_blocking_status = -1;
 extern uint64_t md5sum_totalbytes;
 extern BOOL preserve_timestamps, enable_ntfs_compression, validate_md5sum;
 extern HANDLE format_thread;
 extern StrArray modified_files;
-BOOL enable_iso = TRUE, enable_joliet = TRUE, enable_rockridge = TRUE, has_ldlinux_c32;
-#define ISO_BLOCKING(x) do {x; iso_blocking_status++; } while(0)
+BOOL enable_iso = TRUE, enable_joliet = TRUE, enable_rockridge = TRUE, enable_iso_scan_cache = TRUE, has_ldlinux_c32;
+BOOL enable_iso_mmap = FALSE;
+uint32_t iso_copy_threads = 0, iso_copy_buffer_size = ISO_COPY_BUFFER_SIZE;
+// The copy pool workers also go through this, so the counter must be updated atomically
+#define ISO_BLOCKING(x) do {x; atomic_fetch_add64(&iso_blocking_status, 1); } while(0)
 static const char* psz_extract_dir;
 static const char* bootmgr_name = "bootmgr";
 const char* bootmgr_efi_name = "bootmgr.efi";
@@ -127,6 +179,18 @@ static uint32_t md5sum_size = 0;
 static uint64_t total_blocks, extra_blocks, nb_blocks, last_nb_blocks;
 static BOOL scan_only = FALSE;
 static FILE* fd_md5sum = NULL;
+static struct {
+	BOOL active;
+	pool_t pool;
+	ISO_COPY_JOB* job;
+	ISO_COPY_JOB* free_job;
+	uint8_t* buffer;
+	DWORD buf_size;
+	mutex_t lock;				// Protects the free jobs and fd_md5sum
+	cond_t free_cond;
+	ISO_SCHEDULE_ENTRY* schedule;
+	size_t nb_scheduled, max_scheduled;
+} iso_copy = { 0 };
 static StrArray config_path, isolinux_path;
 static char symlinked_syslinux[MAX_PATH], *md5sum_data = NULL, *md5sum_pos = NULL;
 
@@ -598,6 +662,339 @@ static void __inline set_directory_timestamp(char* path, LPFILETIME creation, LP
 	safe_closehandle(dir_handle);
 }
 
+// Update the progress bar, if we copied enough blocks since the last update
+static void update_copy_progress(void)
+{
+	uint64_t cur_blocks = nb_blocks;
+
+	if (cur_blocks - last_nb_blocks >= PROGRESS_THRESHOLD) {
+		UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, cur_blocks, total_blocks +
+			((fs_type != FS_NTFS) ? extra_blocks : 0));
+		last_nb_blocks = cur_blocks;
+	}
+}
+
+// Add an entry to the md5sum.txt we are creating. Since the copy threads
+// also add entries, each of them must be written as a whole.
+static void add_md5sum_entry(HASH_CONTEXT* ctx, const char* path)
+{
+	size_t j;
+
+	if (iso_copy.active)
+		mutex_lock(&iso_copy.lock);
+	for (j = 0; j < MD5_HASHSIZE; j++)
+		fprintf(fd_md5sum, "%02x", ctx->buf[j]);
+	fprintf(fd_md5sum, "  ./%s\n", path);
+	if (iso_copy.active)
+		mutex_unlock(&iso_copy.lock);
+}
+
+static void release_copy_job(ISO_COPY_JOB* job)
+{
+	mutex_lock(&iso_copy.lock);
+	job->next = iso_copy.free_job;
+	iso_copy.free_job = job;
+	cond_signal(&iso_copy.free_cond);
+	mutex_unlock(&iso_copy.lock);
+}
+
+// Copy pool worker: create the destination file and write the payload we read for it.
+// The ISO is only ever read from the thread that walks the directories, since libcdio
+// keeps the read position in the iso9660_t/udf_t and these can't be shared.
+static BOOL iso_copy_worker(void* context, uint32_t worker, void* _job)
+{
+	ISO_COPY_JOB* job = (ISO_COPY_JOB*)_job;
+	HANDLE file_handle = NULL;
+	HASH_CONTEXT ctx;
+	DWORD wr_size, err;
+	BOOL r = TRUE;
+
+	// No need to copy anything if the user cancelled or another job failed
+	if (ErrorStatus || iso_copy.pool.failed)
+		goto out;
+	file_handle = CreatePreallocatedFile(job->path, GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, job->size);
+	if (file_handle == INVALID_HANDLE_VALUE) {
+		err = GetLastError();
+		uprintf("  Unable to create file '%s': %s", job->path, WindowsErrorString());
+		if (((err == ERROR_ACCESS_DENIED) || (err == ERROR_INVALID_HANDLE)) &&
+			(safe_strcmp(&job->path[3], autorun_name) == 0))
+			uprintf(stupid_antivirus);
+		else
+			r = FALSE;
+		goto out;
+	}
+	if (job->size != 0) {
+		ISO_BLOCKING(r = WriteFileWithRetry(file_handle, job->buf, job->size, &wr_size, WRITE_RETRIES));
+		if (!r || (wr_size != job->size)) {
+			uprintf("  Error writing file '%s': %s", job->path, r ? "Short write detected" : WindowsErrorString());
+			r = FALSE;
+			goto out;
+		}
+	}
+	if (fd_md5sum != NULL) {
+		hash_init[HASH_MD5](&ctx);
+		hash_write[HASH_MD5](&ctx, job->buf, job->size);
+		hash_final[HASH_MD5](&ctx);
+		add_md5sum_entry(&ctx, job->md5_path);
+	}
+	if ((preserve_timestamps) && (!SetFileTime(file_handle, &job->ft[0], &job->ft[1], &job->ft[2])))
+		uprintf("  Could not set timestamp for '%s': %s", job->path, WindowsErrorString());
+	atomic_fetch_add64(&nb_blocks, job->nb_blocks);
+
+out:
+	ISO_BLOCKING(safe_closehandle(file_handle));
+	release_copy_job(job);
+	return r;
+}
+
+// Wait for all the files to be copied and release the copy pool
+static BOOL iso_copy_exit(void)
+{
+	BOOL r;
+	size_t i;
+
+	if (!iso_copy.active)
+		return TRUE;
+	while (!pool_wait(&iso_copy.pool, 100))
+		update_copy_progress();
+	r = !iso_copy.pool.failed;
+	for (i = 0; i < iso_copy.nb_scheduled; i++) {
+		free(iso_copy.schedule[i].sanpath);
+		free(iso_copy.schedule[i].fullpath);
+	}
+	safe_free(iso_copy.schedule);
+	iso_copy.nb_scheduled = 0;
+	iso_copy.max_scheduled = 0;
+	pool_destroy(&iso_copy.pool);
+	cond_destroy(&iso_copy.free_cond);
+	mutex_destroy(&iso_copy.lock);
+	safe_free(iso_copy.job);
+	safe_free(iso_copy.buffer);
+	iso_copy.free_job = NULL;
+	iso_copy.active = FALSE;
+	return r;
+}
+
+// Set up a pool of threads, that copies file payloads in parallel with the extraction.
+// This is especially useful for small files, as creating and closing files on the
+// target (especially for FAT32) takes much longer than reading them from the ISO.
+static BOOL iso_copy_init(void)
+{
+	uint32_t i, nb_workers, nb_jobs;
+
+	nb_workers = (iso_copy_threads != 0) ? iso_copy_threads : MIN(get_cpu_count(), ISO_COPY_MAX_THREADS);
+	nb_workers = MIN(nb_workers, 64);
+	// Keep enough jobs in flight for the walker to read the next file while the workers write
+	nb_jobs = 2 * nb_workers;
+	iso_copy.buf_size = (DWORD)HI_ALIGN_X_TO_Y(MAX(iso_copy_buffer_size, ISO_BUFFER_SIZE), ISO_BLOCKSIZE);
+	iso_copy.job = calloc(nb_jobs, sizeof(ISO_COPY_JOB));
+	iso_copy.buffer = malloc((size_t)nb_jobs * iso_copy.buf_size);
+	if ((iso_copy.job == NULL) || (iso_copy.buffer == NULL)) {
+		safe_free(iso_copy.job);
+		safe_free(iso_copy.buffer);
+		return FALSE;
+	}
+	iso_copy.free_job = NULL;
+	for (i = 0; i < nb_jobs; i++) {
+		iso_copy.job[i].buf = &iso_copy.buffer[(size_t)i * iso_copy.buf_size];
+		iso_copy.job[i].next = iso_copy.free_job;
+		iso_copy.free_job = &iso_copy.job[i];
+	}
+	mutex_init(&iso_copy.lock);
+	cond_init(&iso_copy.free_cond);
+	// Each queue can hold all the jobs, so that submitting never fails
+	if (!pool_create(&iso_copy.pool, nb_workers, nb_jobs, iso_copy_worker, NULL)) {
+		cond_destroy(&iso_copy.free_cond);
+		mutex_destroy(&iso_copy.lock);
+		safe_free(iso_copy.job);
+		safe_free(iso_copy.buffer);
+		return FALSE;
+	}
+	iso_copy.active = TRUE;
+	uprintf("Using %d threads with %s buffers to copy files", nb_workers,
+		SizeToHumanReadable(iso_copy.buf_size, FALSE, FALSE));
+	return TRUE;
+}
+
+// Get a free job, waiting for the copy pool to release one if needed.
+// Returns NULL if the user cancelled or if a copy failed.
+static ISO_COPY_JOB* get_copy_job(void)
+{
+	ISO_COPY_JOB* job = NULL;
+
+	while (1) {
+		if (ErrorStatus || iso_copy.pool.failed)
+			return NULL;
+		mutex_lock(&iso_copy.lock);
+		if (iso_copy.free_job == NULL)
+			cond_wait(&iso_copy.free_cond, &iso_copy.lock, 100);
+		job = iso_copy.free_job;
+		if (job != NULL)
+			iso_copy.free_job = job->next;
+		mutex_unlock(&iso_copy.lock);
+		if (job != NULL)
+			return job;
+		update_copy_progress();
+	}
+}
+
+// Hand a job, which payload has been read, over to the copy pool
+static BOOL submit_copy_job(ISO_COPY_JOB* job, const char* psz_sanpath, const char* psz_fullpath,
+	DWORD size, uint64_t nb, LPFILETIME creation, LPFILETIME last_access, LPFILETIME modify)
+{
+	job->size = size;
+	job->nb_blocks = nb;
+	job->ft[0] = *creation;
+	job->ft[1] = *last_access;
+	job->ft[2] = *modify;
+	static_strcpy(job->path, psz_sanpath);
+	static_strcpy(job->md5_path, &psz_fullpath[3]);
+	if (!pool_submit(&iso_copy.pool, job)) {
+		release_copy_job(job);
+		return FALSE;
+	}
+	update_copy_progress();
+	return TRUE;
+}
+
+// Add a file to the list of files which payload is copied once the tree has been walked
+static BOOL schedule_copy_job(lsn_t lsn, DWORD size, const char* psz_sanpath, const char* psz_fullpath,
+	LPFILETIME creation, LPFILETIME last_access, LPFILETIME modify)
+{
+	ISO_SCHEDULE_ENTRY* entry;
+	size_t max_scheduled;
+
+	if (iso_copy.nb_scheduled >= iso_copy.max_scheduled) {
+		max_scheduled = MAX(2 * iso_copy.max_scheduled, 256);
+		entry = realloc(iso_copy.schedule, max_scheduled * sizeof(ISO_SCHEDULE_ENTRY));
+		if (entry == NULL) {
+			uprintf("Could not allocate file schedule");
+			return FALSE;
+		}
+		iso_copy.schedule = entry;
+		iso_copy.max_scheduled = max_scheduled;
+	}
+	entry = &iso_copy.schedule[iso_copy.nb_scheduled];
+	entry->lsn = lsn;
+	entry->size = size;
+	entry->ft[0] = *creation;
+	entry->ft[1] = *last_access;
+	entry->ft[2] = *modify;
+	entry->sanpath = safe_strdup(psz_sanpath);
+	entry->fullpath = safe_strdup(psz_fullpath);
+	if ((entry->sanpath == NULL) || (entry->fullpath == NULL)) {
+		safe_free(entry->sanpath);
+		safe_free(entry->fullpath);
+		uprintf("Could not allocate file schedule");
+		return FALSE;
+	}
+	iso_copy.nb_scheduled++;
+	return TRUE;
+}
+
+static int schedule_cmp(const void* a, const void* b)
+{
+	lsn_t lsn_a = ((const ISO_SCHEDULE_ENTRY*)a)->lsn, lsn_b = ((const ISO_SCHEDULE_ENTRY*)b)->lsn;
+	return (lsn_a > lsn_b) - (lsn_a < lsn_b);
+}
+
+// Copy the payload of all the scheduled files. Reading the ISO in monotonic LSN order,
+// rather than in directory order, and coalescing adjacent extents into large reads,
+// avoids seeking back and forth on sources such as spinning disks or network shares.
+// Returns 0 on success, nonzero on error.
+static int copy_scheduled_files(iso9660_t* p_iso, udf_t* p_udf)
+{
+	ISO_SCHEDULE_ENTRY* entry = iso_copy.schedule;
+	ISO_COPY_JOB* job;
+	uint8_t* buf = NULL;
+	const uint8_t* data;
+	uint32_t nb, max_blocks;
+	lsn_t start, end;
+	size_t i, j, k, nb_reads = 0;
+	int r = 1;
+
+	if (iso_copy.nb_scheduled == 0)
+		return 0;
+	qsort(entry, iso_copy.nb_scheduled, sizeof(ISO_SCHEDULE_ENTRY), schedule_cmp);
+	max_blocks = (uint32_t)(MAX(SCHEDULE_READ_SIZE, iso_copy.buf_size) / ISO_BLOCKSIZE);
+	buf = malloc((size_t)max_blocks * ISO_BLOCKSIZE);
+	if (buf == NULL) {
+		uprintf("Could not allocate schedule buffer");
+		goto out;
+	}
+
+	for (i = 0; i < iso_copy.nb_scheduled; i = j) {
+		if (ErrorStatus)
+			goto out;
+		// Find how many of the following extents we can get with the same read
+		start = entry[i].lsn;
+		end = start + (lsn_t)((entry[i].size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+		for (j = i + 1; j < iso_copy.nb_scheduled; j++) {
+			nb = (uint32_t)((entry[j].size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+			if (nb == 0)
+				continue;
+			if ((entry[j].lsn > end + SCHEDULE_MAX_GAP) || (MAX(end, entry[j].lsn + (lsn_t)nb) - start > (lsn_t)max_blocks))
+				break;
+			end = MAX(end, entry[j].lsn + (lsn_t)nb);
+		}
+		nb = (uint32_t)(end - start);
+		// Memory mapped images can be copied from directly
+		data = (p_iso != NULL) ? iso9660_iso_map(p_iso, start, (long)nb) : NULL;
+		if ((nb != 0) && (data == NULL)) {
+			if ((p_iso != NULL) ? (iso9660_iso_seek_read(p_iso, buf, start, (long)nb) != (long)nb * ISO_BLOCKSIZE) :
+				(udf_read_sectors(p_udf, buf, start, nb) != DRIVER_OP_SUCCESS)) {
+				uprintf("  Error reading %lu blocks at LSN %lu", (long unsigned int)nb, (long unsigned int)start);
+				goto out;
+			}
+			nb_reads++;
+		}
+		if (data == NULL)
+			data = buf;
+		// Then scatter the data to the copy pool
+		for (k = i; k < j; k++) {
+			job = get_copy_job();
+			if (job == NULL)
+				goto out;
+			if (entry[k].size != 0)
+				memcpy(job->buf, &data[(size_t)(entry[k].lsn - start) * ISO_BLOCKSIZE], entry[k].size);
+			if (!submit_copy_job(job, entry[k].sanpath, entry[k].fullpath, entry[k].size,
+				(entry[k].size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE, &entry[k].ft[0], &entry[k].ft[1], &entry[k].ft[2]))
+				goto out;
+		}
+	}
+	uprintf("Copied %d files using %d reads", (int)iso_copy.nb_scheduled, (int)nb_reads);
+	r = 0;
+
+out:
+	free(buf);
+	return r;
+}
+
+// Whether a file can be copied by the copy pool. Config files must be written by the
+// time we call fix_config(), so they are always copied synchronously, along with files
+// that don't fit in the pool buffers.
+static __inline BOOL use_copy_pool(int64_t file_length, const char* psz_sanpath, const char* psz_fullpath, EXTRACT_PROPS* props)
+{
+	return iso_copy.active && !props->is_cfg && !props->is_conf && (file_length <= (int64_t)iso_copy.buf_size) &&
+		(safe_strlen(psz_sanpath) < MAX_PATH) && (safe_strlen(psz_fullpath) < MAX_PATH);
+}
+
+// Get the absolute LSN of a UDF file, if its data is recorded as a single extent
+static BOOL udf_get_file_lsn(udf_dirent_t* p_udf_dirent, int64_t file_length, lsn_t* lsn)
+{
+	uint32_t start, end;
+	uint16_t ad_type = p_udf_dirent->fe.icb_tag.flags & ICBTAG_FLAG_AD_MASK;
+
+	if ((uint16_from_le(p_udf_dirent->fe.icb_tag.strat_type) != ICBTAG_STRATEGY_TYPE_4) ||
+		((ad_type != ICBTAG_FLAG_AD_SHORT) && (ad_type != ICBTAG_FLAG_AD_LONG)) ||
+		!udf_get_lba(&p_udf_dirent->fe, &start, &end) || (end < start) ||
+		((int64_t)(end - start + 1) * UDF_BLOCKSIZE < file_length))
+		return FALSE;
+	*lsn = (lsn_t)(p_udf_dirent->i_part_start + start);
+	return TRUE;
+}
+
 // Returns 0 on success, nonzero on error
 static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const char *psz_path)
 {
@@ -607,14 +1004,17 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 	HASH_CONTEXT ctx;
 	BOOL r, is_identical;
 	int length;
-	size_t i, j, nb;
+	size_t i, nb;
 	char tmp[128], *psz_fullpath = NULL, *psz_sanpath = NULL;
 	const char* psz_basename;
 	udf_dirent_t *p_udf_dirent2;
+	ISO_COPY_JOB* job;
+	lsn_t lsn;
 	_Static_assert(ISO_BUFFER_SIZE % UDF_BLOCKSIZE == 0,
 		"ISO_BUFFER_SIZE is not a multiple of UDF_BLOCKSIZE");
 	uint8_t* buf = malloc(ISO_BUFFER_SIZE);
-	int64_t read, file_length;
+	int64_t read, file_length, pos;
+	uint64_t nb_read;
 
 	if ((p_udf_dirent == NULL) || (psz_path == NULL) || (buf == NULL)) {
 		safe_free(buf);
@@ -676,6 +1076,39 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
 			if (!is_identical)
 				uprintf("  File name sanitized to '%s'", psz_sanpath);
+			if (use_copy_pool(file_length, psz_sanpath, psz_fullpath, &props) &&
+				((file_length == 0) || udf_get_file_lsn(p_udf_dirent, file_length, &lsn))) {
+				if (!schedule_copy_job((file_length == 0) ? 0 : lsn, (DWORD)file_length, psz_sanpath, psz_fullpath,
+					to_filetime(udf_get_attribute_time(p_udf_dirent)), to_filetime(udf_get_access_time(p_udf_dirent)),
+					to_filetime(udf_get_modification_time(p_udf_dirent))))
+					goto out;
+				safe_free(psz_sanpath);
+				safe_free(psz_fullpath);
+				continue;
+			}
+			if (use_copy_pool(file_length, psz_sanpath, psz_fullpath, &props)) {
+				job = get_copy_job();
+				if (job == NULL)
+					goto out;
+				for (pos = 0, nb_read = 0; pos < file_length; pos += buf_size) {
+					nb = (size_t)((file_length - pos + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+					read = udf_read_block(p_udf_dirent, &job->buf[pos], nb);
+					if (read < 0) {
+						uprintf("  Error reading UDF file %s", &psz_fullpath[strlen(psz_extract_dir)]);
+						release_copy_job(job);
+						goto out;
+					}
+					buf_size = (DWORD)MIN(file_length - pos, read);
+					nb_read += nb;
+				}
+				if (!submit_copy_job(job, psz_sanpath, psz_fullpath, (DWORD)file_length, nb_read,
+					to_filetime(udf_get_attribute_time(p_udf_dirent)), to_filetime(udf_get_access_time(p_udf_dirent)),
+					to_filetime(udf_get_modification_time(p_udf_dirent))))
+					goto out;
+				safe_free(psz_sanpath);
+				safe_free(psz_fullpath);
+				continue;
+			}
 			file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
 				FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
 			if (file_handle == INVALID_HANDLE_VALUE) {
@@ -707,17 +1140,12 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 						goto out;
 					}
 					file_length -= wr_size;
-					nb_blocks += nb;
-					if (nb_blocks - last_nb_blocks >= PROGRESS_THRESHOLD) {
-						UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
-						last_nb_blocks = nb_blocks;
-					}
+					atomic_fetch_add64(&nb_blocks, nb);
+					update_copy_progress();
 				}
 				if (fd_md5sum != NULL) {
 					hash_final[HASH_MD5](&ctx);
-					for (j = 0; j < MD5_HASHSIZE; j++)
-						fprintf(fd_md5sum, "%02x", ctx.buf[j]);
-					fprintf(fd_md5sum, "  ./%s\n", &psz_fullpath[3]);
+					add_md5sum_entry(&ctx, &psz_fullpath[3]);
 				}
 			}
 			if ((preserve_timestamps) && (!SetFileTime(file_handle, to_filetime(udf_get_attribute_time(p_udf_dirent)),
@@ -763,10 +1191,11 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 	_Static_assert(ISO_BUFFER_SIZE % ISO_BLOCKSIZE == 0,
 		"ISO_BUFFER_SIZE is not a multiple of ISO_BLOCKSIZE");
 	uint8_t* buf = malloc(ISO_BUFFER_SIZE);
+	const uint8_t* data;
 	CdioListNode_t* p_entnode;
 	iso9660_stat_t *p_statbuf;
 	CdioISO9660FileList_t* p_entlist = NULL;
-	size_t i, j, nb;
+	size_t i, nb;
 	lsn_t lsn;
 	int64_t file_length;
 
@@ -793,23 +1222,12 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 		p_statbuf = (iso9660_stat_t*) _cdio_list_node_data(p_entnode);
 		free_p_statbuf = FALSE;
 		if (scan_only && (p_statbuf->rr.b3_rock == yep) && enable_rockridge) {
-			if (p_statbuf->rr.u_su_fields & ISO_ROCK_SUF_PL) {
-				if (!img_report.has_deep_directories)
-					uprintf("  Note: The selected ISO uses Rock Ridge 'deep directories'.\r\n"
-						"  Because of this, it may take a very long time to scan or extract...");
+			// Rock Ridge deep directories are resolved by looking up the LSN they
+			// were relocated to, which libcdio answers from an index it builds
+			// with a single walk of the file system, so they get scanned in full.
+			if ((p_statbuf->rr.u_su_fields & ISO_ROCK_SUF_PL) && !img_report.has_deep_directories) {
+				uprintf("  Note: The selected ISO uses Rock Ridge 'deep directories'");
 				img_report.has_deep_directories = TRUE;
-				// Due to the nature of the parsing of Rock Ridge deep directories
-				// which requires performing a *very costly* search of the whole
-				// ISO9660 file system to find the matching LSN, ISOs with loads of
-				// deep directory entries (e.g. OPNsense) are very slow to parse...
-				// To speed up the scan process, and since we expect deep directory
-				// entries to appear below anything we care for, we cut things
-				// short by telling the parent not to bother any further once we
-				// find that we are dealing with a deep directory.
-				r = -1;
-				// Add at least one extra block, since we're skipping content.
-				total_blocks++;
-				goto out;
 			}
 		}
 		// Eliminate . and .. entries
@@ -931,6 +1349,12 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 					create_file = FALSE;
 				}
 			}
+			if (create_file && !is_symlink && use_copy_pool(file_length, psz_sanpath, psz_fullpath, &props)) {
+				LPFILETIME ft = to_filetime(mktime(&p_statbuf->tm));
+				if (!schedule_copy_job(p_statbuf->lsn, (DWORD)file_length, psz_sanpath, psz_fullpath, ft, ft, ft))
+					goto out;
+				create_file = FALSE;
+			}
 			if (create_file) {
 				file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
 					FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
@@ -958,32 +1382,31 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 							goto out;
 						lsn = p_statbuf->lsn + (lsn_t)i;
 						nb = (size_t)MIN(ISO_BUFFER_SIZE / ISO_BLOCKSIZE, (file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
-						if (iso9660_iso_seek_read(p_iso, buf, lsn, (long)nb) != (nb * ISO_BLOCKSIZE)) {
-							uprintf("  Error reading ISO9660 file %s at LSN %lu",
-								psz_iso_name, (long unsigned int)lsn);
-							goto out;
+						// Write straight from the image if it is memory mapped
+						data = iso9660_iso_map(p_iso, lsn, (long)nb);
+						if (data == NULL) {
+							if (iso9660_iso_seek_read(p_iso, buf, lsn, (long)nb) != (nb * ISO_BLOCKSIZE)) {
+								uprintf("  Error reading ISO9660 file %s at LSN %lu",
+									psz_iso_name, (long unsigned int)lsn);
+								goto out;
+							}
+							data = buf;
 						}
 						buf_size = (DWORD)MIN(file_length, ISO_BUFFER_SIZE);
 						if (fd_md5sum != NULL)
-							hash_write[HASH_MD5](&ctx, buf, buf_size);
-						ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
+							hash_write[HASH_MD5](&ctx, data, buf_size);
+						ISO_BLOCKING(r = WriteFileWithRetry(file_handle, data, buf_size, &wr_size, WRITE_RETRIES));
 						if (!r || wr_size != buf_size) {
 							uprintf("  Error writing file: %s", r ? "Short write detected" : WindowsErrorString());
 							goto out;
 						}
 						file_length -= wr_size;
-						nb_blocks += nb;
-						if (nb_blocks - last_nb_blocks >= PROGRESS_THRESHOLD) {
-							UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks +
-								((fs_type != FS_NTFS) ? extra_blocks : 0));
-							last_nb_blocks = nb_blocks;
-						}
+						atomic_fetch_add64(&nb_blocks, nb);
+						update_copy_progress();
 					}
 					if (fd_md5sum != NULL) {
 						hash_final[HASH_MD5](&ctx);
-						for (j = 0; j < MD5_HASHSIZE; j++)
-							fprintf(fd_md5sum, "%02x", ctx.buf[j]);
-						fprintf(fd_md5sum, "  ./%s\n", &psz_fullpath[3]);
+						add_md5sum_entry(&ctx, &psz_fullpath[3]);
 					}
 				}
 				if (preserve_timestamps) {
@@ -1092,6 +1515,180 @@ void GetGrubVersion(char* buf, size_t buf_size)
 	}
 }
 
+// Compute the key under which the scan results of an image are cached. Besides the
+// image itself, this covers the Rufus version and the options that alter the scan.
+static BOOL get_scan_cache_key(const char* src_iso, uint8_t* key)
+{
+	struct __stat64 stat;
+	struct {
+		uint16_t version[3];
+		uint8_t enable_joliet;
+		uint8_t enable_rockridge;
+		int64_t size;
+		int64_t mtime;
+		uint8_t vd[(SCAN_CACHE_VD_BLOCKS + 1) * ISO_BLOCKSIZE];
+	} *data = NULL;
+	FILE* fd = NULL;
+	BOOL r = FALSE;
+
+	if (_stat64U(src_iso, &stat) != 0)
+		return FALSE;
+	if (stat.st_size < (SCAN_CACHE_VD_LSN + SCAN_CACHE_VD_BLOCKS) * ISO_BLOCKSIZE)
+		return FALSE;
+	data = calloc(1, sizeof(*data));
+	fd = fopenU(src_iso, "rb");
+	if ((data == NULL) || (fd == NULL))
+		goto out;
+	memcpy(data->version, rufus_version, sizeof(data->version));
+	data->enable_joliet = (uint8_t)enable_joliet;
+	data->enable_rockridge = (uint8_t)enable_rockridge;
+	data->size = stat.st_size;
+	data->mtime = (int64_t)stat.st_mtime;
+	if ((fseek(fd, SCAN_CACHE_VD_LSN * ISO_BLOCKSIZE, SEEK_SET) != 0) ||
+		(fread(data->vd, ISO_BLOCKSIZE, SCAN_CACHE_VD_BLOCKS, fd) != SCAN_CACHE_VD_BLOCKS))
+		goto out;
+	// Images that are too small to have a UDF anchor keep that part zeroed
+	if ((stat.st_size >= (SCAN_CACHE_ANCHOR_LSN + 1) * ISO_BLOCKSIZE) &&
+		((fseek(fd, SCAN_CACHE_ANCHOR_LSN * ISO_BLOCKSIZE, SEEK_SET) != 0) ||
+		(fread(&data->vd[SCAN_CACHE_VD_BLOCKS * ISO_BLOCKSIZE], ISO_BLOCKSIZE, 1, fd) != 1)))
+		goto out;
+	r = HashBuffer(HASH_SHA1, (uint8_t*)data, sizeof(*data), key);
+
+out:
+	if (fd != NULL)
+		fclose(fd);
+	free(data);
+	return r;
+}
+
+static void get_scan_cache_path(const uint8_t* key, char* path, size_t path_size)
+{
+	char key_str[2 * SHA1_HASHSIZE + 1];
+	int i;
+
+	for (i = 0; i < SHA1_HASHSIZE; i++)
+		sprintf(&key_str[2 * i], "%02x", key[i]);
+	snprintf(path, path_size, "%s\\%s\\%s\\%s.bin", app_data_dir, FILES_DIR, SCAN_CACHE_DIR, key_str);
+}
+
+// Restore the results of a previous scan of the same image, if we have them
+static BOOL read_scan_cache(const uint8_t* key)
+{
+	ISO_SCAN_CACHE_HEADER hdr;
+	RUFUS_IMG_REPORT* report = NULL;
+	uint8_t report_hash[SHA1_HASHSIZE];
+	char path[MAX_PATH];
+	FILE* fd;
+	BOOL r = FALSE, stale = FALSE;
+
+	get_scan_cache_path(key, path, sizeof(path));
+	fd = fopenU(path, "rb");
+	if (fd == NULL)
+		return FALSE;
+	report = malloc(sizeof(RUFUS_IMG_REPORT));
+	if (report == NULL)
+		goto out;
+	// Entries from a different version of the cache are of no use to anybody, so remove them
+	stale = TRUE;
+	if ((fread(&hdr, sizeof(hdr), 1, fd) != 1) || (memcmp(hdr.magic, SCAN_CACHE_MAGIC, sizeof(hdr.magic)) != 0) ||
+		(hdr.version != SCAN_CACHE_VERSION) || (hdr.report_size != sizeof(RUFUS_IMG_REPORT)) ||
+		(memcmp(hdr.key, key, SHA1_HASHSIZE) != 0))
+		goto out;
+	if ((fread(report, sizeof(RUFUS_IMG_REPORT), 1, fd) != 1) ||
+		!HashBuffer(HASH_SHA1, (uint8_t*)report, sizeof(RUFUS_IMG_REPORT), report_hash) ||
+		(memcmp(report_hash, hdr.report_hash, SHA1_HASHSIZE) != 0)) {
+		uprintf("  Ignoring corrupted scan cache '%s'", path);
+		goto out;
+	}
+	stale = FALSE;
+	memcpy(&img_report, report, sizeof(RUFUS_IMG_REPORT));
+	total_blocks = hdr.total_blocks;
+	extra_blocks = hdr.extra_blocks;
+	has_ldlinux_c32 = hdr.has_ldlinux_c32;
+	r = TRUE;
+
+out:
+	fclose(fd);
+	free(report);
+	if (stale)
+		DeleteFileU(path);
+	return r;
+}
+
+// Keep the SCAN_CACHE_MAX_ENTRIES most recently written entries of the scan cache
+static void prune_scan_cache(void)
+{
+	WIN32_FIND_DATAA FindFileData = { 0 };
+	FILETIME oldest_time = { 0 };
+	HANDLE hFind;
+	char mask[MAX_PATH], oldest[MAX_PATH];
+	int i, count;
+
+	static_sprintf(mask, "%s\%s\%s\*.bin", app_data_dir, FILES_DIR, SCAN_CACHE_DIR);
+	// We normally only ever go one entry over the limit, so just remove the oldest one until we're good
+	for (i = 0; i < 1024; i++) {
+		hFind = FindFirstFileU(mask, &FindFileData);
+		if (hFind == INVALID_HANDLE_VALUE)
+			return;
+		count = 0;
+		oldest[0] = 0;
+		do {
+			if (FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				continue;
+			if ((count++ == 0) || (CompareFileTime(&FindFileData.ftLastWriteTime, &oldest_time) < 0)) {
+				oldest_time = FindFileData.ftLastWriteTime;
+				static_strcpy(oldest, FindFileData.cFileName);
+			}
+		} while (FindNextFileU(hFind, &FindFileData));
+		FindClose(hFind);
+		if (count <= SCAN_CACHE_MAX_ENTRIES)
+			return;
+		static_sprintf(mask, "%s\%s\%s\%s", app_data_dir, FILES_DIR, SCAN_CACHE_DIR, oldest);
+		if (!DeleteFileU(mask)) {
+			uprintf("Could not remove scan cache '%s': %s", mask, WindowsErrorString());
+			return;
+		}
+		static_sprintf(mask, "%s\%s\%s\*.bin", app_data_dir, FILES_DIR, SCAN_CACHE_DIR);
+	}
+}
+
+// Save the scan results, so that selecting the same image again doesn't require a rescan
+static void write_scan_cache(const uint8_t* key)
+{
+	ISO_SCAN_CACHE_HEADER hdr = { 0 };
+	char path[MAX_PATH];
+	FILE* fd;
+
+	memcpy(hdr.magic, SCAN_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = SCAN_CACHE_VERSION;
+	hdr.report_size = sizeof(RUFUS_IMG_REPORT);
+	memcpy(hdr.key, key, SHA1_HASHSIZE);
+	if (!HashBuffer(HASH_SHA1, (uint8_t*)&img_report, sizeof(RUFUS_IMG_REPORT), hdr.report_hash))
+		return;
+	hdr.total_blocks = total_blocks;
+	hdr.extra_blocks = extra_blocks;
+	hdr.has_ldlinux_c32 = (uint8_t)has_ldlinux_c32;
+
+	static_sprintf(path, "%s\\%s", app_data_dir, FILES_DIR);
+	IGNORE_RETVAL(_mkdirU(path));
+	static_sprintf(path, "%s\\%s\\%s", app_data_dir, FILES_DIR, SCAN_CACHE_DIR);
+	IGNORE_RETVAL(_mkdirU(path));
+	get_scan_cache_path(key, path, sizeof(path));
+	fd = fopenU(path, "wb");
+	if (fd == NULL) {
+		uprintf("Could not create scan cache '%s'", path);
+		return;
+	}
+	if ((fwrite(&hdr, sizeof(hdr), 1, fd) != 1) || (fwrite(&img_report, sizeof(RUFUS_IMG_REPORT), 1, fd) != 1)) {
+		uprintf("Could not write scan cache '%s'", path);
+		fclose(fd);
+		DeleteFileU(path);
+		return;
+	}
+	fclose(fd);
+	prune_scan_cache();
+}
+
 BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 {
 	const char* basedir[] = { "i386", "amd64", "minint" };
@@ -1099,6 +1696,8 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 	int k, r = 1;
 	char *tmp, *buf = NULL, *ext, *spacing = "  ";
 	char path[MAX_PATH], path2[16];
+	uint8_t scan_key[SHA1_HASHSIZE];
+	BOOL has_scan_key = FALSE;
 	uint16_t sl_version;
 	size_t i, j, size, sl_index = 0;
 	FILE* fd;
@@ -1119,6 +1718,13 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 	// Change progress style to marquee for scanning
 	if (scan_only) {
 		uprintf("ISO analysis:");
+		if (enable_iso_scan_cache) {
+			has_scan_key = get_scan_cache_key(src_iso, scan_key);
+			if (has_scan_key && read_scan_cache(scan_key)) {
+				uprintf("  Using the results from a previous scan of this image");
+				return TRUE;
+			}
+		}
 		SendMessage(hMainDialog, UM_PROGRESS_INIT, PBS_MARQUEE, 0);
 		total_blocks = 0;
 		extra_blocks = 0;
@@ -1153,8 +1759,12 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 				md5sum_pos = md5sum_data;
 			}
 		}
+		if (!iso_copy_init())
+			uprintf("Could not start file copy threads - Files will be copied sequentially");
 	}
 
+	// Memory mapping the image is opt-in, as a media error then takes the whole process down
+	cdio_stdio_mmap = enable_iso_mmap;
 	// First try to open as UDF - fallback to ISO if it failed
 	p_udf = udf_open(src_iso);
 	if (p_udf == NULL)
@@ -1211,6 +1821,11 @@ try_iso:
 	r = iso_extract_files(p_iso, "");
 
 out:
+	if ((r == 0) && (iso_copy.nb_scheduled != 0))
+		r = copy_scheduled_files(p_iso, p_udf);
+	// All the files must have been written before we process them further
+	if (!iso_copy_exit() && (r == 0))
+		r = 1;
 	iso_blocking_status = -1;
 	if (scan_only) {
 		struct __stat64 stat;
@@ -1343,6 +1958,8 @@ out:
 		}
 		StrArrayDestroy(&config_path);
 		StrArrayDestroy(&isolinux_path);
+		if (has_scan_key && (r == 0) && (ErrorStatus == 0))
+			write_scan_cache(scan_key);
 		SendMessage(hMainDialog, UM_PROGRESS_EXIT, 0, 0);
 	} else {
 		// Solus and other ISOs only provide EFI boot files in a FAT efi.img
@@ -1445,6 +2062,12 @@ out:
 			md5sum_size = 0;
 		}
 	}
+	if (p_iso != NULL) {
+		uint64_t dir_hits, dir_misses;
+		iso9660_ifs_get_dir_cache_stats(p_iso, &dir_hits, &dir_misses);
+		if (dir_hits + dir_misses != 0)
+			uprintf("ISO9660 directory cache: %llu hits, %llu misses", dir_hits, dir_misses);
+	}
 	iso9660_close(p_iso);
 	udf_close(p_udf);
 	if ((r != 0) && (ErrorStatus == 0))
@@ -1722,28 +2345,33 @@ typedef struct {
  * Read sectors from a FAT img file residing on an ISO-9660 filesystem.
  * NB: This assumes that the img file sectors are contiguous on the ISO.
   */
-int iso9660_readfat(intptr_t pp, void *buf, size_t secsize, libfat_sector_t sec)
+int iso9660_readfat(intptr_t pp, void *buf, size_t size, libfat_sector_t sec)
 {
 	iso9660_readfat_private* p_private = (iso9660_readfat_private*)pp;
+	const size_t secsize = LIBFAT_SECTOR_SIZE;
+	size_t i;
 
-	if (sizeof(p_private->buf) % secsize != 0) {
+	if ((sizeof(p_private->buf) % secsize != 0) || (size % secsize != 0)) {
 		uprintf("iso9660_readfat: Sector size %zu is not a divisor of %zu", secsize, sizeof(p_private->buf));
 		return 0;
 	}
 
-	if ((sec < p_private->sec_start) || (sec >= p_private->sec_start + sizeof(p_private->buf) / secsize)) {
-		// Sector being queried is not in our multi block buffer -> Update it
-		p_private->sec_start = (((sec * secsize) / ISO_BLOCKSIZE) * ISO_BLOCKSIZE) / secsize;
-		if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf,
-			p_private->lsn + (lsn_t)((p_private->sec_start * secsize) / ISO_BLOCKSIZE), ISO_NB_BLOCKS)
-			!= ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
-			uprintf("Error reading ISO-9660 file %s at LSN %lu", img_report.efi_img_path,
-				(long unsigned int)(p_private->lsn + (p_private->sec_start * secsize) / ISO_BLOCKSIZE));
-			return 0;
+	// libfat may request multiple consecutive sectors at once
+	for (i = 0; i < size / secsize; i++, sec++) {
+		if ((sec < p_private->sec_start) || (sec >= p_private->sec_start + sizeof(p_private->buf) / secsize)) {
+			// Sector being queried is not in our multi block buffer -> Update it
+			p_private->sec_start = (((sec * secsize) / ISO_BLOCKSIZE) * ISO_BLOCKSIZE) / secsize;
+			if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf,
+				p_private->lsn + (lsn_t)((p_private->sec_start * secsize) / ISO_BLOCKSIZE), ISO_NB_BLOCKS)
+				!= ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
+				uprintf("Error reading ISO-9660 file %s at LSN %lu", img_report.efi_img_path,
+					(long unsigned int)(p_private->lsn + (p_private->sec_start * secsize) / ISO_BLOCKSIZE));
+				return 0;
+			}
 		}
+		memcpy(&((uint8_t*)buf)[i * secsize], &p_private->buf[(sec - p_private->sec_start) * secsize], secsize);
 	}
-	memcpy(buf, &p_private->buf[(sec - p_private->sec_start)*secsize], secsize);
-	return (int)secsize;
+	return (int)size;
 }
 
 /*
@@ -1926,8 +2554,6 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 					}
 					written += size;
 					s = libfat_nextsector(lf_fs, s);
-					// Trust me, you *REALLY* want to invoke libfat_flush() here
-					libfat_flush(lf_fs);
 				}
 				safe_closehandle(handle);
 				if (props.is_conf)
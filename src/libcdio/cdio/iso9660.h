@@ -726,6 +726,34 @@ typedef struct _iso9660_s iso9660_t;
   long int iso9660_iso_seek_read (const iso9660_t *p_iso, /*out*/ void *ptr,
                                   lsn_t start, long int i_size);
 
+  /*!
+    Get a pointer to i_size blocks of an image, without copying them.
+
+    @param p_iso the ISO-9660 file image to get data from
+
+    @param start location of the first block
+
+    @param i_size number of blocks. Each block is ISO_BLOCKSIZE bytes
+    long.
+
+    @return a pointer to the data, which remains valid until p_iso is
+    closed, or NULL if the image is not memory mapped (e.g. it is not a
+    regular file, uses raw sectors or cdio_stdio_mmap is not set) or if
+    the range goes past its end, in which case iso9660_iso_seek_read()
+    must be used instead.
+  */
+  const void *iso9660_iso_map (const iso9660_t *p_iso, lsn_t start,
+                               long int i_size);
+
+  /*!
+    If set, images that are regular files get memory mapped when they
+    are opened, where the platform supports it. This is off by default,
+    as a media error, or the image being truncated or removed while it
+    is open, then results in SIGBUS rather than in a read error, so it
+    should only be set for images that reside on local fixed storage.
+  */
+  extern bool cdio_stdio_mmap;
+
   /*!
     Read the Primary Volume Descriptor for a CD.
     True is returned if read, and false if there was an error.
@@ -971,6 +999,11 @@ iso9660_stat_t *iso9660_fs_find_lsn_with_path(CdIo_t *p_cdio, lsn_t i_lsn,
    Given a directory pointer, find the filesystem entry that contains
    lsn and return information about it.
 
+   The first call walks the whole file system once, to build an index
+   of the entries by LSN that the next calls are answered from. Rock
+   Ridge deep directories are reported at the location they were
+   relocated to.
+
    @param p_iso the ISO-9660 file image to get data from.
 
    @param i_lsn the LSN to find
@@ -1316,6 +1349,14 @@ lsn_t iso9660_get_dir_extent(const iso9660_dir_t *p_idr);
   */
   bool iso9660_ifs_is_xa (const iso9660_t * p_iso);
 
+  /*!
+    Return the number of directory extent reads that were answered from
+    the directory cache of p_iso, and of those that had to read the image.
+  */
+  void iso9660_ifs_get_dir_cache_stats (const iso9660_t *p_iso,
+                                        /*out*/ uint64_t *pu_hits,
+                                        /*out*/ uint64_t *pu_misses);
+
 
 #ifndef DO_NOT_WANT_COMPATIBILITY
 /** For compatibility with < 0.77 */
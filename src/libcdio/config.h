@@ -168,6 +168,11 @@
 /* Define to 1 if you have the <sys/cdio.h> header file. */
 /* #undef HAVE_SYS_CDIO_H */
 
+/* Define to 1 if you have the <sys/mman.h> header file. */
+#ifndef _WIN32
+#define HAVE_SYS_MMAN_H 1
+#endif
+
 /* Define to 1 if you have the <sys/param.h> header file. */
 /* #undef HAVE_SYS_PARAM_H */
 
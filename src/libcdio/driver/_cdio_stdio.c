@@ -40,6 +40,14 @@
 #include <errno.h>
 #endif
 #include <ctype.h>
+#include <stdint.h>
+
+/* Local files can be accessed through a memory mapping, if requested */
+#if defined(HAVE_SYS_MMAN_H) && !defined(_WIN32)
+#define CDIO_STDIO_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 
 #include <cdio/logging.h>
 #include <cdio/util.h>
@@ -91,18 +99,78 @@ static inline int _stati64_utf8(const char *path, struct _stati64 *buffer) {
 
 #define CDIO_STDIO_BUFSIZE (128*1024)
 
+bool cdio_stdio_mmap = false;
+
 typedef struct {
   char *pathname;
   FILE *fd;
   char *fd_buf;
   off_t st_size; /* used only for source */
+#ifdef CDIO_STDIO_MMAP
+  uint8_t *map;  /* non NULL if the file is mapped, in which case fd is NULL */
+  size_t map_size;
+  size_t map_pos;
+  size_t page_size;
+#endif
 } _UserData;
 
+#ifdef CDIO_STDIO_MMAP
+/*!
+  Map a regular file in its entirety, so that reads become a plain
+  memcpy() from the page cache and that cdio_stream_map() can return
+  pointers into the file data.
+
+  @return true if the file was mapped, false if stdio must be used,
+  as is the case for pipes, devices or files too large for the address
+  space.
+*/
+static bool
+_stdio_map_open (_UserData *ud)
+{
+  struct stat statbuf;
+  void *p_map;
+  int fd;
+
+  fd = open (ud->pathname, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  if (fstat (fd, &statbuf) != 0 || !S_ISREG (statbuf.st_mode)
+      || statbuf.st_size <= 0 || (uintmax_t) statbuf.st_size > SIZE_MAX)
+    {
+      close (fd);
+      return false;
+    }
+  p_map = mmap (NULL, (size_t) statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  /* The mapping holds its own reference to the file */
+  close (fd);
+  if (p_map == MAP_FAILED)
+    {
+      cdio_debug ("mmap (): %s", strerror (errno));
+      return false;
+    }
+  /* Extraction reads the image front to back, so favour read-ahead */
+  madvise (p_map, (size_t) statbuf.st_size, MADV_SEQUENTIAL);
+
+  ud->map       = p_map;
+  ud->map_size  = (size_t) statbuf.st_size;
+  ud->map_pos   = 0;
+  ud->page_size = (size_t) sysconf (_SC_PAGESIZE);
+  return true;
+}
+#endif
+
 static int
 _stdio_open (void *user_data)
 {
   _UserData *const ud = user_data;
 
+#ifdef CDIO_STDIO_MMAP
+  /* An I/O error on a mapped file raises SIGBUS instead of failing the
+     read, so this must only be requested for files that can't go away */
+  if (cdio_stdio_mmap && _stdio_map_open (ud))
+    return 0;
+#endif
+
   if ((ud->fd = CDIO_FOPEN (ud->pathname, "rb")))
     {
       ud->fd_buf = calloc (1, CDIO_STDIO_BUFSIZE);
@@ -117,6 +185,16 @@ _stdio_close(void *user_data)
 {
   _UserData *const ud = user_data;
 
+#ifdef CDIO_STDIO_MMAP
+  if (ud->map)
+    {
+      if (munmap (ud->map, ud->map_size))
+        cdio_error ("munmap (): %s", strerror (errno));
+      ud->map = NULL;
+      return 0;
+    }
+#endif
+
   if (fclose (ud->fd))
     cdio_error ("fclose (): %s", strerror (errno));
 
@@ -138,6 +216,10 @@ _stdio_free(void *user_data)
 
   if (ud->fd) /* should be NULL anyway... */
     _stdio_close(user_data);
+#ifdef CDIO_STDIO_MMAP
+  if (ud->map)
+    _stdio_close(user_data);
+#endif
 
   free(ud);
 }
@@ -163,6 +245,31 @@ _stdio_seek(void *p_user_data, off_t i_offset, int whence)
 {
   _UserData *const ud = p_user_data;
   int ret;
+
+#ifdef CDIO_STDIO_MMAP
+  if (ud->map)
+    {
+      off_t i_base = (whence == SEEK_CUR) ? (off_t) ud->map_pos
+        : (whence == SEEK_END) ? (off_t) ud->map_size : 0;
+
+      if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END)
+        {
+          errno = EINVAL;
+          return DRIVER_OP_ERROR;
+        }
+      if (i_offset < -i_base || (uintmax_t) (i_base + i_offset) > SIZE_MAX)
+        {
+          cdio_error ("seek (): offset %lld out of range",
+                      (long long) (i_base + i_offset));
+          errno = EINVAL;
+          return DRIVER_OP_ERROR;
+        }
+      /* Like fseek, going past the end is not an error until we read */
+      ud->map_pos = (size_t) (i_base + i_offset);
+      return DRIVER_OP_SUCCESS;
+    }
+#endif
+
 #if !defined(HAVE_FSEEKO) && !defined(HAVE_FSEEKO64)
   /* Detect if off_t is lossy-truncated to long to avoid data corruption */
   if ( (sizeof(off_t) > sizeof(long)) && (i_offset != (off_t)((long)i_offset)) ) {
@@ -210,6 +317,23 @@ _stdio_read(void *user_data, void *buf, size_t count)
   _UserData *const ud = user_data;
   long read_count;
 
+#ifdef CDIO_STDIO_MMAP
+  if (ud->map)
+    {
+      size_t i_avail = (ud->map_pos < ud->map_size)
+        ? ud->map_size - ud->map_pos : 0;
+
+      if (count > i_avail)
+        {
+          cdio_debug ("read (): EOF encountered");
+          count = i_avail;
+        }
+      memcpy (buf, ud->map + ud->map_pos, count);
+      ud->map_pos += count;
+      return count;
+    }
+#endif
+
   read_count = fread(buf, 1, count, ud->fd);
 
   if (read_count != count)
@@ -231,6 +355,33 @@ _stdio_read(void *user_data, void *buf, size_t count)
   return read_count;
 }
 
+#ifdef CDIO_STDIO_MMAP
+/*!
+  Return a pointer to the count bytes of the mapped file that start at
+  offset, or NULL if the file isn't mapped or if the range goes past
+  its end. The kernel is told that the range is about to be accessed,
+  so that it can be read in while the caller processes the previous one.
+*/
+static const void *
+_stdio_map(void *user_data, off_t offset, size_t count)
+{
+  _UserData *const ud = user_data;
+  size_t i_start;
+
+  if (!ud->map || (uintmax_t) offset > ud->map_size
+      || count > ud->map_size - (size_t) offset)
+    return NULL;
+
+  if (count != 0)
+    {
+      i_start = (size_t) offset & ~(ud->page_size - 1);
+      madvise (ud->map + i_start, (size_t) offset + count - i_start,
+               MADV_WILLNEED);
+    }
+  return ud->map + offset;
+}
+#endif
+
 /*!
   Deallocate resources assocaited with obj. After this obj is unusable.
 */
@@ -244,7 +395,7 @@ CdioDataSource_t *
 cdio_stdio_new(const char pathname[])
 {
   CdioDataSource_t *new_obj = NULL;
-  cdio_stream_io_functions funcs = { NULL, NULL, NULL, NULL, NULL, NULL };
+  cdio_stream_io_functions funcs = { NULL, NULL, NULL, NULL, NULL, NULL, NULL };
   _UserData *ud = NULL;
   struct CDIO_STAT_STRUCT statbuf;
   char* pathdup;
@@ -277,6 +428,9 @@ cdio_stdio_new(const char pathname[])
   funcs.read   = _stdio_read;
   funcs.close  = _stdio_close;
   funcs.free   = _stdio_free;
+#ifdef CDIO_STDIO_MMAP
+  funcs.map    = _stdio_map;
+#endif
 
   new_obj = cdio_stream_new(ud, &funcs);
 
@@ -43,6 +43,9 @@ extern "C" {
   
   typedef void(*cdio_data_free_t)(void *user_data);
   
+  typedef const void*(*cdio_data_map_t)(void *user_data, off_t offset,
+                                        size_t count);
+  
   
   /* abstract data source */
   
@@ -53,6 +56,7 @@ extern "C" {
     cdio_data_read_t read;
     cdio_data_close_t close;
     cdio_data_free_t free;
+    cdio_data_map_t map; /* optional */
   } cdio_stream_io_functions;
   
   /**
@@ -121,6 +125,19 @@ extern "C" {
   void cdio_stream_destroy(CdioDataSource_t *p_obj);
   
   void cdio_stream_close(CdioDataSource_t *p_obj);
+
+  /**
+    Return a pointer to the i_size bytes of the stream that start at
+    i_offset, without copying them, if the stream is backed by a
+    memory mapping. The data remains valid until the stream is closed.
+    The stream position is not changed.
+
+    @return a pointer to the data, or NULL if the stream can't be
+    mapped or the range is out of bounds, in which case the caller
+    should fall back to cdio_stream_seek() and cdio_stream_read().
+  */
+  const void *cdio_stream_map(CdioDataSource_t *p_obj, off_t i_offset,
+                              size_t i_size);
   
 #ifdef __cplusplus
 }
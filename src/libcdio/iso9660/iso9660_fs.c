@@ -63,6 +63,44 @@
 /* Maximum number of El-Torito boot images we keep an index for */
 #define MAX_BOOT_IMAGES     8
 
+/* Initial number of slots (log2) of the LSN index */
+#define LSN_INDEX_MIN_BITS  10
+
+/* Maximum number of blocks of directory extents the cache of an image holds,
+   and number of buckets of its hash table */
+#define DIR_CACHE_MAX_BLOCKS 2048
+#define DIR_CACHE_BUCKETS    256
+
+/** A directory extent, as read from the image */
+typedef struct iso9660_dir_cache_entry_s {
+  struct iso9660_dir_cache_entry_s *p_hash_next; /**< Next in the bucket */
+  struct iso9660_dir_cache_entry_s *p_prev;      /**< More recently used */
+  struct iso9660_dir_cache_entry_s *p_next;      /**< Less recently used */
+  lsn_t lsn;
+  uint32_t blocks;
+  uint8_t data[EMPTY_ARRAY_SIZE];
+} iso9660_dir_cache_entry_t;
+
+/** LRU cache of the directory extents of an image, keyed by LSN, so that
+    resolving a path or listing a directory doesn't have to read every
+    extent from the root again (see iso9660_read_dir_extent()) */
+typedef struct {
+  iso9660_dir_cache_entry_t *p_bucket[DIR_CACHE_BUCKETS];
+  iso9660_dir_cache_entry_t *p_head; /**< Most recently used */
+  iso9660_dir_cache_entry_t *p_tail; /**< Least recently used */
+  uint32_t i_blocks;                 /**< Blocks held by all the entries */
+  uint64_t i_hits;
+  uint64_t i_misses;
+} iso9660_dir_cache_t;
+
+/** Hash table of the entries of an image, keyed by LSN, built on the first
+    LSN lookup (see _iso9660_lsn_index_get()) */
+typedef struct {
+  iso9660_stat_t **pp_stat; /**< 2^i_bits slots, using linear probing */
+  unsigned int i_bits;
+  unsigned int i_count;
+} iso9660_lsn_index_t;
+
 /** Implementation of iso9660_t type */
 struct _iso9660_s {
   cdio_header_t header;     /**< Internal header - MUST come first. */
@@ -103,12 +141,19 @@ struct _iso9660_s {
 			         different.
 			     */
   bool b_have_superblock;   /**< Superblock has been read in? */
+  iso9660_lsn_index_t *p_lsn_index; /**< LSN to entry index, or NULL if
+				         it hasn't been built yet */
+  iso9660_dir_cache_t *p_dir_cache; /**< Directory extent cache, allocated
+				         on open, as duplicates of this
+				         struct share it */
 };
 
 static long int iso9660_seek_read_framesize (const iso9660_t *p_iso,
 					     void *ptr, lsn_t start,
 					     long int size,
 					     uint16_t i_framesize);
+static void lsn_index_free (iso9660_lsn_index_t *p_index);
+static void dir_cache_free (iso9660_dir_cache_t *p_cache);
 
 /* Adjust the p_iso's i_datastart, i_byte_offset and i_framesize
    based on whether we find a frame header or not.
@@ -207,6 +252,8 @@ iso9660_open_ext_private (const char *psz_path,
     ? nope : yep;
 
   p_iso->iso_extension_mask = iso_extension_mask;
+  /* Not fatal, as directory extents are then read from the image every time */
+  p_iso->p_dir_cache = calloc(1, sizeof(iso9660_dir_cache_t));
   return p_iso;
 
  error:
@@ -297,6 +344,8 @@ iso9660_close (iso9660_t *p_iso)
   if (NULL != p_iso) {
     cdio_stdio_destroy(p_iso->stream);
     p_iso->stream = NULL;
+    lsn_index_free(p_iso->p_lsn_index);
+    dir_cache_free(p_iso->p_dir_cache);
     free(p_iso);
   }
   return true;
@@ -794,6 +843,152 @@ iso9660_iso_seek_read (const iso9660_t *p_iso, void *ptr, lsn_t start,
   return iso9660_seek_read_framesize(p_iso, ptr, start, size, ISO_BLOCKSIZE);
 }
 
+/*!
+  Return a pointer to size blocks of the image, starting at start,
+  without copying them. Only images that use plain ISO_BLOCKSIZE
+  sectors and that are backed by a memory mapped file can be accessed
+  this way, as raw sectors have headers between their user data.
+*/
+const void *
+iso9660_iso_map (const iso9660_t *p_iso, lsn_t start, long int size)
+{
+  int64_t i_byte_offset;
+
+  if (!p_iso || size < 0 || p_iso->i_framesize != ISO_BLOCKSIZE)
+    return NULL;
+  i_byte_offset = (start * (int64_t)ISO_BLOCKSIZE)
+    + p_iso->i_fuzzy_offset + p_iso->i_datastart;
+  if (i_byte_offset < 0)
+    return NULL;
+  return cdio_stream_map (p_iso->stream, i_byte_offset,
+			  (size_t)size * ISO_BLOCKSIZE);
+}
+
+static void
+dir_cache_free (iso9660_dir_cache_t *p_cache)
+{
+  iso9660_dir_cache_entry_t *p_entry, *p_next;
+
+  if (!p_cache)
+    return;
+  for (p_entry = p_cache->p_head; p_entry != NULL; p_entry = p_next) {
+    p_next = p_entry->p_next;
+    free(p_entry);
+  }
+  free(p_cache);
+}
+
+static void
+dir_cache_unlink (iso9660_dir_cache_t *p_cache,
+		  iso9660_dir_cache_entry_t *p_entry)
+{
+  if (p_entry->p_prev)
+    p_entry->p_prev->p_next = p_entry->p_next;
+  else
+    p_cache->p_head = p_entry->p_next;
+  if (p_entry->p_next)
+    p_entry->p_next->p_prev = p_entry->p_prev;
+  else
+    p_cache->p_tail = p_entry->p_prev;
+}
+
+static void
+dir_cache_push_front (iso9660_dir_cache_t *p_cache,
+		      iso9660_dir_cache_entry_t *p_entry)
+{
+  p_entry->p_prev = NULL;
+  p_entry->p_next = p_cache->p_head;
+  if (p_cache->p_head)
+    p_cache->p_head->p_prev = p_entry;
+  else
+    p_cache->p_tail = p_entry;
+  p_cache->p_head = p_entry;
+}
+
+static void
+dir_cache_remove (iso9660_dir_cache_t *p_cache,
+		  iso9660_dir_cache_entry_t *p_entry)
+{
+  iso9660_dir_cache_entry_t **pp;
+
+  for (pp = &p_cache->p_bucket[p_entry->lsn % DIR_CACHE_BUCKETS]; *pp != p_entry;
+       pp = &(*pp)->p_hash_next);
+  *pp = p_entry->p_hash_next;
+  dir_cache_unlink(p_cache, p_entry);
+  p_cache->i_blocks -= p_entry->blocks;
+  free(p_entry);
+}
+
+/*!
+  Read the 'blocks' blocks of the directory extent at 'lsn', from the
+  directory cache of p_iso if it holds it, or from the image otherwise,
+  in which case the extent gets added to the cache, evicting the least
+  recently used ones as needed. Size read is returned.
+*/
+static long int
+iso9660_read_dir_extent (const iso9660_t *p_iso, void *ptr, lsn_t lsn,
+			 uint32_t blocks)
+{
+  iso9660_dir_cache_t *p_cache = p_iso->p_dir_cache;
+  iso9660_dir_cache_entry_t *p_entry;
+  long int ret;
+
+  if (!p_cache || blocks == 0 || blocks > DIR_CACHE_MAX_BLOCKS)
+    return iso9660_iso_seek_read(p_iso, ptr, lsn, blocks);
+
+  for (p_entry = p_cache->p_bucket[lsn % DIR_CACHE_BUCKETS]; p_entry != NULL;
+       p_entry = p_entry->p_hash_next) {
+    if (p_entry->lsn == lsn)
+      break;
+  }
+  if (p_entry && p_entry->blocks == blocks) {
+    p_cache->i_hits++;
+    memcpy(ptr, p_entry->data, (size_t)blocks * ISO_BLOCKSIZE);
+    dir_cache_unlink(p_cache, p_entry);
+    dir_cache_push_front(p_cache, p_entry);
+    return (long int)blocks * ISO_BLOCKSIZE;
+  }
+
+  p_cache->i_misses++;
+  if (p_entry)
+    dir_cache_remove(p_cache, p_entry);
+  ret = iso9660_iso_seek_read(p_iso, ptr, lsn, blocks);
+  if (ret != (long int)blocks * ISO_BLOCKSIZE)
+    return ret;
+
+  while (p_cache->p_tail && p_cache->i_blocks + blocks > DIR_CACHE_MAX_BLOCKS)
+    dir_cache_remove(p_cache, p_cache->p_tail);
+  p_entry = malloc(sizeof(iso9660_dir_cache_entry_t) +
+		   (size_t)blocks * ISO_BLOCKSIZE);
+  if (!p_entry)
+    return ret;
+  p_entry->lsn = lsn;
+  p_entry->blocks = blocks;
+  memcpy(p_entry->data, ptr, (size_t)blocks * ISO_BLOCKSIZE);
+  p_entry->p_hash_next = p_cache->p_bucket[lsn % DIR_CACHE_BUCKETS];
+  p_cache->p_bucket[lsn % DIR_CACHE_BUCKETS] = p_entry;
+  dir_cache_push_front(p_cache, p_entry);
+  p_cache->i_blocks += blocks;
+  return ret;
+}
+
+/*!
+  Return the number of directory extent reads that the directory cache
+  of p_iso answered, and of those that had to go to the image.
+*/
+void
+iso9660_ifs_get_dir_cache_stats (const iso9660_t *p_iso,
+				 /*out*/ uint64_t *pu_hits,
+				 /*out*/ uint64_t *pu_misses)
+{
+  const iso9660_dir_cache_t *p_cache = p_iso ? p_iso->p_dir_cache : NULL;
+
+  if (pu_hits)
+    *pu_hits = p_cache ? p_cache->i_hits : 0;
+  if (pu_misses)
+    *pu_misses = p_cache ? p_cache->i_misses : 0;
+}
+
 
 
 /*!
@@ -1324,7 +1519,7 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
     return NULL;
     }
 
-  ret = iso9660_iso_seek_read (p_iso, _dirbuf, _root->lsn, blocks);
+  ret = iso9660_read_dir_extent (p_iso, _dirbuf, _root->lsn, blocks);
   if (ret != blocks * ISO_BLOCKSIZE) {
     free(_dirbuf);
     return NULL;
@@ -1742,7 +1937,7 @@ iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
         return NULL;
       }
 
-    ret = iso9660_iso_seek_read (p_iso, _dirbuf, p_stat->lsn, blocks);
+    ret = iso9660_read_dir_extent (p_iso, _dirbuf, p_stat->lsn, blocks);
     if (ret != dirbuf_len) 	  {
       _cdio_list_free (retval, true, NULL);
       iso9660_stat_free(p_stat);
@@ -1885,6 +2080,205 @@ find_lsn_recurse (void *p_image, iso9660_readdir_t iso9660_readdir,
   return NULL;
 }
 
+/* Return a copy of p_stat, including its Rock Ridge symlink, that the
+   caller must free with iso9660_stat_free(). */
+static iso9660_stat_t *
+stat_dup (const iso9660_stat_t *p_stat)
+{
+  const unsigned int len = sizeof(iso9660_stat_t) +
+			   strlen(p_stat->filename) + 1;
+  iso9660_stat_t *p_dup = calloc(1, len);
+
+  if (!p_dup) {
+    cdio_warn("Couldn't calloc(1, %d)", len);
+    return NULL;
+  }
+  memcpy(p_dup, p_stat, len);
+  if (p_stat->rr.psz_symlink) {
+    p_dup->rr.psz_symlink = calloc(1, p_stat->rr.i_symlink_max);
+    if (!p_dup->rr.psz_symlink) {
+      cdio_warn("Couldn't calloc(1, %d)", p_stat->rr.i_symlink_max);
+      free(p_dup);
+      return NULL;
+    }
+    memcpy(p_dup->rr.psz_symlink, p_stat->rr.psz_symlink,
+	   p_stat->rr.i_symlink_max);
+  }
+  return p_dup;
+}
+
+static inline uint32_t
+lsn_index_slot (lsn_t lsn, unsigned int i_bits)
+{
+  return ((uint32_t)lsn * 0x9E3779B1U) >> (32 - i_bits);
+}
+
+static void
+lsn_index_free (iso9660_lsn_index_t *p_index)
+{
+  uint32_t i;
+
+  if (!p_index)
+    return;
+  if (p_index->pp_stat) {
+    for (i = 0; i < (1U << p_index->i_bits); i++)
+      iso9660_stat_free(p_index->pp_stat[i]);
+    free(p_index->pp_stat);
+  }
+  free(p_index);
+}
+
+/* Add a copy of p_stat to the index, unless an entry with the same LSN is
+   already there, so that the first entry found by the walk is the one kept,
+   as with find_lsn_recurse(). */
+static bool
+lsn_index_add (iso9660_lsn_index_t *p_index, const iso9660_stat_t *p_stat)
+{
+  uint32_t i, mask;
+
+  if (2 * (p_index->i_count + 1) > (1U << p_index->i_bits)) {
+    const unsigned int i_bits = p_index->i_bits + 1;
+    iso9660_stat_t **pp_stat = calloc(1U << i_bits, sizeof(iso9660_stat_t *));
+    uint32_t j;
+
+    if (!pp_stat) {
+      cdio_warn("Couldn't calloc(%u, %d)", 1U << i_bits,
+		(int)sizeof(iso9660_stat_t *));
+      return false;
+    }
+    mask = (1U << i_bits) - 1;
+    for (j = 0; j < (1U << p_index->i_bits); j++) {
+      if (!p_index->pp_stat[j])
+	continue;
+      for (i = lsn_index_slot(p_index->pp_stat[j]->lsn, i_bits); pp_stat[i];
+	   i = (i + 1) & mask);
+      pp_stat[i] = p_index->pp_stat[j];
+    }
+    free(p_index->pp_stat);
+    p_index->pp_stat = pp_stat;
+    p_index->i_bits = i_bits;
+  }
+
+  mask = (1U << p_index->i_bits) - 1;
+  for (i = lsn_index_slot(p_stat->lsn, p_index->i_bits); p_index->pp_stat[i];
+       i = (i + 1) & mask) {
+    if (p_index->pp_stat[i]->lsn == p_stat->lsn)
+      return true;
+  }
+  p_index->pp_stat[i] = stat_dup(p_stat);
+  if (!p_index->pp_stat[i])
+    return false;
+  p_index->i_count++;
+  return true;
+}
+
+/* Return a copy of the indexed entry for lsn, or NULL if there is none. */
+static iso9660_stat_t *
+lsn_index_find (const iso9660_lsn_index_t *p_index, lsn_t lsn)
+{
+  const uint32_t mask = (1U << p_index->i_bits) - 1;
+  uint32_t i;
+
+  for (i = lsn_index_slot(lsn, p_index->i_bits); p_index->pp_stat[i];
+       i = (i + 1) & mask) {
+    if (p_index->pp_stat[i]->lsn == lsn)
+      return stat_dup(p_index->pp_stat[i]);
+  }
+  return NULL;
+}
+
+/* Add the entries of psz_path, then those of its subdirectories, in the
+   same order as find_lsn_recurse() visits them. */
+static bool
+lsn_index_walk (iso9660_t *p_iso, iso9660_lsn_index_t *p_index,
+		const char psz_path[])
+{
+  CdioISO9660FileList_t *entlist = iso9660_ifs_readdir (p_iso, psz_path);
+  CdioISO9660DirList_t *dirlist;
+  CdioListNode_t *entnode;
+  bool b_ret = true;
+
+  if (!entlist)
+    return true;
+
+  dirlist = iso9660_dirlist_new();
+  _CDIO_LIST_FOREACH (entnode, entlist)
+    {
+      iso9660_stat_t *statbuf = _cdio_list_node_data (entnode);
+
+      if (!lsn_index_add(p_index, statbuf)) {
+	b_ret = false;
+	break;
+      }
+      if (statbuf->type == _STAT_DIR
+          && strcmp ((char *) statbuf->filename, ".")
+          && strcmp ((char *) statbuf->filename, "..")) {
+	unsigned int len = strlen(psz_path) + strlen(statbuf->filename) + 2;
+	char *psz_subdir = calloc(1, len);
+
+	if (!psz_subdir) {
+	  b_ret = false;
+	  break;
+	}
+	snprintf (psz_subdir, len, "%s%s/", psz_path, statbuf->filename);
+        _cdio_list_append (dirlist, psz_subdir);
+      }
+    }
+  iso9660_filelist_free (entlist);
+
+  if (b_ret) {
+    _CDIO_LIST_FOREACH (entnode, dirlist)
+      {
+	if (!lsn_index_walk (p_iso, p_index, _cdio_list_node_data (entnode))) {
+	  b_ret = false;
+	  break;
+	}
+      }
+  }
+  iso9660_dirlist_free(dirlist);
+  return b_ret;
+}
+
+/* Return the LSN index of p_iso, building it with a single walk of the file
+   system on the first call, or NULL if it couldn't be built. */
+static iso9660_lsn_index_t *
+_iso9660_lsn_index_get (iso9660_t *p_iso)
+{
+  iso9660_lsn_index_t *p_index;
+  iso9660_t *p_iso_dd;
+
+  if (p_iso->p_lsn_index)
+    return p_iso->p_lsn_index;
+
+  p_index = calloc(1, sizeof(iso9660_lsn_index_t));
+  if (p_index) {
+    p_index->i_bits = LSN_INDEX_MIN_BITS;
+    p_index->pp_stat = calloc(1U << p_index->i_bits, sizeof(iso9660_stat_t *));
+  }
+  /* Index the entries where they are recorded, with Rock Ridge deep
+     directory resolution disabled, as _iso9660_dd_find_lsn() needs the
+     relocated directories. As with the latter, work with a duplicate,
+     since we may be called while p_iso is in the middle of a readdir. */
+  p_iso_dd = calloc(1, sizeof(iso9660_t));
+  if (!p_index || !p_index->pp_stat || !p_iso_dd) {
+    cdio_warn("Couldn't allocate the LSN index");
+    lsn_index_free(p_index);
+    free(p_iso_dd);
+    return NULL;
+  }
+  memcpy(p_iso_dd, p_iso, sizeof(iso9660_t));
+  p_iso_dd->header.u_flags |= CDIO_HEADER_FLAGS_DISABLE_RR_DD;
+
+  if (!lsn_index_walk(p_iso_dd, p_index, "/")) {
+    cdio_warn("Couldn't build the LSN index");
+    lsn_index_free(p_index);
+    p_index = NULL;
+  }
+  free(p_iso_dd);
+  p_iso->p_lsn_index = p_index;
+  return p_index;
+}
+
 /*!
    Given a directory pointer, find the filesystem entry that contains
    lsn and return information about it.
@@ -1940,9 +2334,17 @@ iso9660_stat_t *
 iso9660_ifs_find_lsn(iso9660_t *p_iso, lsn_t i_lsn)
 {
   char *psz_full_filename = NULL;
-  iso9660_stat_t *ret  =
-    find_lsn_recurse (p_iso, (iso9660_readdir_t *) iso9660_ifs_readdir,
-		      "/", i_lsn, &psz_full_filename);
+  iso9660_lsn_index_t *p_index;
+  iso9660_stat_t *ret;
+
+  if (!p_iso)
+    return NULL;
+  p_index = _iso9660_lsn_index_get(p_iso);
+  if (p_index)
+    return lsn_index_find(p_index, i_lsn);
+
+  ret = find_lsn_recurse (p_iso, (iso9660_readdir_t *) iso9660_ifs_readdir,
+			  "/", i_lsn, &psz_full_filename);
   if (psz_full_filename != NULL)
     free(psz_full_filename);
   return ret;
@@ -1966,6 +2368,11 @@ _iso9660_dd_find_lsn(void* p_image, lsn_t i_lsn)
 
   switch(p_header->u_type) {
   case CDIO_HEADER_TYPE_ISO:
+    {
+      iso9660_lsn_index_t *p_index = _iso9660_lsn_index_get(p_image);
+      if (p_index)
+	return lsn_index_find(p_index, i_lsn);
+    }
     size = sizeof(iso9660_t);
     f_readdir = (iso9660_readdir_t*)iso9660_ifs_readdir;
     break;
@@ -2090,7 +2497,7 @@ iso_have_rr_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
     return dunno;
     }
 
-  ret = iso9660_iso_seek_read (p_iso, _dirbuf, _root->lsn, blocks);
+  ret = iso9660_read_dir_extent (p_iso, _dirbuf, _root->lsn, blocks);
   if (ret != blocks * ISO_BLOCKSIZE) {
     free(_dirbuf);
     return false;
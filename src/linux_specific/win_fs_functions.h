@@ -22,6 +22,7 @@
 
 #include <sys/stat.h>
 #include <stdio.h>
+#include <unistd.h>
 
 // Allow the underscore FS functions
 #define _openU open
@@ -39,6 +40,10 @@
 #define OPEN_ALWAYS       4
 #define TRUNCATE_EXISTING 5
 
+// Only used as hints on linux
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000
+#define FILE_FLAG_NO_BUFFERING    0x20000000
+
 
 
 
@@ -96,6 +101,12 @@ static __inline BOOL WriteFile(HANDLE handle, LPCVOID buffer, DWORD count, LPDWO
 
 
 
+static __inline BOOL FlushFileBuffers(HANDLE handle){
+	FILE* f = (FILE*) handle;
+	if (f == NULL) return 0;
+	return (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+}
+
 static __inline VOID CloseHandle(HANDLE handle){
 	FILE* f = (FILE*) handle;
 	if (f == NULL) return;
@@ -25,99 +25,456 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
+#include <poll.h>
 #include <aio.h>
+#include <linux/io_uring.h>
 
-typedef struct {
-    int fd;               // File descriptor
-    off_t offset;         // File offset
+/*
+ * Two backends are available: io_uring, which is what we want, and glibc's
+ * POSIX aio, which runs on a hidden thread pool but is always there. We use
+ * raw syscalls for io_uring so that we don't have to depend on liburing.
+ *
+ * Both backends keep up to ASYNC_QUEUE_DEPTH requests in flight per handle.
+ * Requests are retired in the order they were submitted, so that callers
+ * that only ever keep one request in flight see the exact same behaviour
+ * as with the Windows implementation.
+ */
+#define ASYNC_QUEUE_DEPTH   8
+
+enum async_backend {
+    ASYNC_BACKEND_AIO = 0,
+    ASYNC_BACKEND_URING,
+};
 
+typedef struct {
+    BOOL pending;           // Request was submitted and not yet retired
+    BOOL completed;         // Completion was reaped (io_uring only)
+    int result;             // Bytes transferred, or -errno
+    off_t offset;
+    struct iovec iov;
     struct aiocb cb;
+} ASYNC_REQ;
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+} URING;
+
+typedef struct {
+    int fd;                 // File descriptor
+    off_t offset;           // File offset for the next request
+    enum async_backend backend;
+    URING ring;
+    uint8_t* fixed_buf;     // Buffer registered with io_uring, if any
+    size_t fixed_len;
+    unsigned head, count;   // FIFO of in-flight requests
+    ASYNC_REQ req[ASYNC_QUEUE_DEPTH];
 } ASYNC_FD;
 
+/* Set once we know io_uring is not usable, so that we don't retry for every handle */
+static BOOL uring_unavailable = FALSE;
+
+static __inline int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static __inline int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static __inline int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_exit(URING* ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(URING));
+    ring->fd = -1;
+}
+
+static BOOL uring_init(URING* ring, unsigned entries)
+{
+    struct io_uring_params p = { 0 };
+    uint8_t *sq, *cq;
+
+    memset(ring, 0, sizeof(URING));
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0)
+        return FALSE;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sq_size = ring->cq_size = max(ring->sq_size, ring->cq_size);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto error;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto error;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto error;
+
+    sq = (uint8_t*)ring->sq_ptr;
+    cq = (uint8_t*)ring->cq_ptr;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return TRUE;
+
+error:
+    uring_exit(ring);
+    return FALSE;
+}
+
+/* Queue and submit a single SQE. The ring is sized so that it can never be full. */
+static BOOL uring_submit(URING* ring, uint8_t opcode, int fd, ASYNC_REQ* r, uint64_t user_data, int buf_index)
+{
+    unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    int ret;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)r->offset;
+    sqe->user_data = user_data;
+    if (buf_index >= 0) {
+        sqe->addr = (uint64_t)(uintptr_t)r->iov.iov_base;
+        sqe->len = (uint32_t)r->iov.iov_len;
+        sqe->buf_index = (uint16_t)buf_index;
+    } else {
+        // Use the vectored variants, as they are available since the very first io_uring kernels
+        sqe->addr = (uint64_t)(uintptr_t)&r->iov;
+        sqe->len = 1;
+    }
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do {
+        ret = sys_io_uring_enter(ring->fd, 1, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 1)
+        return TRUE;
+
+    // If the kernel consumed the SQE regardless, its completion will be posted, so it
+    // must be accounted for as in flight. Otherwise, withdraw it, as the caller is going
+    // to consider the request slot free, and a later submission would otherwise pick it.
+    if (__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) != tail)
+        return TRUE;
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    return FALSE;
+}
+
+/* Reap all the CQEs that are currently available */
+static void uring_reap(ASYNC_FD* h)
+{
+    URING* ring = &h->ring;
+    unsigned head = *ring->cq_head;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        if (cqe->user_data < ASYNC_QUEUE_DEPTH) {
+            ASYNC_REQ* r = &h->req[cqe->user_data];
+            r->result = cqe->res;
+            r->completed = TRUE;
+        }
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
 
-ASYNC_FD* CreateFileAsync(LPCSTR lpFileName, DWORD dwDesiredAccess,
-	DWORD dwShareMode, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes){
+void* CreateFileAsync(LPCSTR lpFileName, DWORD dwDesiredAccess,
+    DWORD dwShareMode, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes){
     ASYNC_FD* afd = calloc(1, sizeof(ASYNC_FD));
     if (!afd) return NULL;
-    
+
     afd->fd = create_file_linux(lpFileName, windowsAccessToLinux(dwDesiredAccess), dwCreationDisposition, dwFlagsAndAttributes);
     if (afd->fd == -1){
         free(afd);
         return NULL;
     }
+    if (dwFlagsAndAttributes & FILE_FLAG_SEQUENTIAL_SCAN)
+        posix_fadvise(afd->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // Drop whatever is cached, so that reads come from the media
+    if (dwFlagsAndAttributes & FILE_FLAG_NO_BUFFERING)
+        posix_fadvise(afd->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    afd->ring.fd = -1;
+    afd->backend = ASYNC_BACKEND_AIO;
+    if (!uring_unavailable) {
+        if (uring_init(&afd->ring, ASYNC_QUEUE_DEPTH)) {
+            afd->backend = ASYNC_BACKEND_URING;
+        } else {
+            uprintf("Note: io_uring is not available (%s) - Using POSIX aio", strerror(errno));
+            uring_unavailable = TRUE;
+        }
+    }
     return afd;
 }
 
-#define _IO_FUNC_GEN(IO_FUNC_NAME, BYTES_COUNT)\
-    if (aio_error(&h->cb) == EINPROGRESS){\
-        fprintf(stderr, "ERROR: " STRINGIFY(IO_FUNC_NAME) "() attempted while still preforming operation!\n");\
-        return 0;\
-    }\
-    int r = aio_return(&h->cb);\
-    if (r > 0)\
-        h->offset += r; \
-    \
-    memset(&h->cb, 0, sizeof(struct aiocb));\
-    h->cb.aio_fildes = h->fd;\
-    h->cb.aio_buf = lpBuffer;\
-    h->cb.aio_nbytes = BYTES_COUNT;\
-    h->cb.aio_offset = h->offset;\
-    if (-1 == IO_FUNC_NAME(&h->cb))\
-        return 0;\
-    \
-    int stat = aio_error(&h->cb);\
-    if (stat == 0 || stat == EINPROGRESS)\
-        return 1;\
-    \
-    return 0;
+/* Queue a new read or write request at the current offset */
+static BOOL QueueFileAsync(ASYNC_FD* h, LPVOID lpBuffer, DWORD nNumberOfBytes, BOOL write){
+    ASYNC_REQ* r;
+    unsigned slot;
+    int buf_index = -1;
+    uint8_t opcode;
 
+    if (h == NULL)
+        return FALSE;
+    if (h->count >= ASYNC_QUEUE_DEPTH){
+        errno = EBUSY;
+        return FALSE;
+    }
+    slot = (h->head + h->count) % ASYNC_QUEUE_DEPTH;
+    r = &h->req[slot];
+    memset(r, 0, sizeof(ASYNC_REQ));
+    r->offset = h->offset;
+    r->iov.iov_base = lpBuffer;
+    r->iov.iov_len = nNumberOfBytes;
 
-BOOL ReadFileAsync(ASYNC_FD* h, LPVOID lpBuffer, DWORD nNumberOfBytesToRead){
-    _IO_FUNC_GEN(aio_read, nNumberOfBytesToRead);
+    if (h->backend == ASYNC_BACKEND_URING){
+        if (h->fixed_buf != NULL && (uint8_t*)lpBuffer >= h->fixed_buf &&
+            (uint8_t*)lpBuffer + nNumberOfBytes <= h->fixed_buf + h->fixed_len)
+            buf_index = 0;
+        if (write)
+            opcode = (buf_index >= 0) ? IORING_OP_WRITE_FIXED : IORING_OP_WRITEV;
+        else
+            opcode = (buf_index >= 0) ? IORING_OP_READ_FIXED : IORING_OP_READV;
+        if (!uring_submit(&h->ring, opcode, h->fd, r, slot, buf_index))
+            return FALSE;
+    } else {
+        r->cb.aio_fildes = h->fd;
+        r->cb.aio_buf = lpBuffer;
+        r->cb.aio_nbytes = nNumberOfBytes;
+        r->cb.aio_offset = r->offset;
+        if ((write ? aio_write(&r->cb) : aio_read(&r->cb)) == -1)
+            return FALSE;
+    }
+
+    r->pending = TRUE;
+    h->offset += nNumberOfBytes;
+    h->count++;
+    return TRUE;
 }
 
-BOOL WriteFileAsync(ASYNC_FD* h, LPVOID lpBuffer, DWORD nNumberOfBytesToWrite){
-    _IO_FUNC_GEN(aio_write, nNumberOfBytesToWrite);
+BOOL ReadFileAsync(void* h, LPVOID lpBuffer, DWORD nNumberOfBytesToRead){
+    return QueueFileAsync((ASYNC_FD*)h, lpBuffer, nNumberOfBytesToRead, FALSE);
 }
 
+BOOL WriteFileAsync(void* h, LPVOID lpBuffer, DWORD nNumberOfBytesToWrite){
+    return QueueFileAsync((ASYNC_FD*)h, lpBuffer, nNumberOfBytesToWrite, TRUE);
+}
 
-BOOL WaitFileAsync(ASYNC_FD* h, DWORD dwTimeout){
-    const struct aiocb* cblist[1] = { &h->cb };
+/* Wait for the oldest in-flight request */
+BOOL WaitFileAsync(void* _h, DWORD dwTimeout){
+    ASYNC_FD* h = (ASYNC_FD*)_h;
+    ASYNC_REQ* r;
+    ULONGLONG deadline = GetTickCount64() + dwTimeout;
 
-    struct timespec timeout;
-    timeout.tv_sec = dwTimeout / 1000;
-    timeout.tv_nsec = (dwTimeout % 1000) * 1000000000;
+    if (h == NULL || h->count == 0)
+        return 0;
+    r = &h->req[h->head];
 
-    // Wait until the asynchronous operation completes or timeout occurs.
-    if (aio_suspend(cblist, 1, &timeout) == -1)
-        return 0;  // Timeout or error occurred
+    if (h->backend == ASYNC_BACKEND_URING){
+        struct pollfd pfd = { h->ring.fd, POLLIN, 0 };
+        uring_reap(h);
+        while (!r->completed){
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline){
+                errno = ETIMEDOUT;
+                return 0;
+            }
+            if (poll(&pfd, 1, (int)(deadline - now)) < 0 && errno != EINTR)
+                return 0;
+            uring_reap(h);
+        }
+        if (r->result < 0){
+            errno = -r->result;
+            return 0;
+        }
+        return 1;
+    } else {
+        const struct aiocb* cblist[1] = { &r->cb };
+        struct timespec timeout;
+        int status;
 
-    int status = aio_error(&h->cb);
-    if (status == EINPROGRESS)
-        return 0;
+        timeout.tv_sec = dwTimeout / 1000;
+        timeout.tv_nsec = (dwTimeout % 1000) * 1000000;
 
-    return (status == 0);
+        // Wait until the asynchronous operation completes or timeout occurs.
+        while (aio_error(&r->cb) == EINPROGRESS){
+            if (aio_suspend(cblist, 1, &timeout) == -1 && errno != EINTR)
+                return 0;  // Timeout or error occurred
+        }
+        status = aio_error(&r->cb);
+        if (status != 0){
+            errno = status;
+            return 0;
+        }
+        return 1;
+    }
+}
+
+/* Retire the oldest in-flight request and return the number of bytes it transferred */
+BOOL GetSizeAsync(void* _h, LPDWORD lpNumberOfBytes){
+    ASYNC_FD* h = (ASYNC_FD*)_h;
+    ASYNC_REQ* r;
+    ssize_t res;
+
+    *lpNumberOfBytes = 0;
+    if (h == NULL || h->count == 0){
+        errno = ENODATA;
+        return 0;
+    }
+    r = &h->req[h->head];
+    if (h->backend == ASYNC_BACKEND_URING){
+        if (!r->completed){
+            errno = EINPROGRESS;
+            return 0;
+        }
+        res = r->result;
+    } else {
+        if (aio_error(&r->cb) == EINPROGRESS){
+            errno = EINPROGRESS;
+            return 0;
+        }
+        res = aio_return(&r->cb);
+        if (res < 0)
+            res = -aio_error(&r->cb);
+    }
+    r->pending = FALSE;
+    h->head = (h->head + 1) % ASYNC_QUEUE_DEPTH;
+    h->count--;
+    if (res < 0){
+        errno = (int)-res;
+        return 0;
+    }
+    *lpNumberOfBytes = (DWORD)res;
+    return 1;
 }
 
+DWORD GetQueueDepthAsync(void* h){
+    return (h == NULL) ? 0 : ASYNC_QUEUE_DEPTH;
+}
 
-// Not actually async
-BOOL GetSizeAsync(ASYNC_FD* h, LPDWORD lpNumberOfBytes){
-    int r = aio_return(&h->cb);
-    if (r > 0)
-        h->offset += r;
-    
-    memset(&h->cb, 0, sizeof(struct aiocb));
+BOOL RegisterBufferAsync(void* _h, LPVOID lpBuffer, DWORD dwBufferSize){
+    ASYNC_FD* h = (ASYNC_FD*)_h;
+    struct iovec iov = { lpBuffer, dwBufferSize };
 
-    *lpNumberOfBytes = h->offset;
+    if (h == NULL)
+        return 0;
+    // Fixed buffers are an io_uring optimization only, and can't be changed with requests in flight
+    if (h->backend != ASYNC_BACKEND_URING || h->count != 0)
+        return 1;
+    if (h->fixed_buf != NULL){
+        sys_io_uring_register(h->ring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        h->fixed_buf = NULL;
+        h->fixed_len = 0;
+    }
+    if (lpBuffer == NULL || dwBufferSize == 0)
+        return 1;
+    // This can fail if the buffer exceeds RLIMIT_MEMLOCK, in which case we just use regular reads
+    if (sys_io_uring_register(h->ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0){
+        uprintf("Note: Could not register I/O buffer with io_uring: %s", strerror(errno));
+        return 1;
+    }
+    h->fixed_buf = (uint8_t*)lpBuffer;
+    h->fixed_len = dwBufferSize;
     return 1;
 }
 
+void CloseFileAsync(void* _h){
+    ASYNC_FD* h = (ASYNC_FD*)_h;
+    DWORD size;
 
-void CloseFileAsync(ASYNC_FD* h){
-    if (!h) return;
+    if (h == NULL || h == INVALID_HANDLE_VALUE) return;
+    // Don't release buffers the kernel may still be writing into
+    while (h->count > 0){
+        if (!WaitFileAsync(h, DRIVE_ACCESS_TIMEOUT) && h->backend == ASYNC_BACKEND_AIO){
+            aio_cancel(h->fd, &h->req[h->head].cb);
+            WaitFileAsync(h, DRIVE_ACCESS_TIMEOUT);
+        }
+        if (!GetSizeAsync(h, &size) && errno == EINPROGRESS)
+            break;
+    }
+    if (h->backend == ASYNC_BACKEND_URING)
+        uring_exit(&h->ring);
     close(h->fd);
     free(h);
 }
+
+BOOL ZeroFileRange(HANDLE handle, uint64_t offset, uint64_t size){
+    FILE* f = (FILE*)handle;
+    struct stat st;
+    uint64_t range[2] = { offset, size };
+    int fd, r = -1;
+
+    if (f == NULL || f == INVALID_HANDLE_VALUE){
+        errno = EINVAL;
+        return 0;
+    }
+    // Anything still sitting in the stdio buffer must reach the target first
+    if (fflush(f) != 0)
+        return 0;
+    fd = fileno(f);
+    if (fstat(fd, &st) != 0)
+        return 0;
+
+    if (S_ISBLK(st.st_mode)){
+        // Unlike BLKDISCARD, this guarantees that the range reads back as zeroes, while
+        // still letting the kernel use WRITE ZEROES/UNMAP when the device supports it.
+        r = ioctl(fd, BLKZEROOUT, range);
+    } else if (S_ISREG(st.st_mode)){
+        r = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)size);
+        // Punching holes doesn't extend the file, so do it ourselves
+        if (r == 0 && (uint64_t)st.st_size < offset + size)
+            r = ftruncate(fd, (off_t)(offset + size));
+    } else {
+        errno = EOPNOTSUPP;
+    }
+    if (r != 0)
+        return 0;
+    return fseeko(f, (off_t)(offset + size), SEEK_SET) == 0;
+}
@@ -32,22 +32,29 @@ extern char* ini_file;
 #define SETTING_ADVANCED_MODE_DEVICE        "ShowAdvancedDriveProperties"
 #define SETTING_ADVANCED_MODE_FORMAT        "ShowAdvancedFormatOptions"
 #define SETTING_COMM_CHECK                  "CommCheck64"
+#define SETTING_DD_BUFFER_COUNT             "DdBufferCount"
 #define SETTING_DEFAULT_THREAD_PRIORITY     "DefaultThreadPriority"
 #define SETTING_DISABLE_FAKE_DRIVES_CHECK   "DisableFakeDrivesCheck"
+#define SETTING_DISABLE_ISO_SCAN_CACHE      "DisableIsoScanCache"
 #define SETTING_DISABLE_LGP                 "DisableLGP"
 #define SETTING_DISABLE_RUFUS_MBR           "DisableRufusMBR"
 #define SETTING_DISABLE_SECURE_BOOT_NOTICE  "DisableSecureBootNotice"
 #define SETTING_DISABLE_VHDS                "DisableVHDs"
 #define SETTING_ENABLE_EXTRA_HASHES         "EnableExtraHashes"
 #define SETTING_ENABLE_FILE_INDEXING        "EnableFileIndexing"
+#define SETTING_ENABLE_ISO_MMAP             "EnableIsoMemoryMapping"
 #define SETTING_ENABLE_RUNTIME_VALIDATION   "EnableRuntimeValidation"
 #define SETTING_ENABLE_USB_DEBUG            "EnableUsbDebug"
 #define SETTING_ENABLE_VMDK_DETECTION       "EnableVmdkDetection"
 #define SETTING_ENABLE_WIN_DUAL_EFI_BIOS    "EnableWindowsDualUefiBiosMode"
 #define SETTING_EXPERT_MODE                 "ExpertMode"
 #define SETTING_FORCE_LARGE_FAT32_FORMAT    "ForceLargeFat32Formatting"
+#define SETTING_HASH_BUFFER_SIZE            "HashBufferSize"
+#define SETTING_HASH_ON_WRITE               "HashOnWrite"
 #define SETTING_IGNORE_BOOT_MARKER          "IgnoreBootMarker"
 #define SETTING_INCLUDE_BETAS               "CheckForBetas"
+#define SETTING_ISO_COPY_BUFFER_SIZE        "IsoCopyBufferSize"
+#define SETTING_ISO_COPY_THREADS            "IsoCopyThreads"
 #define SETTING_LAST_UPDATE                 "LastUpdateCheck"
 #define SETTING_LOCALE                      "Locale"
 #define SETTING_UPDATE_INTERVAL             "UpdateCheckInterval"
@@ -58,7 +65,10 @@ extern char* ini_file;
 #define SETTING_PERSISTENT_LOG              "PersistentLog"
 #define SETTING_PREFERRED_SAVE_IMAGE_TYPE   "PreferredSaveImageType"
 #define SETTING_PRESERVE_TIMESTAMPS         "PreserveTimestamps"
+#define SETTING_READ_BACK_ON_WRITE          "ReadBackOnWrite"
+#define SETTING_SPARSE_WRITE                "SparseWrite"
 #define SETTING_VERBOSE_UPDATES             "VerboseUpdateCheck"
+#define SETTING_VERIFY_AFTER_WRITE          "VerifyAfterWrite"
 #define SETTING_WUE_OPTIONS                 "WindowsUserExperienceOptions"
 
 
@@ -55,28 +55,28 @@ uint32_t LIBFAT_SECTOR_MASK = 511;
 /*
  * Wrapper for ReadFile suitable for libfat
  */
-int libfat_readfile(intptr_t pp, void *buf, size_t secsize, libfat_sector_t sector)
+int libfat_readfile(intptr_t pp, void *buf, size_t size, libfat_sector_t sector)
 {
 	LARGE_INTEGER offset;
 	DWORD bytes_read;
 
-	offset.QuadPart = (LONGLONG) sector * secsize;
+	offset.QuadPart = (LONGLONG) sector * LIBFAT_SECTOR_SIZE;
 	if (!SetFilePointerEx((HANDLE) pp, offset, NULL, FILE_BEGIN)) {
 		uprintf("Could not set pointer to position %llu: %s", offset.QuadPart, WindowsErrorString());
 		return 0;
 	}
 
-	if (!ReadFile((HANDLE) pp, buf, (DWORD) secsize, &bytes_read, NULL)) {
+	if (!ReadFile((HANDLE) pp, buf, (DWORD) size, &bytes_read, NULL)) {
 		uprintf("Could not read sector %llu: %s", sector, WindowsErrorString());
 		return 0;
 	}
 
-	if (bytes_read != secsize) {
-		uprintf("Sector %llu: Read %lu bytes instead of %zu requested", sector, bytes_read, secsize);
+	if (bytes_read != size) {
+		uprintf("Sector %llu: Read %lu bytes instead of %zu requested", sector, bytes_read, size);
 		return 0;
 	}
 
-	return (int)secsize;
+	return (int)size;
 }
 
 /*
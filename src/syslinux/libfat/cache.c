@@ -13,13 +13,89 @@
 /*
  * cache.c
  *
- * Simple sector cache
+ * Hashed LRU sector cache
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 #include "libfatint.h"
 
+static __inline unsigned int hash_sector(libfat_sector_t n)
+{
+    return (unsigned int)((n * 0x9E3779B97F4A7C15ULL) >> 32) & (LIBFAT_CACHE_BUCKETS - 1);
+}
+
+static struct libfat_sector *find_sector(struct libfat_filesystem *fs, libfat_sector_t n)
+{
+    struct libfat_sector *ls;
+
+    for (ls = fs->sectors[hash_sector(n)]; ls; ls = ls->next) {
+	if (ls->n == n)
+	    return ls;
+    }
+    return NULL;
+}
+
+static void lru_unlink(struct libfat_filesystem *fs, struct libfat_sector *ls)
+{
+    if (ls->lru_prev)
+	ls->lru_prev->lru_next = ls->lru_next;
+    else
+	fs->lru_head = ls->lru_next;
+    if (ls->lru_next)
+	ls->lru_next->lru_prev = ls->lru_prev;
+    else
+	fs->lru_tail = ls->lru_prev;
+}
+
+static void lru_push(struct libfat_filesystem *fs, struct libfat_sector *ls)
+{
+    ls->lru_prev = NULL;
+    ls->lru_next = fs->lru_head;
+    if (fs->lru_head)
+	fs->lru_head->lru_prev = ls;
+    else
+	fs->lru_tail = ls;
+    fs->lru_head = ls;
+}
+
+static void hash_unlink(struct libfat_filesystem *fs, struct libfat_sector *ls)
+{
+    struct libfat_sector **pls;
+
+    for (pls = &fs->sectors[hash_sector(ls->n)]; *pls; pls = &(*pls)->next) {
+	if (*pls == ls) {
+	    *pls = ls->next;
+	    break;
+	}
+    }
+}
+
+/*
+ * Get a cache entry for a new sector, recycling the least recently used
+ * one if the cache is full. The entry is not in the hash or LRU lists.
+ */
+static struct libfat_sector *alloc_sector(struct libfat_filesystem *fs)
+{
+    struct libfat_sector *ls;
+
+    if (fs->nsectors < LIBFAT_CACHE_SECTORS) {
+	ls = _mm_malloc(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE, 16);
+	if (ls) {
+	    fs->nsectors++;
+	    return ls;
+	}
+	if (!fs->lru_tail)
+	    return NULL;	/* Can't allocate memory */
+    }
+
+    ls = fs->lru_tail;
+    lru_unlink(fs, ls);
+    hash_unlink(fs, ls);
+    return ls;
+}
+
 /*
  * NB: We need to align our sector buffers to at least the 8-byte mark, as some Windows
  * disk devices, notably O2Micro PCI-E SD card readers, return ERROR_INVALID_PARAMETER
@@ -27,36 +103,61 @@
  * For good measure, we'll go further and align our buffers on a 16-byte boundary.
  * Also, since struct libfat_sector's data[0] is our buffer, this means we must BOTH
  * align that member in the struct declaration, and use aligned malloc/free.
+ *
+ * The pointer we return remains valid until LIBFAT_CACHE_SECTORS - LIBFAT_READAHEAD
+ * other sectors have been requested.
  */
 void *libfat_get_sector(struct libfat_filesystem *fs, libfat_sector_t n)
 {
     struct libfat_sector *ls;
+    char *buf;
+    size_t i, count = 1;
 
-    for (ls = fs->sectors; ls; ls = ls->next) {
-	if (ls->n == n)
-	    return ls->data;	/* Found in cache */
+    ls = find_sector(fs, n);
+    if (ls) {
+	/* Found in cache */
+	if (ls != fs->lru_head) {
+	    lru_unlink(fs, ls);
+	    lru_push(fs, ls);
+	}
+	return ls->data;
     }
 
-    /* Not found in cache */
-    ls = _mm_malloc(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE, 16);
-    if (!ls) {
-	libfat_flush(fs);
-	ls = _mm_malloc(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE, 16);
-
-	if (!ls)
-	    return NULL;	/* Can't allocate memory */
-    }
+    /*
+     * Not found in cache => Read the sector, along with the uncached ones
+     * that follow it, as directory and FAT chain walks are mostly sequential.
+     * The end of the filesystem is unknown until libfat_open() has read the
+     * boot sector, in which case we read a single sector.
+     */
+    buf = fs->readahead;
+    while ((count < LIBFAT_READAHEAD) && (n + count < fs->end) &&
+	   !find_sector(fs, n + count))
+	count++;
+    if ((count > 1) && (fs->read(fs->readptr, buf, count * LIBFAT_SECTOR_SIZE, n)
+	!= (int)(count * LIBFAT_SECTOR_SIZE)))
+	count = 1;	/* Retry with the requested sector only */
+    if ((count == 1) && (fs->read(fs->readptr, buf, LIBFAT_SECTOR_SIZE, n)
+	!= (int)LIBFAT_SECTOR_SIZE))
+	return NULL;	/* I/O error */
 
-    if (fs->read(fs->readptr, ls->data, LIBFAT_SECTOR_SIZE, n)
-	!= LIBFAT_SECTOR_SIZE) {
-	_mm_free(ls);
-	return NULL;		/* I/O error */
+    /*
+     * Insert the sectors last to first, so that the requested one
+     * ends up as the most recently used.
+     */
+    for (i = count; i-- > 0; ) {
+	ls = alloc_sector(fs);
+	if (!ls) {
+	    if (i == 0)
+		return NULL;	/* Can't allocate memory */
+	    continue;
+	}
+	memcpy(ls->data, &buf[i * LIBFAT_SECTOR_SIZE], LIBFAT_SECTOR_SIZE);
+	ls->n = n + i;
+	ls->next = fs->sectors[hash_sector(ls->n)];
+	fs->sectors[hash_sector(ls->n)] = ls;
+	lru_push(fs, ls);
     }
 
-    ls->n = n;
-    ls->next = fs->sectors;
-    fs->sectors = ls;
-
     return ls->data;
 }
 
@@ -64,11 +165,13 @@ void libfat_flush(struct libfat_filesystem *fs)
 {
     struct libfat_sector *ls, *lsnext;
 
-    lsnext = fs->sectors;
-    fs->sectors = NULL;
+    lsnext = fs->lru_head;
+    fs->lru_head = fs->lru_tail = NULL;
+    memset(fs->sectors, 0, sizeof(fs->sectors));
+    fs->nsectors = 0;
 
     for (ls = lsnext; ls; ls = lsnext) {
-	lsnext = ls->next;
+	lsnext = ls->lru_next;
 	_mm_free(ls);
     }
 }
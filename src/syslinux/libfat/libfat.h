@@ -54,12 +54,13 @@ typedef struct libfat_diritem {
 /*
  * Open the filesystem.  The readfunc is the function to read
  * sectors, in the format:
- * int readfunc(intptr_t readptr, void *buf, size_t secsize,
+ * int readfunc(intptr_t readptr, void *buf, size_t size,
  *              libfat_sector_t secno)
  *
- * ... where readptr is a private argument.
+ * ... where readptr is a private argument, and size is a multiple
+ * of LIBFAT_SECTOR_SIZE, as consecutive sectors may be read at once.
  *
- * A return value of != secsize is treated as error.
+ * A return value of != size is treated as error.
  */
 struct libfat_filesystem
     *libfat_open(int (*readfunc) (intptr_t, void *, size_t, libfat_sector_t),
@@ -87,7 +88,9 @@ libfat_sector_t libfat_nextsector(struct libfat_filesystem *fs,
 void libfat_flush(struct libfat_filesystem *fs);
 
 /*
- * Get a pointer to a specific sector.
+ * Get a pointer to a specific sector. The data is cached and remains
+ * valid until many other sectors have been requested or the cache is
+ * flushed.
  */
 void *libfat_get_sector(struct libfat_filesystem *fs, libfat_sector_t n);
 
@@ -36,9 +36,20 @@
 #endif
 
 
+/*
+ * The sector cache holds up to LIBFAT_CACHE_SECTORS sectors, indexed by a
+ * hash of their number and evicted in least recently used order. On a miss,
+ * up to LIBFAT_READAHEAD consecutive uncached sectors are read at once.
+ */
+#define LIBFAT_CACHE_SECTORS	1024
+#define LIBFAT_CACHE_BUCKETS	256	/* Must be a power of 2 */
+#define LIBFAT_READAHEAD	16
+
 ALIGN_START(16) struct libfat_sector {
 	libfat_sector_t n;		/* Sector number */
-	struct libfat_sector *next;	/* Next in list */
+	struct libfat_sector *next;	/* Next in hash bucket */
+	struct libfat_sector *lru_prev;	/* More recently used */
+	struct libfat_sector *lru_next;	/* Less recently used */
 	/* data[0] MUST be aligned to at least 8 bytes - see cache.c */
 	ALIGN_START(16) char data[0] ALIGN_END(16);
 } ALIGN_END(16);
@@ -64,7 +75,11 @@ struct libfat_filesystem {
     libfat_sector_t data;	/* Start of data area */
     libfat_sector_t end;	/* End of filesystem */
 
-    struct libfat_sector *sectors;
+    struct libfat_sector *sectors[LIBFAT_CACHE_BUCKETS];
+    struct libfat_sector *lru_head;	/* Most recently used */
+    struct libfat_sector *lru_tail;	/* Least recently used */
+    unsigned int nsectors;		/* Number of cached sectors */
+    void *readahead;			/* LIBFAT_READAHEAD sectors buffer */
 };
 
 #endif /* LIBFATINT_H */
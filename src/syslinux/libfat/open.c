@@ -31,11 +31,14 @@ libfat_open(int (*readfunc) (intptr_t, void *, size_t, libfat_sector_t),
     uint32_t sectors, fatsize, minfatsize, rootdirsize;
     uint32_t nclusters;
 
-    fs = malloc(sizeof(struct libfat_filesystem));
+    /* NB: fs->end must be zero until we have read the boot sector */
+    fs = calloc(1, sizeof(struct libfat_filesystem));
     if (!fs)
 	goto barf;
 
-    fs->sectors = NULL;
+    fs->readahead = _mm_malloc((size_t)LIBFAT_READAHEAD * LIBFAT_SECTOR_SIZE, 16);
+    if (!fs->readahead)
+	goto barf;
     fs->read = readfunc;
     fs->readptr = readptr;
 
@@ -106,12 +109,14 @@ libfat_open(int (*readfunc) (intptr_t, void *, size_t, libfat_sector_t),
 
 barf:
     if (fs)
-	free(fs);
+	libfat_close(fs);
     return NULL;
 }
 
 void libfat_close(struct libfat_filesystem *fs)
 {
     libfat_flush(fs);
+    if (fs->readahead)
+	_mm_free(fs->readahead);
     free(fs);
 }
@@ -132,9 +132,10 @@ static int8_t IsCompressedBootableImage(const char* path)
 				return 0;
 			ErrorStatus = 0;
 			if (img_report.compression_type < BLED_COMPRESSION_MAX) {
-				bled_init(0, uprintf, NULL, NULL, NULL, NULL, &ErrorStatus);
-				dc = bled_uncompress_to_buffer(path, (char*)buf, MBR_SIZE, file_assoc[i].type);
-				bled_exit();
+				// Use our own context, so that images can be probed concurrently
+				bled_ctx_t* ctx = bled_ctx_create(0, uprintf, NULL, NULL, NULL, NULL, &ErrorStatus);
+				dc = bled_ctx_uncompress_to_buffer(ctx, path, (char*)buf, MBR_SIZE, file_assoc[i].type);
+				bled_ctx_destroy(ctx);
 			} else if (img_report.compression_type == BLED_COMPRESSION_MAX) {
 				// Dism, through FfuProvider.dll, can mount a .ffu as a physicaldrive, which we
 				// could then use to poke the MBR as we do for VHD... Except Microsoft did design
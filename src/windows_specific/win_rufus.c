@@ -93,11 +93,13 @@ static unsigned int timer;
 static char uppercase_select[2][64], uppercase_start[64], uppercase_close[64], uppercase_cancel[64];
 
 extern HANDLE update_check_thread, wim_thread;
-extern BOOL enable_iso, enable_joliet, enable_rockridge, enable_extra_hashes, is_bootloader_revoked;
-extern BOOL validate_md5sum, cpu_has_sha1_accel, cpu_has_sha256_accel;
+extern BOOL enable_iso, enable_joliet, enable_rockridge, enable_iso_scan_cache, enable_iso_mmap, enable_extra_hashes, is_bootloader_revoked;
+extern BOOL validate_md5sum, cpu_has_sha1_accel, cpu_has_sha256_accel, sparse_write;
+extern BOOL hash_on_write, read_back_on_write, verify_after_write;
 extern BYTE* fido_script;
 extern HWND hFidoDlg;
 extern uint8_t* grub2_buf;
+extern uint32_t dd_buffer_count, hash_buffer_size, iso_copy_threads, iso_copy_buffer_size;
 extern long grub2_len;
 extern char* szStatusMessage;
 extern const char* old_c32_name[NB_OLD_C32];
@@ -3554,10 +3556,17 @@ skip_args_processing:
 	enable_vmdk = ReadSettingBool(SETTING_ENABLE_VMDK_DETECTION);
 	enable_file_indexing = ReadSettingBool(SETTING_ENABLE_FILE_INDEXING);
 	enable_VHDs = !ReadSettingBool(SETTING_DISABLE_VHDS);
+	enable_iso_scan_cache = !ReadSettingBool(SETTING_DISABLE_ISO_SCAN_CACHE);
+	enable_iso_mmap = ReadSettingBool(SETTING_ENABLE_ISO_MMAP);
 	enable_extra_hashes = ReadSettingBool(SETTING_ENABLE_EXTRA_HASHES);
 	expert_mode = ReadSettingBool(SETTING_EXPERT_MODE);
 	ignore_boot_marker = ReadSettingBool(SETTING_IGNORE_BOOT_MARKER);
 	persistent_log = ReadSettingBool(SETTING_PERSISTENT_LOG);
+	sparse_write = ReadSettingBool(SETTING_SPARSE_WRITE);
+	// Reading back requires the digests of what we wrote
+	read_back_on_write = ReadSettingBool(SETTING_READ_BACK_ON_WRITE);
+	hash_on_write = read_back_on_write || ReadSettingBool(SETTING_HASH_ON_WRITE);
+	verify_after_write = ReadSettingBool(SETTING_VERIFY_AFTER_WRITE);
 	save_image_type = ReadSettingStr(SETTING_PREFERRED_SAVE_IMAGE_TYPE);
 	// This restores the Windows User Experience/unattend.xml mask from the saved user
 	// settings, and is designed to work even if we add new options later.
@@ -3569,6 +3578,19 @@ skip_args_processing:
 	}
 	// We want above normal priority by default, so we offset the value.
 	default_thread_priority = ReadSetting32(SETTING_DEFAULT_THREAD_PRIORITY) + THREAD_PRIORITY_ABOVE_NORMAL;
+	// Number of buffers for the DD write pipeline. More buffers allow deeper read queues.
+	dd_buffer_count = ReadSetting32(SETTING_DD_BUFFER_COUNT);
+	if (dd_buffer_count == 0)
+		dd_buffer_count = DD_PIPELINE_BUFFERS;
+	// Size of the multi-hash engine buffers, in KB
+	hash_buffer_size = ReadSetting32(SETTING_HASH_BUFFER_SIZE) * KB;
+	if (hash_buffer_size == 0)
+		hash_buffer_size = HASH_BUFFER_SIZE;
+	// Number of threads (0 for automatic) and size of the buffers, in KB, used to copy ISO files
+	iso_copy_threads = ReadSetting32(SETTING_ISO_COPY_THREADS);
+	iso_copy_buffer_size = ReadSetting32(SETTING_ISO_COPY_BUFFER_SIZE) * KB;
+	if (iso_copy_buffer_size == 0)
+		iso_copy_buffer_size = ISO_COPY_BUFFER_SIZE;
 
 	// Initialize the global scaling, in case we need it before we initialize the dialog
 	hDC = GetDC(NULL);
@@ -176,3 +176,90 @@ BOOL GetSizeAsync(HANDLE h, LPDWORD lpNumberOfBytes)
 	fd->Overlapped.Offset += *lpNumberOfBytes;
 	return TRUE;
 }
+
+/// <summary>
+/// Return the maximum number of read or write operations that can be in flight at once
+/// for an asynchronous handle.
+/// </summary>
+/// <param name="h">An async handle, created by a call to CreateFileAsync()</param>
+/// <returns>The queue depth, or 0 on error</returns>
+DWORD GetQueueDepthAsync(HANDLE h)
+{
+	// We only have the one OVERLAPPED per handle
+	return (h == NULL) ? 0 : 1;
+}
+
+/// <summary>
+/// Register a buffer that all subsequent asynchronous I/O will be using.
+/// This is a no-op on Windows.
+/// </summary>
+/// <param name="h">An async handle, created by a call to CreateFileAsync()</param>
+/// <param name="lpBuffer">The buffer to register, or NULL to unregister</param>
+/// <param name="dwBufferSize">The size of the buffer</param>
+/// <returns>TRUE on success, FALSE on error</returns>
+BOOL RegisterBufferAsync(HANDLE h, LPVOID lpBuffer, DWORD dwBufferSize)
+{
+	return (h != NULL);
+}
+
+// Size of the chunks ZeroFileRange() reads back from devices
+#define ZERO_RANGE_CHUNK_SIZE (1024 * 1024)
+
+/// <summary>
+/// Zero a range of a file or device, with as little data transferred as possible.
+/// Files get the range deallocated with FSCTL_SET_ZERO_DATA. Windows has no equivalent
+/// of BLKZEROOUT for physical drives (TRIM does not guarantee that the sectors read back
+/// as zero), so for these, the range is read back and only the chunks that aren't zeroed
+/// already get written, since reading from flash media is a lot faster than writing.
+/// On success, the file pointer is moved to the end of the range.
+/// </summary>
+/// <param name="h">A regular (non async) file or device handle</param>
+/// <param name="offset">The start of the range, which must be aligned to the sector size for devices</param>
+/// <param name="size">The size of the range, which must be a multiple of the sector size for devices</param>
+/// <returns>TRUE on success, FALSE on error</returns>
+BOOL ZeroFileRange(HANDLE h, uint64_t offset, uint64_t size)
+{
+	FILE_ZERO_DATA_INFORMATION fzdi;
+	LARGE_INTEGER li, file_size;
+	DWORD len, rw, i;
+	uint64_t pos;
+	uint64_t* buf;
+	BOOL r = FALSE;
+
+	fzdi.FileOffset.QuadPart = (LONGLONG)offset;
+	fzdi.BeyondFinalZero.QuadPart = (LONGLONG)(offset + size);
+	if (DeviceIoControl(h, FSCTL_SET_ZERO_DATA, &fzdi, sizeof(fzdi), NULL, 0, &rw, NULL)) {
+		// The range may extend past the end of the file, which FSCTL_SET_ZERO_DATA doesn't do
+		li.QuadPart = (LONGLONG)(offset + size);
+		if (!SetFilePointerEx(h, li, NULL, FILE_BEGIN))
+			return FALSE;
+		if (GetFileSizeEx(h, &file_size) && (file_size.QuadPart < li.QuadPart))
+			return SetEndOfFile(h);
+		return TRUE;
+	}
+
+	// This is page aligned, which satisfies the alignment requirements of unbuffered I/O
+	buf = VirtualAlloc(NULL, ZERO_RANGE_CHUNK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (buf == NULL)
+		return FALSE;
+	for (pos = 0; pos < size; pos += len) {
+		len = (DWORD)min(size - pos, ZERO_RANGE_CHUNK_SIZE);
+		li.QuadPart = (LONGLONG)(offset + pos);
+		if (!SetFilePointerEx(h, li, NULL, FILE_BEGIN) ||
+			!ReadFile(h, buf, len, &rw, NULL) || (rw != len))
+			goto out;
+		for (i = 0; (i < len / sizeof(uint64_t)) && (buf[i] == 0); i++);
+		if (i >= len / sizeof(uint64_t))
+			continue;
+		memset(buf, 0, len);
+		if (!SetFilePointerEx(h, li, NULL, FILE_BEGIN) ||
+			!WriteFile(h, buf, len, &rw, NULL) || (rw != len))
+			goto out;
+	}
+	li.QuadPart = (LONGLONG)(offset + size);
+	r = SetFilePointerEx(h, li, NULL, FILE_BEGIN);
+
+out:
+	VirtualFree(buf, 0, MEM_RELEASE);
+	return r;
+}